@@ -3,6 +3,7 @@
  *
  * Gani Raissov graissov
  */
+#define _GNU_SOURCE
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,15 +14,49 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 #include <errno.h>
+#include <spawn.h>
 #include "stdbool.h"
 #include "csapp.h"
 
+/* A fuzzing build (-DTSH_FUZZ, with libFuzzer) brings its own main */
+#ifdef TSH_FUZZ
+#define main tsh_main
+#endif
+
 /* Misc manifest constants */
-#define MAXLINE_TSH 1024 /* max line size */
-#define MAXARGS 128      /* max args on a command line */
-#define MAXJOBS 16       /* max jobs at any point in time */
+#define MAXLINE_TSH 1024 /* size of message and listing buffers */
+#define LINEBLOCK (1 << 13)   /* bytes per read() of interactive input */
+#define SCRIPTBLOCK (1 << 18) /* bytes per read() of a -f script */
+#define ARENACHUNK (1 << 14) /* smallest chunk the parse arena allocates */
+#define CAPTURE_MEM (1 << 16) /* output a background job keeps in memory */
+#define INITJOBS 16      /* initial number of job table slots */
 #define MAXJID 1 << 16   /* max job ID */
+#define NODEBITS 1024    /* NUMA nodes a placement can name */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -39,66 +74,802 @@
  * At most 1 job can be in the FG state.
  */
 
+/* Process states, for each process of a pipeline job */
+#define PROC_RUNNING 0 /* running (or not yet reported stopped) */
+#define PROC_STOPPED 1 /* stopped by a signal */
+#define PROC_DONE 2    /* exited or terminated, and reaped */
+
 /* Parsing states */
 #define ST_NORMAL 0x0  /* next token is an argument */
-#define ST_INFILE 0x1  /* next token is the input file */
-#define ST_OUTFILE 0x2 /* next token is the output file */
+#define ST_REDIR 0x1   /* next token is the file or fd of a redirection */
+
+/* Redirection ops */
+#define REDIR_IN 0      /* [n]< file */
+#define REDIR_OUT 1     /* [n]> file, created or truncated */
+#define REDIR_APPEND 2  /* [n]>> file, created or appended to */
+#define REDIR_RDWR 3    /* [n]<> file, opened for reading and writing */
+#define REDIR_DUP 4     /* [n]>&m or [n]<&m */
+#define REDIR_CLOSE 5   /* [n]>&- or [n]<&- */
+#define REDIR_HERE 6    /* <<< word or the body of a here-document */
+#define REDIR_HEREDOC 7 /* << delim, until read_heredocs() reads the body */
+
+/* Character classes for the tokenizer */
+#define TC_SPACE 0x1 /* argument delimiter (white-space) */
+#define TC_END 0x2   /* end of the command line */
+
+/* Orders in which captured background output is written (-o) */
+#define CAPTURE_OFF 0    /* background jobs write straight to stdout */
+#define CAPTURE_DONE 1   /* in the order the jobs finish */
+#define CAPTURE_SUBMIT 2 /* in the order the jobs were started */
+
+/* How parallel spreads its tasks (--spread) */
+#define SPREAD_NONE 0  /* tasks run wherever the scheduler puts them */
+#define SPREAD_CPUS 1  /* round-robin over the CPUs the shell may use */
+#define SPREAD_NODES 2 /* round-robin over the NUMA nodes, CPUs and memory */
+
+/* Limits a job was started with (limit) */
+#define LIMIT_CPU 0x1    /* RLIMIT_CPU */
+#define LIMIT_AS 0x2     /* RLIMIT_AS */
+#define LIMIT_NOFILE 0x4 /* RLIMIT_NOFILE */
+#define LIMIT_CGROUP 0x8 /* a cgroup of its own, with memory.max or cpu.max */
+
+/* Phases of the trace (-t, trace) */
+#define TR_EVAL 0   /* eval() of one command line */
+#define TR_PARSE 1  /* parseline() */
+#define TR_LAUNCH 2 /* launch() of one stage, arg the pid */
+#define TR_FORK 3   /* fork() */
+#define TR_EXEC 4   /* from fork() until the child has exec'd */
+#define TR_SPAWN 5  /* posix_spawn() */
+#define TR_WAITFG 6 /* waiting for a foreground job */
+#define TR_REAP 7   /* one pass of reap_children() */
+#define TR_CHILD 8  /* a child reaped, arg the pid (instant) */
+
+/* Record a trace event; nearly free when tracing is off */
+#define TRACE(phase, ph, arg)               \
+    do                                      \
+    {                                       \
+        if (trace_on)                       \
+            trace_event(phase, ph, arg);    \
+    } while (0)
+
+/* listjobs flags */
+#define LIST_VERBOSE 0x1 /* add each job's resource usage */
+#define LIST_JSON 0x2    /* one JSON array, for scripts */
+#define LIST_CHECK 0x4   /* check the table's invariants instead */
+#ifdef TSH_CHECK
+#define CHECK_OPTS "r:" /* a checked build can replay a trace */
+#else
+#define CHECK_OPTS ""
+#endif
+
+static const unsigned char tokclass[256] = {
+    ['\0'] = TC_END, [' '] = TC_SPACE, ['\t'] = TC_SPACE,
+    ['\r'] = TC_SPACE, ['\n'] = TC_SPACE};
 
 /* Global variables */
 extern char **environ;   /* defined in libc */
 char prompt[] = "tsh> "; /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;         /* if true, print additional output */
-int nextjid = 1;         /* next job ID to allocate */
+int use_spawn = 0;       /* if true, launch commands with posix_spawn */
+int sigchld_fd = -1;     /* signalfd reporting SIGCHLD, -1 with the handler */
+int capture_order = CAPTURE_OFF; /* how background output is buffered */
+volatile sig_atomic_t trace_on = 0; /* record trace events */
+volatile sig_atomic_t builtin_intr = 0; /* ctrl-c hit a builtin in the shell */
 char sbuf[MAXLINE_TSH];  /* for composing sprintf messages */
 
+/*
+ * Output that is put together piece by piece and written with as few
+ * write()s as possible: once when it is done, or whenever buf fills up.
+ * The buffer is the caller's, so it works in a handler too.
+ */
+struct outbuf
+{
+    char *buf;  /* where the output collects */
+    size_t cap; /* its size */
+    size_t len; /* bytes in it */
+    int fd;     /* where it goes */
+    int err;    /* a write failed */
+};
+
 struct job_t
 {                              /* The job struct */
-    pid_t pid;                 /* job PID */
+    pid_t pid;                 /* job PID (process group of the pipeline) */
     int jid;                   /* job ID [1, 2, ...] */
     int state;                 /* UNDEF, BG, FG, or ST */
-    char cmdline[MAXLINE_TSH]; /* command line */
+    int nprocs;                /* number of processes in the pipeline */
+    int nlive;                 /* processes not reaped yet */
+    int stopsig;               /* signal that last stopped a process */
+    int termsig;               /* signal that terminated a process, or 0 */
+    int status;                /* wait status of the last stage, once reaped */
+    pid_t *procs;              /* pids of the pipeline, procs[0] == pid */
+    char *pstate;              /* PROC_RUNNING, PROC_STOPPED or PROC_DONE */
+    int proccap;               /* allocated length of procs and pstate */
+    char *cmdline;             /* command line */
+    size_t cmdcap;             /* allocated size of cmdline */
+    int task;                  /* parallel task it runs, or -1 */
+    int memo;                  /* slot in memo_jobs it writes, or -1 */
+    int limits;                /* LIMIT_* bits it was started with */
+    rlim_t cpulimit;           /* its RLIMIT_CPU in seconds, with LIMIT_CPU */
+    int cgfd;                  /* its cgroup directory, or -1 */
+    char cgname[32];           /* name of that cgroup under cgroot_fd */
+    struct timespec start;     /* CLOCK_MONOTONIC time the job was added */
+    struct rusage ru;          /* summed usage of its reaped processes */
 };
-struct job_t job_list[MAXJOBS]; /* The job list */
 
-struct cmdline_tokens
+/*
+ * The job table. Jobs live in jobs[jid], so lookup by jid is a single
+ * index, and pids are mapped to jids through an open-addressed hash.
+ * The table only grows inside addjob(), which the main routine calls
+ * with SIGCHLD, SIGINT and SIGTSTP blocked; the handlers never allocate
+ * and only update slots in place, so they may safely use the table.
+ */
+struct jobtable
+{
+    struct job_t *jobs;   /* job slots, indexed by jid (slot 0 unused) */
+    int cap;              /* number of slots in jobs[] */
+    int maxjid;           /* largest allocated job ID, 0 if none */
+    pid_t *pidkey;        /* pid hash keys (PID_EMPTY, PID_DEAD or pid) */
+    int *pidjid;          /* pid hash values: the job ID owning the pid */
+    int pidcap;           /* number of hash buckets (a power of 2) */
+    int pidused;          /* live keys plus tombstones in the hash */
+    struct job_t *fg;     /* cached foreground job, NULL if none */
+    int fgstatus;         /* wait status of the last foreground job done */
+    struct rusage fgusage; /* resource usage of that job */
+};
+struct jobtable job_list; /* The job list */
+
+/*
+ * Job notifications ("Job [1] (42) terminated by signal 15") are queued
+ * by the reaper in a preallocated ring and written by the main loop
+ * before the next prompt. A run of notices alike in all but the job is
+ * kept as one, and printed as "37 jobs terminated by signal 15".
+ */
+#define NOTICE_RING 256 /* queued notices (a power of 2) */
+
+/* Kinds of notice */
+#define NOTE_TERM 0 /* terminated by a signal */
+#define NOTE_STOP 1 /* stopped by a signal */
+#define NOTE_MEM 2  /* killed by its memory limit */
+#define NOTE_CPU 3  /* killed by its CPU time limit */
+#define NOTE_AS 4   /* ran out of its address space limit, it seems */
+
+/* When notices are written */
+#define NOTIFY_DEFER 0 /* before the next prompt (default) */
+#define NOTIFY_NOW 1   /* as soon as the reaper finds them (-b) */
+#define NOTIFY_OFF 2   /* never (-q) */
+
+struct notice
+{
+    int kind;     /* NOTE_* */
+    int sig;      /* the signal, for NOTE_TERM and NOTE_STOP */
+    int jid;      /* the job, or the first of a run */
+    pid_t pid;    /* its process group */
+    unsigned n;   /* jobs in the run */
+};
+struct noticering
+{
+    struct notice ring[NOTICE_RING];
+    unsigned head;          /* next notice to write */
+    unsigned tail;          /* next free slot */
+    unsigned long dropped;  /* notices the ring had no room for */
+    int mode;               /* NOTIFY_* */
+};
+struct noticering notices; /* Job notifications not written yet */
+
+/*
+ * The environment. Its "NAME=value" strings are the shell's own, and
+ * vars, NULL-terminated, is the envp every command gets: it changes only
+ * when export or unset does, and environ points at it too, so getenv()
+ * sees the same variables. A command with VAR=value words before it gets
+ * a copy of the array with those entries patched.
+ */
+struct envstore
+{
+    char **vars; /* the variables, then NULL */
+    int n;       /* number of variables */
+    int cap;     /* allocated length of vars, NULL included */
+};
+struct envstore env_store; /* The environment */
+
+/* Markers for unused pid hash buckets */
+#define PID_EMPTY 0 /* never used */
+#define PID_DEAD -1 /* tombstone left by a deleted pid */
+
+/*
+ * The command hash remembers where PATH search found each command name,
+ * so a repeated command costs one lookup instead of a stat of every
+ * PATH directory. Entries are chained in CMDHASH_SIZE buckets.
+ */
+#define CMDHASH_SIZE 64 /* buckets in the command hash (a power of 2) */
+
+struct cmdhash_entry
 {
+    char *name;                /* command name as typed */
+    char *path;                /* where PATH search found it */
+    int hits;                  /* times the entry has been used */
+    struct cmdhash_entry *next; /* next entry in the bucket */
+};
+struct cmdhash_entry *cmdhash[CMDHASH_SIZE]; /* The command hash */
+
+struct redirection
+{              /* One redirection of a command */
+    int op;    /* REDIR_* */
+    int fd;    /* The descriptor it redirects */
+    int src;   /* REDIR_DUP: the descriptor copied; REDIR_HERE: a pipe or
+                  memfd made for it by the shell, or -1 */
+    char *word; /* The file, the here-document text or its delimiter */
+};
+
+struct cmdline_stage
+{                        /* One command of a pipeline */
     int argc;            /* Number of arguments */
-    char *argv[MAXARGS]; /* The arguments list */
-    char *infile;        /* The input file */
-    char *outfile;       /* The output file */
+    char **argv;         /* The arguments list, NULL-terminated */
+    int nredirs;         /* Number of redirections */
+    struct redirection *redirs; /* The redirections, applied in order */
+    int nassigns;        /* Number of VAR=value words before the command */
+    char **assigns;      /* Those words, set in its environment only */
     enum builtins_t
     { /* Indicates if argv[0] is a builtin command */
       BUILTIN_NONE,
       BUILTIN_QUIT,
       BUILTIN_JOBS,
       BUILTIN_BG,
-      BUILTIN_FG
+      BUILTIN_FG,
+      BUILTIN_HASH,
+      BUILTIN_CAT,
+      BUILTIN_TEE,
+      BUILTIN_PARALLEL,
+      BUILTIN_ULIMIT,
+      BUILTIN_BENCH,
+      BUILTIN_TRACE,
+      BUILTIN_WORKER,
+      BUILTIN_KILL,
+      BUILTIN_WAIT,
+      BUILTIN_EXPORT,
+      BUILTIN_UNSET,
+      BUILTIN_TIME,
+      BUILTIN_TASKSET,
+      BUILTIN_LIMIT,
+      BUILTIN_MEMO,
+      BUILTIN_REMOTE
     } builtins;
 };
 
+struct cmdline_tokens
+{
+    int nstages;                /* Number of pipeline stages */
+    struct cmdline_stage *stage; /* The commands, left to right */
+};
+
+/*
+ * The arena that parseline() carves its copy of the line and its token
+ * arrays from. Chunks never move and are kept when the arena is
+ * released, so after warm-up parsing allocates nothing. Releases follow
+ * a stack discipline (arena_mark/arena_release), so a command can be
+ * evaluated while an outer one still holds its tokens.
+ */
+struct arena_chunk
+{
+    struct arena_chunk *next; /* next chunk, allocated after this one */
+    size_t size;              /* bytes in data[] */
+    size_t used;              /* bytes of data[] handed out */
+    char data[];
+};
+
+struct arena
+{
+    struct arena_chunk *head; /* first chunk */
+    struct arena_chunk *cur;  /* chunk being allocated from */
+    void *last;               /* most recent allocation, may grow in place */
+};
+
+struct arena_mark
+{
+    struct arena_chunk *chunk; /* chunk that was current */
+    size_t used;               /* its fill level */
+};
+struct arena cmd_arena; /* The parse arena used by eval() */
+
+/* Where a job runs: CPU affinity and NUMA memory policy (taskset) */
+struct placement
+{
+    int has_cpus;  /* cpus is to be applied */
+    cpu_set_t cpus; /* CPUs the processes may run on */
+    int mpol;      /* MPOL_DEFAULT (leave alone), MPOL_BIND or MPOL_INTERLEAVE */
+    unsigned long nodes[NODEBITS / (8 * sizeof(unsigned long))]; /* mpol nodes */
+};
+
+/* Resource limits of a job (limit), applied in each of its children */
+struct limits
+{
+    int set;             /* LIMIT_* bits of what to apply */
+    rlim_t cpu;          /* CPU seconds */
+    rlim_t as;           /* address space bytes */
+    rlim_t nofile;       /* open files */
+    char memory_max[32]; /* memory.max of its cgroup, "" to leave alone */
+    char cpu_max[32];    /* cpu.max of its cgroup, "" to leave alone */
+    int cgfd;            /* the job's cgroup directory, or -1 */
+    char cgname[32];     /* name of that cgroup under cgroot_fd */
+};
+int cgroot_fd = -1; /* cgroup job cgroups are made in, once opened */
+
+/*
+ * A memoized command (memo). Its result, stdout and exit status, is
+ * kept in a cache directory under a hash of everything it depends on:
+ * the working directory, the program file, the arguments, the
+ * redirections and the declared inputs (files are known by device,
+ * inode, size and mtime). The entry holds that key material too, so a
+ * hash collision is a miss, not a wrong answer.
+ */
+struct memo_t
+{
+    char **inputs; /* files declared with -i */
+    int ninputs;   /* number of them */
+    char *key;     /* the key material, NUL-separated */
+    size_t keylen; /* its length */
+    char *path;    /* the cache entry */
+    char *tmp;     /* on a miss, the entry being written */
+    int fd;        /* that entry, or -1 */
+    int hit;       /* the result came from the cache */
+    int status;    /* the wait status it was served with, or ended with */
+    int done;      /* in memo_jobs, the job has ended */
+};
+
+/* A cache entry: this header, the key material, then the output */
+struct memo_header
+{
+    char magic[4];   /* MEMO_MAGIC */
+    uint32_t status; /* wait status of the command */
+    uint64_t keylen; /* bytes of key material */
+    uint64_t outlen; /* bytes of output */
+};
+#define MEMO_MAGIC "TSHM"
+#define MEMO_SIZE (64LL << 20) /* default byte bound of the cache */
+
+/* What memo has done, for memo without a command */
+struct memostats
+{
+    unsigned long hits;      /* results served from the cache */
+    unsigned long misses;    /* commands run and cached */
+    unsigned long uncached;  /* commands memo could not cache */
+    unsigned long evictions; /* entries dropped to stay in bounds */
+    long long bytes;         /* size of the cache, -1 until scanned */
+    long long limit;         /* its bound ($TSH_MEMO_SIZE) */
+    char *dir;               /* its directory, once set up */
+};
+struct memostats memo_stats = {.bytes = -1}; /* The memo cache */
+
+/*
+ * The entries of memoized commands that were stopped before they ended.
+ * The job keeps writing to its entry after fg or bg, so the entry stays
+ * open until the reaper marks it done with the job's status; the main
+ * loop then finishes it with memo_flush(). Slots only grow with SIGCHLD
+ * blocked, so the reaper may index them.
+ */
+struct memojobs
+{
+    struct memo_t *m; /* the entries; a free slot has fd -1 */
+    int n;            /* slots in m[] */
+};
+struct memojobs memo_jobs; /* The stopped memoized commands */
+
+/* How eval() wants one pipeline stage started */
+struct launch_t
+{
+    pid_t pgid; /* process group to join, 0 to lead a new one */
+    int in_fd;  /* pipe end to use as stdin, -1 to inherit */
+    int out_fd; /* pipe end to use as stdout, -1 to inherit */
+    int err_fd; /* pipe end to use as stderr, -1 to inherit */
+    struct placement *place; /* where to run it, NULL to inherit */
+    struct limits *limits;   /* resource limits, NULL to inherit */
+    char **envp;             /* its environment, set by launch() */
+};
+
+/*
+ * A source of command lines. Input is read in large blocks and split in
+ * place, so lines cost no per-line stdio call and have no length limit.
+ * A returned line is valid until the next call to readline_src().
+ */
+struct linereader
+{
+    int fd;       /* where the lines come from */
+    char *buf;    /* block buffer */
+    size_t cap;   /* allocated size of buf */
+    size_t block; /* bytes to ask read() for at a time */
+    size_t start; /* first byte not yet returned */
+    size_t scan;  /* first byte not yet searched for a newline */
+    size_t end;   /* one past the last byte read */
+    int eof;      /* read() has reported end of file */
+    unsigned long lines; /* lines returned so far */
+};
+struct linereader cmd_input; /* The shell's command input */
+
+/*
+ * The command history. Lines are appended to a text file, and the offset
+ * each begins at to an index file beside it (<history>.idx, 8 bytes per
+ * line), both O_APPEND and under flock, so several shells can share
+ * them. Both are mapped rather than read, so starting up costs a stat
+ * and two mmaps however long the history is, and line i is a lookup in
+ * the index. Only a tail the index lacks (lines some other writer added)
+ * is scanned, and then indexed for next time.
+ */
+struct history
+{
+    int fd;          /* the history file, or -1 without one */
+    int ifd;         /* its index */
+    char *text;      /* the history, mapped */
+    size_t size;     /* bytes of it mapped */
+    uint64_t *off;   /* the index, mapped: where each line starts */
+    size_t n;        /* lines indexed */
+};
+struct history cmd_history = {.fd = -1}; /* The command history */
+
+/* The line editor, used when the shell reads commands from a terminal */
+struct lineedit
+{
+    char *buf;              /* the line being edited */
+    size_t len;             /* its length */
+    size_t cap;             /* allocated size of buf */
+    size_t pos;             /* the cursor, as an offset into buf */
+    struct termios cooked;  /* the terminal's modes outside the editor */
+    int on;                 /* the editor is in use */
+};
+struct lineedit line_edit; /* The line editor */
+#define HIST_CHUNK (1 << 16) /* bytes searched at a time by ctrl-r */
+
+/*
+ * The parse cache of a -f script. A script is parsed once, and its
+ * tokens are written to script.tshc next to it, keyed by a hash of the
+ * script's contents. Later runs of the same script map the cache and
+ * replay the tokens, without reading or tokenizing the script at all.
+ * A script is not cached if any of its commands (parallel without a
+ * file, or a << here-document) reads further lines of the script itself.
+ */
+#define CACHE_OFF 0    /* lines are read and parsed as usual */
+#define CACHE_RECORD 1 /* parsed lines are added to the cache */
+#define CACHE_REPLAY 2 /* lines and tokens come from the cache */
+
+#define CACHE_MAGIC "TSHC"
+#define CACHE_VERSION 3 /* bump whenever the format or builtins_t changes */
+
+struct cache_header
+{
+    char magic[4];    /* CACHE_MAGIC */
+    uint32_t version; /* CACHE_VERSION */
+    uint64_t hash;    /* FNV-1a hash of the script */
+    uint64_t size;    /* length of the script */
+    uint32_t nrec;    /* number of records that follow */
+    uint32_t pad;
+};
+
+/*
+ * A record is a run of 32-bit words followed by its strings, all
+ * offsets relative to the start of the record:
+ *   len, bg, cmdline, nstages, then for each stage
+ *   argc, builtins, nredirs, then for each redirection op, fd and
+ *   its word (the src descriptor of a REDIR_DUP, 0 for REDIR_CLOSE),
+ *   then argv[0..argc-1]
+ * with len a multiple of 4. A line
+ * parseline() rejected is kept with bg -1 and parsed again on replay,
+ * so its error is reported again.
+ */
+struct scriptcache
+{
+    int mode;        /* CACHE_OFF, CACHE_RECORD or CACHE_REPLAY */
+    char *path;      /* the cache file */
+    uint64_t hash;   /* hash of the script */
+    uint64_t size;   /* length of the script */
+    char *buf;       /* CACHE_RECORD: records so far, after a header */
+    size_t len;      /* bytes used in buf */
+    size_t cap;      /* allocated size of buf */
+    uint32_t nrec;   /* records in buf, or in the map */
+    char *map;       /* CACHE_REPLAY: the mapped cache */
+    size_t maplen;   /* length of the map */
+    size_t next;     /* offset of the next record to replay */
+    uint32_t *cur;   /* record being replayed */
+    pid_t pid;       /* the shell, the only process that writes the cache */
+};
+struct scriptcache script_cache; /* The -f script's parse cache */
+
+/*
+ * The parallel task runner. Every command line of a parallel run is a
+ * task, started as a background job; the reaper records the task's
+ * exit status when its job is done, so the next one can be started.
+ * Like the job table, tasks[] only grows with signals blocked.
+ */
+struct task_t
+{
+    char *cmdline; /* the command line, malloc'ed */
+    int status;    /* wait status of its last stage, once done */
+    int out_fd;    /* memfd holding its output with -g, or -1 */
+    int done;      /* it has finished (or never started) */
+};
+
+struct taskrunner
+{
+    struct task_t *tasks;           /* the tasks of the run, in order */
+    int ntasks;                     /* tasks started so far */
+    int cap;                        /* allocated length of tasks[] */
+    int cur;                        /* task of the job being started, or -1 */
+    int active;                     /* a parallel run is going on */
+    int group;                      /* tasks write to memfds of their own */
+    int spread;                     /* SPREAD_NONE, SPREAD_CPUS or SPREAD_NODES */
+    int *spread_ids;                /* the CPUs or nodes to spread over */
+    int nspread;                    /* length of spread_ids[] */
+    struct placement place;         /* placement of the task being started */
+    char **hosts;                   /* with --hosts, where tasks run */
+    char *hostbuf;                  /* the copy of the list hosts[] is in */
+    int nhosts;                     /* length of hosts[], 0 to run here */
+    volatile sig_atomic_t nrunning; /* tasks whose job is still live */
+};
+struct taskrunner task_runner = {.cur = -1}; /* The task runner */
+
+/*
+ * Worker pools (worker). A pool keeps a few long-lived processes of one
+ * program, each talking to the shell over a Unix socket that is both
+ * its stdin and stdout: a request is one line in, its reply is
+ * everything the worker writes up to a NUL byte. So a request costs two
+ * socket writes instead of a fork and exec and the program's startup.
+ * A pool is one background job, so jobs lists it and the reaper reports
+ * it if its workers die.
+ */
+#define MAXWORKERS 64     /* workers in one pool */
+#define REPLYBLOCK (1 << 16) /* bytes per recv() of a reply */
+
+struct pool_t
+{
+    char name[32];             /* the name it is used by */
+    pid_t pgid;                /* its job, led by the first worker */
+    int n;                     /* number of workers */
+    int fds[MAXWORKERS];       /* the shell's socket ends, -1 once gone */
+    char busy[MAXWORKERS];     /* a reply is still to be read */
+    int next;                  /* worker the next request goes to */
+    unsigned long requests;    /* requests sent so far */
+};
+
+struct poollist
+{
+    struct pool_t *pools; /* the pools, in order of start */
+    int n;                /* number of pools */
+    int cap;              /* allocated length of pools */
+};
+struct poollist worker_pools; /* The worker pools */
+
+/*
+ * Captured output of background jobs (-o). Each job writes its stdout
+ * and stderr to a pipe of its own, which the shell drains without
+ * blocking whenever it waits, and writes out in one piece once the job
+ * has closed it. Up to CAPTURE_MEM bytes are kept in memory; beyond
+ * that the output spills to an unlinked temporary file. Captures are
+ * only touched by the main routine, never by the handlers.
+ */
+struct capture
+{
+    int fd;       /* non-blocking read end of the pipe, -1 after EOF */
+    char *buf;    /* the latest output */
+    size_t len;   /* bytes in buf */
+    size_t cap;   /* allocated size of buf, at most CAPTURE_MEM */
+    int spill_fd; /* temporary file with the output before buf, or -1 */
+};
+
+struct capturelist
+{
+    struct capture *c;   /* the captures, in the order jobs started */
+    int n;               /* captures in c[] */
+    int cap;             /* allocated length of c[] */
+    struct pollfd *pfd;  /* scratch array for poll_captures() */
+    int pfdcap;          /* allocated length of pfd[] */
+};
+struct capturelist captures; /* The captured background output */
+
+/*
+ * The trace ring. Events are claimed with an atomic increment, so the
+ * main routine and the handlers can record without a lock; once the
+ * ring wraps, the oldest events are overwritten.
+ */
+#define TRACE_RING 8192 /* events kept (a power of 2) */
+
+struct trace_event
+{
+    long long ns; /* CLOCK_MONOTONIC time */
+    int arg;      /* pid, or 0 */
+    char phase;   /* TR_* */
+    char ph;      /* 'B'egin, 'E'nd or 'i'nstant */
+};
+
+struct trace_event trace_ring[TRACE_RING]; /* The trace ring */
+atomic_uint trace_head;                    /* events ever recorded */
+const char *trace_file = NULL;             /* where -t dumps it at exit */
+pid_t trace_pid;                           /* the shell that traces */
+
+/*
+ * The audit ring. Every job start, stop and end is recorded here, by
+ * addjob(), the reaper and deletejob(), as a fixed-size record; slots
+ * are claimed with a compare-and-swap and marked ready once filled, so
+ * handlers and the main routine record without a lock. The main routine
+ * writes the ready records out as NDJSON, a batch at a time, between
+ * command lines, to an O_APPEND file or a Unix datagram socket (-a).
+ */
+#define AUDIT_RING 4096 /* records kept until written (a power of 2) */
+#define AUDIT_CMD 240   /* bytes of the command line kept */
+
+/* Kinds of audit record */
+#define AUDIT_START 0 /* a job was started */
+#define AUDIT_STOP 1  /* it stopped */
+#define AUDIT_END 2   /* it is done */
+
+struct audit_rec
+{
+    atomic_int ready;       /* filled in, and not written yet */
+    int kind;               /* AUDIT_* */
+    pid_t pid;              /* process group of the job */
+    int jid;                /* its job ID */
+    int status;             /* AUDIT_END: wait status; AUDIT_STOP: signal */
+    long long ns;           /* CLOCK_REALTIME time of the event */
+    long long real_us;      /* AUDIT_END: how long the job ran */
+    char cmd[AUDIT_CMD];    /* AUDIT_START: command line, maybe cut short */
+};
+struct auditlog
+{
+    struct audit_rec ring[AUDIT_RING];
+    atomic_uint head;       /* next record to write */
+    atomic_uint tail;       /* next free slot */
+    atomic_ulong dropped;   /* records the ring had no room for */
+    int fd;                 /* the sink, or -1 if not auditing */
+    int dgram;              /* the sink is a datagram socket */
+};
+struct auditlog audit_log = {.fd = -1}; /* The audit ring */
+
 /* End global variables */
 
 /* Function prototypes */
 void eval(char *cmdline);
+void eval_script(struct scriptcache *sc, char *cmdline);
+int eval_tokens(char *cmdline, struct cmdline_tokens *tok, int bg);
+int builtin_cmd(struct cmdline_stage *st);
+int redirect(struct cmdline_stage *st);
+int redirects(struct cmdline_stage *st, int fd);
+pid_t launch_fork(struct cmdline_stage *st, const char *path,
+                  struct launch_t *how, sigset_t *set, int *err);
+pid_t launch_spawn(struct cmdline_stage *st, const char *path,
+                   struct launch_t *how, sigset_t *child_mask, int *err);
+pid_t launch(struct cmdline_stage *st, struct launch_t *how, sigset_t *set,
+             sigset_t *child_mask);
+int waitfg(pid_t pgid, sigset_t *mask);
+void bg_handler(struct cmdline_stage *st);
+void fg_handler(struct cmdline_stage *st);
+void kill_handler(struct cmdline_stage *st);
+void wait_handler(struct cmdline_stage *st);
+void hash_handler(struct cmdline_stage *st);
+void export_handler(struct cmdline_stage *st);
+void unset_handler(struct cmdline_stage *st);
+void cat_handler(struct cmdline_stage *st);
+void tee_handler(struct cmdline_stage *st);
+void parallel_handler(struct cmdline_stage *st);
+void ulimit_handler(struct cmdline_stage *st);
+void bench_handler(struct cmdline_stage *st);
+void trace_handler(struct cmdline_stage *st);
+void worker_handler(struct cmdline_stage *st);
+void stop_workers(void);
+void report_time(long long real, struct rusage *ru);
 
 void sigchld_handler(int sig);
+void reap_children(void);
+void drain_sigchld(void);
+void wait_child_event(sigset_t *mask);
+void wait_input(int fd);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
 
 /* Here are helper routines that we've provided for you */
-int parseline(const char *cmdline, struct cmdline_tokens *tok);
+int parseline(const char *cmdline, struct cmdline_tokens *tok,
+              struct arena *a);
+char *read_heredocs(char *cmdline, struct cmdline_tokens *tok,
+                    struct linereader *lr, struct arena *a);
+enum builtins_t builtin_id(const char *name);
 void sigquit_handler(int sig);
 
 void clearjob(struct job_t *job);
-void initjobs(struct job_t *job_list);
-int maxjid(struct job_t *job_list);
-int addjob(struct job_t *job_list, pid_t pid, int state, char *cmdline);
-int deletejob(struct job_t *job_list, pid_t pid);
-pid_t fgpid(struct job_t *job_list);
-struct job_t *getjobpid(struct job_t *job_list, pid_t pid);
-struct job_t *getjobjid(struct job_t *job_list, int jid);
+void initjobs(struct jobtable *job_list);
+int maxjid(struct jobtable *job_list);
+int addjob(struct jobtable *job_list, pid_t *pids, int npids, int state,
+           char *cmdline);
+int deletejob(struct jobtable *job_list, pid_t pid);
+void setjobstate(struct jobtable *job_list, struct job_t *job, int state);
+void resumejob(struct jobtable *job_list, struct job_t *job, int state);
+int jobrunning(struct job_t *job);
+pid_t fgpid(struct jobtable *job_list);
+struct job_t *getjobpid(struct jobtable *job_list, pid_t pid);
+struct job_t *getjobjid(struct jobtable *job_list, int jid);
 int pid2jid(pid_t pid);
-void listjobs(struct job_t *job_list, int output_fd);
+void listjobs(struct jobtable *job_list, int output_fd, int flags);
+int checkjobs(struct jobtable *job_list, struct outbuf *ob);
+#ifdef TSH_CHECK
+void replay(const char *path);
+#endif
+void rusage_add(struct rusage *sum, const struct rusage *ru);
+void rusage_since(struct rusage *ru, const struct rusage *before);
+long long usecs(struct timespec *from, struct timespec *to);
+
+const char *hash_lookup(const char *name, int *cached);
+void hash_forget(const char *name);
+void hash_clear(void);
+void hash_list(int output_fd);
+
+void env_init(void);
+int env_assignment(const char *word);
+int env_set(const char *assign);
+int env_unset(const char *name);
+char **env_for(struct cmdline_stage *st);
+
+int copyfd(int in_fd, int out_fd);
+int teefd(int in_fd, int *out_fds, int nout);
+int writeall(int fd, const char *buf, size_t n);
+int here_fd(const char *text);
+
+void ob_init(struct outbuf *ob, int fd, char *buf, size_t cap);
+void ob_write(struct outbuf *ob, const char *p, size_t n);
+void ob_puts(struct outbuf *ob, const char *s);
+void ob_putl(struct outbuf *ob, long v);
+void ob_putjson(struct outbuf *ob, const char *s);
+int ob_flush(struct outbuf *ob);
+
+int parse_idlist(const char *list, unsigned long *bits, int nbits);
+int read_idlist(const char *path, int *ids, int max);
+int spread_placement(int spread, int id, struct placement *place);
+int place_self(const struct placement *place);
+
+int cgroup_create(struct limits *lim);
+void cgroup_remove(int cgfd, const char *name);
+int limit_self(const struct limits *lim);
+void report_limits(struct job_t *job);
+
+void notify(int kind, struct job_t *job, int sig);
+void notify_flush(void);
+
+int audit_open(const char *sink);
+void audit_record(int kind, struct job_t *job, int status);
+void audit_flush(void);
+void audit_forget(void);
+
+int memo_open(void);
+void memo_begin(struct memo_t *m, struct cmdline_tokens *tok, int bg);
+void memo_end(struct memo_t *m, int status);
+void memo_defer(struct memo_t *m, struct job_t *job);
+void memo_flush(void);
+
+void trace_event(int phase, char ph, int arg);
+int trace_dump(int fd);
+void trace_atexit(void);
+
+int capture_add(void);
+void capture_drop(void);
+int poll_captures(struct pollfd *pfd, int n, const sigset_t *mask, int block);
+void capture_flush(void);
+
+void *arena_alloc(struct arena *a, size_t n);
+void *arena_grow(struct arena *a, void *old, size_t oldsize, size_t newsize);
+struct arena_mark arena_mark(struct arena *a);
+void arena_release(struct arena *a, struct arena_mark mark);
+
+void initreader(struct linereader *lr, int fd, size_t block);
+char *readline_src(struct linereader *lr);
+
+int hist_open(const char *path);
+void hist_add(const char *line);
+size_t hist_line(size_t i, const char **text);
+long hist_search(const char *pat, size_t plen, size_t before);
+int edit_begin(void);
+char *edit_line(const char *prompt);
+
+void cache_open(struct scriptcache *sc, const char *script, int fd);
+char *cache_next(struct scriptcache *sc);
+uint64_t fnv1a(const char *p, size_t n);
+int cache_tokens(struct scriptcache *sc, char *cmdline,
+                 struct cmdline_tokens *tok, struct arena *a);
+void cache_record(struct scriptcache *sc, const char *cmdline,
+                  struct cmdline_tokens *tok, int bg);
+void cache_finish(struct scriptcache *sc);
 
 void usage(void);
 
@@ -108,15 +879,20 @@ void usage(void);
 int main(int argc, char **argv)
 {
     char c;
-    char cmdline[MAXLINE_TSH]; /* cmdline for fgets */
-    int emit_prompt = 1;       /* emit prompt (default) */
+    char *cmdline;           /* the next command line */
+    int emit_prompt = 1;     /* emit prompt (default) */
+    int batch = 0;           /* running a -f script */
+    int in_fd = STDIN_FILENO; /* where commands are read from */
+    int use_sigfd = 0;        /* reap through a signalfd (-e) */
+    const char *trace = NULL; /* a driver trace to replay (-r) */
+    sigset_t chld;
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(1, 2);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF)
+    while ((c = getopt(argc, argv, "hvpsebqf:o:t:a:" CHECK_OPTS)) != EOF)
     {
         switch (c)
         {
@@ -129,11 +905,57 @@ int main(int argc, char **argv)
         case 'p':            /* don't print a prompt */
             emit_prompt = 0; /* handy for automatic testing */
             break;
+        case 's':          /* launch with posix_spawn instead of fork */
+            use_spawn = 1;
+            break;
+        case 'e': /* reap children from the main loop via signalfd */
+            use_sigfd = 1;
+            break;
+        case 'b': /* report job state changes right away */
+            notices.mode = NOTIFY_NOW;
+            break;
+        case 'q': /* don't report job state changes */
+            notices.mode = NOTIFY_OFF;
+            break;
+        case 'f': /* run a script in batch mode */
+            if ((in_fd = open(optarg, O_RDONLY | O_CLOEXEC)) < 0)
+                unix_error("error opening script");
+            cache_open(&script_cache, optarg, in_fd);
+            emit_prompt = 0;
+            batch = 1;
+            break;
+        case 't': /* trace, dumping the trace to a file at exit */
+            trace_file = optarg;
+            trace_on = 1;
+            trace_pid = getpid();
+            atexit(trace_atexit);
+            break;
+        case 'a': /* audit every job to a file or datagram socket */
+            if (audit_open(optarg) < 0)
+                unix_error("error opening audit sink");
+            break;
+        case 'o': /* buffer background output, by completion or start */
+            if (!strcmp(optarg, "done"))
+                capture_order = CAPTURE_DONE;
+            else if (!strcmp(optarg, "submit"))
+                capture_order = CAPTURE_SUBMIT;
+            else
+                usage();
+            break;
+        case 'r': /* replay a driver trace against a checked shell */
+            trace = optarg;
+            break;
         default:
             usage();
         }
     }
 
+    /* With -r this process drives the trace, and a child is the shell */
+#ifdef TSH_CHECK
+    if (trace != NULL)
+        replay(trace);
+#endif
+
     /* Install the signal handlers */
 
     /* These are the ones you will need to implement */
@@ -146,445 +968,3789 @@ int main(int argc, char **argv)
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, sigquit_handler);
 
-    /* Initialize the job list */
-    initjobs(job_list);
+    /* A replayed trace's signals were held back until now */
+    if (trace != NULL)
+    {
+        sigemptyset(&chld);
+        sigaddset(&chld, SIGINT);
+        sigaddset(&chld, SIGTSTP);
+        sigaddset(&chld, SIGQUIT);
+        sigprocmask(SIG_UNBLOCK, &chld, NULL);
+    }
+
+    /* The signalfd engine keeps SIGCHLD blocked for good and reads it
+     * from a descriptor, so the job table is only touched here */
+    if (use_sigfd)
+    {
+        sigemptyset(&chld);
+        sigaddset(&chld, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &chld, NULL);
+        sigchld_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (sigchld_fd < 0)
+            unix_error("signalfd error");
+    }
+
+    /* Initialize the job list and the environment */
+    initjobs(&job_list);
+    env_init();
+
+    /* In batch mode output is only flushed before a child is started,
+     * so a script full of builtins writes in large blocks */
+    initreader(&cmd_input, in_fd, batch ? SCRIPTBLOCK : LINEBLOCK);
+    if (batch)
+        setvbuf(stdout, NULL, _IOFBF, SCRIPTBLOCK);
+
+    /* A terminal gets the line editor and the history */
+    if (emit_prompt && !batch)
+        edit_begin();
 
     /* Execute the shell's read/eval loop */
     while (1)
     {
+        /* Report jobs that stopped or were killed since the last line,
+         * and write out what the audit ring has gathered */
+        fflush(stdout);
+        notify_flush();
+        if (audit_log.fd >= 0)
+            audit_flush();
+        memo_flush();
 
-        if (emit_prompt)
+        if (line_edit.on)
+            cmdline = edit_line(prompt);
+        else
         {
-            printf("%s", prompt);
-            fflush(stdout);
+            if (emit_prompt)
+            {
+                printf("%s", prompt);
+                fflush(stdout);
+            }
+            if (script_cache.mode == CACHE_REPLAY)
+                cmdline = cache_next(&script_cache);
+            else
+                cmdline = readline_src(&cmd_input);
         }
-        if ((fgets(cmdline, MAXLINE_TSH, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (feof(stdin))
+        if (cmdline == NULL)
         {
             /* End of file (ctrl-d) */
-            printf("\n");
+            if (!batch)
+                printf("\n");
+            fflush(stdout);
+            notify_flush();
+            if (audit_log.fd >= 0)
+                audit_flush();
+            memo_flush();
+            cache_finish(&script_cache);
+            capture_flush();
+            stop_workers();
             fflush(stdout);
             fflush(stderr);
             exit(0);
         }
 
-        /* Remove the trailing newline */
-        cmdline[strlen(cmdline) - 1] = '\0';
+        /* Report background jobs that changed state meanwhile, and
+         * write out the output of those that are done */
+        if (sigchld_fd >= 0)
+            drain_sigchld();
+        if (captures.n > 0)
+            poll_captures(NULL, 0, NULL, 0);
+        fflush(stdout);
+        notify_flush();
 
         /* Evaluate the command line */
-        eval(cmdline);
+        if (script_cache.mode != CACHE_OFF)
+            eval_script(&script_cache, cmdline);
+        else
+            eval(cmdline);
 
-        fflush(stdout);
-        fflush(stdout);
+        if (!batch)
+            fflush(stdout);
     }
 
     exit(0); /* control never reaches here */
 }
 
-// bg_handler changing a stopped background job into a running background job.
-void bg_handler(struct cmdline_tokens *tok)
+// waitfg - the one foreground wait, shared by eval and fg. Blocks until
+// job pgid is no longer in the foreground, which the reaper decides once
+// every process of the job has stopped or finished. The caller has
+// SIGCHLD blocked; mask is the mask to wait with. Returns the job's wait
+// status (that of its last stage) if it finished, -1 if it stopped.
+int waitfg(pid_t pgid, sigset_t *mask)
 {
-    // define a job pointer
-    struct job_t *job;
+    TRACE(TR_WAITFG, 'B', pgid);
+    while (pgid == fgpid(&job_list))
+        wait_child_event(mask);
+    TRACE(TR_WAITFG, 'E', pgid);
+    if (getjobpid(&job_list, pgid) != NULL)
+        return -1;
+    return job_list.fgstatus;
+}
+
+// job_range - the jobs arg names: %N, a range %N-M, every job from N on
+// with %N-, or a process ID. Puts the first and last job ID in *lo and
+// *hi and returns 0, or prints why there is no such job and returns -1.
+static int job_range(const char *arg, int *lo, int *hi)
+{
+    char *end;
+    long n, m;
 
-    // check if the job is specified by its job ID
-    if (tok->argv[1][0] == '%')
+    if (arg[0] != '%')
     {
-        int jid = atoi(&tok->argv[1][1]);
-        job = getjobjid(job_list, jid);
+        n = strtol(arg, &end, 10);
+        if (end == arg || *end != '\0')
+        {
+            printf("%s: argument must be a PID or %%jobid\n", arg);
+            return -1;
+        }
+        if ((*lo = *hi = pid2jid(n)) == 0)
+        {
+            printf("(%s): No such process\n", arg);
+            return -1;
+        }
+        return 0;
     }
-    else
+    n = strtol(arg + 1, &end, 10);
+    m = n;
+    if (end != arg + 1 && *end == '-')
     {
-        // if not specified by job ID, get it by process ID
-        pid_t pid = atoi(tok->argv[1]);
-        job = getjobpid(job_list, pid);
+        if (*++end == '\0')
+            m = job_list.maxjid;
+        else
+            m = strtol(end, &end, 10);
     }
-
-    // if the job is not found, print an error message and return
-    if (!job)
+    if (end == arg + 1 || *end != '\0' || n < 1 || m < n)
     {
-        unix_error("Job not found\n");
-        return;
+        printf("%s: argument must be a PID or %%jobid\n", arg);
+        return -1;
     }
-
-    // set the job's state to background
-    job->state = BG;
-    // send a continue signal to the job
-    kill(-(job->pid), SIGCONT);
-    // print the job's details
-    printf("[%d] (%d) %s\n", job->jid, job->pid, job->cmdline);
+    if (n == m && getjobjid(&job_list, n) == NULL)
+    {
+        printf("%s: No such job\n", arg);
+        return -1;
+    }
+    *lo = n;
+    *hi = m > job_list.maxjid ? job_list.maxjid : m;
+    return 0;
 }
 
-// fg_handler - changing a stopped background job into a running  foreground job
-void fg_handler(struct cmdline_tokens *tok)
+// bg_handler - continue stopped jobs in the background. Each argument
+// is a job or a range of jobs (see job_range)
+void bg_handler(struct cmdline_stage *st)
 {
-    // define a job pointer and a status variable
+    // define a job pointer and signal masks
     struct job_t *job;
-    int status;
+    sigset_t mask, prev_mask;
+    int i, jid, lo, hi;
 
-    // check if the job is specified by its job ID (starts with '%')
-    if (tok->argv[1][0] == '%')
+    if (st->argc < 2)
     {
-        int jid = atoi(&tok->argv[1][1]);
-        job = getjobjid(job_list, jid);
+        printf("bg command requires PID or %%jobid argument\n");
+        return;
     }
-    else
+
+    // keep the handlers out of the job table while we use it
+    sigfillset(&mask);
+    sigprocmask(SIG_BLOCK, &mask, &prev_mask);
+
+    for (i = 1; i < st->argc; i++)
     {
-        // if not specified by job ID, get it by process ID
-        pid_t pid = atoi(tok->argv[1]);
-        job = getjobpid(job_list, pid);
+        if (job_range(st->argv[i], &lo, &hi) < 0)
+            continue;
+        for (jid = lo; jid <= hi; jid++)
+        {
+            if ((job = getjobjid(&job_list, jid)) == NULL)
+                continue;
+            // continue every process of the job in the background
+            resumejob(&job_list, job, BG);
+            // print the job's details
+            printf("[%d] (%d) %s\n", job->jid, job->pid, job->cmdline);
+        }
     }
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+}
+
+// fg_handler - changing a stopped background job into a running  foreground job.
+// With several jobs, or a range, each is brought to the foreground in turn,
+// until one of them stops
+void fg_handler(struct cmdline_stage *st)
+{
+    // define a job pointer and signal masks
+    struct job_t *job;
+    pid_t pid;
+    sigset_t mask, prev_mask;
+    int i, jid, lo, hi;
 
-    // if the job is not found, print an error message and return
-    if (!job)
+    if (st->argc < 2)
     {
-        unix_error("Job not found\n");
+        printf("fg command requires PID or %%jobid argument\n");
         return;
     }
 
-    // send a continue signal to the job
-    kill(-(job->pid), SIGCONT);
+    // keep the handlers out of the job table while we use it
+    sigfillset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, &prev_mask);
+
+    for (i = 1; i < st->argc; i++)
+    {
+        if (job_range(st->argv[i], &lo, &hi) < 0)
+            continue;
+        for (jid = lo; jid <= hi; jid++)
+        {
+            if ((job = getjobjid(&job_list, jid)) == NULL)
+                continue;
+
+            // continue every process of the job in the foreground
+            pid = job->pid;
+            resumejob(&job_list, job, FG);
+
+            // wait until the reaper reports the whole job stopped or gone
+            if (waitfg(pid, &prev_mask) == -1)
+                goto done;
+        }
+    }
+
+done:
+    // restore the signal mask
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+}
+
+// signo - the signal named name: a number, or a name with or without
+// its SIG. Returns 0 if there is no such signal.
+static int signo(const char *name)
+{
+    static const struct
+    {
+        const char *name;
+        int sig;
+    } sigs[] = {{"HUP", SIGHUP},   {"INT", SIGINT},   {"QUIT", SIGQUIT},
+                {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2},
+                {"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM},
+                {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP},
+                {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU}, {"XCPU", SIGXCPU},
+                {"WINCH", SIGWINCH}};
+    char *end;
+    long n;
+    size_t i;
 
-    // set the job's state to foreground
-    job->state = FG;
+    n = strtol(name, &end, 10);
+    if (end != name && *end == '\0')
+        return n > 0 && n < NSIG ? n : 0;
+    if (!strncmp(name, "SIG", 3))
+        name += 3;
+    for (i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++)
+        if (!strcmp(name, sigs[i].name))
+            return sigs[i].sig;
+    return 0;
+}
 
-    // wait for the foreground job to terminate or be stopped
-    waitpid(job->pid, &status, WUNTRACED);
+// kill_handler - kill [-SIG | -s SIG] [-r | -t] job...: send SIG (TERM
+// by default) to each job, as one kill() of its process group. A job is
+// one of job_range's forms, so kill %1-200 takes one builtin, not 200
+// processes. -r only signals running jobs, -t only stopped ones. A
+// stopped job is also continued, so that it sees the signal, and
+// SIGCONT moves it to the background as bg would. A PID that is no
+// job's is signalled alone.
+void kill_handler(struct cmdline_stage *st)
+{
+    struct job_t *job;
+    sigset_t mask, prev_mask;
+    int i, jid, lo, hi, sig = SIGTERM, only = 0;
+    char *end;
+    long pid;
 
-    // check if the job was stopped
-    if (WIFSTOPPED(status))
+    for (i = 1; i < st->argc && st->argv[i][0] == '-'; i++)
     {
-        job->state = ST;
+        if (!strcmp(st->argv[i], "-r"))
+            only = BG;
+        else if (!strcmp(st->argv[i], "-t"))
+            only = ST;
+        else if (!strcmp(st->argv[i], "-s") && i + 1 < st->argc)
+            sig = signo(st->argv[++i]);
+        else
+            sig = signo(st->argv[i] + 1);
+        if (sig == 0)
+        {
+            printf("kill: %s: no such signal\n", st->argv[i]);
+            return;
+        }
     }
-    else
+    if (i == st->argc)
     {
-        // if the job terminated, delete it from the job list
-        deletejob(job_list, job->pid);
+        printf("usage: kill [-SIG | -s SIG] [-r | -t] %%job | %%N-M | pid...\n");
+        return;
     }
-}
 
-/*
- * eval - Evaluate the command line that the user has just typed in
- *
- * If the user has requested a built-in command (quit, jobs, bg or fg)
- * then execute it immediately. Otherwise, fork a child process and
- * run the job in the context of the child. If the job is running in
- * the foreground, wait for it to terminate and then return.  Note:
- * each child process must have a unique process group ID so that our
- * background children don't receive SIGINT (SIGTSTP) from the kernel
- * when we type ctrl-c (ctrl-z) at the keyboard.
- */
+    sigfillset(&mask);
+    sigprocmask(SIG_BLOCK, &mask, &prev_mask);
+    for (; i < st->argc; i++)
+    {
+        // a process that is not one of ours
+        pid = strtol(st->argv[i], &end, 10);
+        if (st->argv[i][0] != '%' && end != st->argv[i] && *end == '\0' &&
+            pid2jid(pid) == 0)
+        {
+            if (kill(pid, sig) < 0)
+                printf("kill: (%ld): %s\n", pid, strerror(errno));
+            continue;
+        }
+        if (job_range(st->argv[i], &lo, &hi) < 0)
+            continue;
+        for (jid = lo; jid <= hi; jid++)
+        {
+            if ((job = getjobjid(&job_list, jid)) == NULL ||
+                (only && job->state != only))
+                continue;
+            if (kill(-job->pid, sig) < 0)
+            {
+                printf("kill: %%%d: %s\n", jid, strerror(errno));
+                continue;
+            }
+            if (job->state == ST && sig == SIGCONT)
+                resumejob(&job_list, job, BG);
+            else if (job->state == ST && sig != SIGSTOP &&
+                     sig != SIGTSTP && sig != SIGTTIN && sig != SIGTTOU)
+                kill(-job->pid, SIGCONT);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+}
 
-void eval(char *cmdline)
+// waitable - whether wait waits for job: one that is running in the
+// background, and is not a worker pool, which only ends when stopped
+static int waitable(struct job_t *job)
 {
-    // define necessary variables and data structures
-    sigset_t set;
-    int bg;
-    pid_t pid;
-    struct cmdline_tokens tok;
+    int i;
 
-    // parse the command line input
-    bg = parseline(cmdline, &tok);
+    if (job->pid == 0 || job->state != BG)
+        return 0;
+    for (i = 0; i < worker_pools.n; i++)
+        if (worker_pools.pools[i].pgid == job->pid)
+            return 0;
+    return 1;
+}
 
-    // if parsing returns -1, return from the function
-    if (bg == -1)
-        return;
+// wait_handler - wait [-n] [job...]: wait for the running background
+// jobs to finish, or for the jobs given (job_range's forms), or with -n
+// for the next one to finish. It sleeps until the reaper has something,
+// as the foreground wait does; ctrl-c stops the waiting, not the jobs.
+void wait_handler(struct cmdline_stage *st)
+{
+    sigset_t mask, prev_mask;
+    int i, k, jid, next = 0, left, first = -1, nr = 0, *lo, *hi;
 
-    // if no command is provided, return from the function
-    if (tok.argv[0] == NULL)
-        return;
+    i = 1;
+    if (i < st->argc && !strcmp(st->argv[i], "-n"))
+    {
+        next = 1;
+        i++;
+    }
+
+    sigfillset(&mask);
+    sigprocmask(SIG_BLOCK, &mask, &prev_mask);
+
+    // the jobs to wait for, as ranges of job IDs
+    lo = arena_alloc(&cmd_arena, (st->argc + 1) * sizeof(int));
+    hi = arena_alloc(&cmd_arena, (st->argc + 1) * sizeof(int));
+    if (i == st->argc)
+    {
+        lo[0] = 1;
+        hi[0] = job_list.maxjid;
+        nr = 1;
+    }
+    for (; i < st->argc; i++)
+        if (job_range(st->argv[i], &lo[nr], &hi[nr]) == 0)
+            nr++;
+
+    // sleep until none of them runs, or with -n until one fewer does
+    builtin_intr = 0;
+    while (!builtin_intr)
+    {
+        left = 0;
+        for (k = 0; k < nr; k++)
+            for (jid = lo[k]; jid <= hi[k] && jid <= job_list.maxjid; jid++)
+                left += waitable(&job_list.jobs[jid]);
+        if (first < 0)
+            first = left;
+        if (left == 0 || (next && left < first))
+            break;
+        wait_child_event(&prev_mask);
+    }
+    builtin_intr = 0;
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+}
+
+// jobs_flags - the listjobs flags asked for by the jobs command st:
+// -v adds each job's resource usage, --json lists the jobs, with their
+// usage, as JSON, and --check checks the job table instead
+static int jobs_flags(struct cmdline_stage *st)
+{
+    int i, flags = 0;
+
+    for (i = 1; i < st->argc; i++)
+    {
+        if (!strcmp(st->argv[i], "-v"))
+            flags |= LIST_VERBOSE;
+        else if (!strcmp(st->argv[i], "--json"))
+            flags |= LIST_JSON;
+        else if (!strcmp(st->argv[i], "--check"))
+            flags |= LIST_CHECK;
+    }
+    return flags;
+}
 
-    // handle built-in commands
-    switch (tok.builtins)
+// builtin_cmd - run st if it is a builtin command. Returns 1 if it was.
+int builtin_cmd(struct cmdline_stage *st)
+{
+    switch (st->builtins)
     {
     case BUILTIN_QUIT:
-        // exit the shell
+        // exit the shell, with what background jobs wrote so far,
+        // taking its worker pools along
+        cache_finish(&script_cache);
+        fflush(stdout);
+        notify_flush();
+        if (audit_log.fd >= 0)
+            audit_flush();
+        capture_flush();
+        stop_workers();
         exit(0);
         break;
     case BUILTIN_JOBS:
-        // list the jobs
-        // if output file is specified, redirect output to the file
-        if (tok.outfile != NULL)
-        {
-            int out_fd = open(tok.outfile, O_WRONLY);
-            if (out_fd < 0)
-            {
-                unix_error("error opening file");
-                return;
-            }
-            listjobs(job_list, out_fd);
-            close(out_fd);
-        }
-        else
-            listjobs(job_list, STDOUT_FILENO);
-        return;
+        // list the jobs, after anything still buffered for stdout
+        fflush(stdout);
+        listjobs(&job_list, STDOUT_FILENO, jobs_flags(st));
+        return 1;
     case BUILTIN_BG:
         // handle background jobs
-        bg_handler(&tok);
-        return;
+        bg_handler(st);
+        return 1;
     case BUILTIN_FG:
         // handle foreground jobs
-        fg_handler(&tok);
-        return;
+        fg_handler(st);
+        return 1;
+    case BUILTIN_HASH:
+        // list or clear the command hash
+        hash_handler(st);
+        return 1;
+    case BUILTIN_CAT:
+        // copy files to stdout inside the kernel
+        cat_handler(st);
+        return 1;
+    case BUILTIN_TEE:
+        // copy stdin to stdout and files inside the kernel
+        tee_handler(st);
+        return 1;
+    case BUILTIN_PARALLEL:
+        // run command lines as jobs, a bounded number at a time
+        parallel_handler(st);
+        return 1;
+    case BUILTIN_ULIMIT:
+        // show or set the shell's resource limits
+        ulimit_handler(st);
+        return 1;
+    case BUILTIN_BENCH:
+        // measure the shell's hot paths
+        bench_handler(st);
+        return 1;
+    case BUILTIN_TRACE:
+        // switch tracing, or dump the trace
+        trace_handler(st);
+        return 1;
+    case BUILTIN_WORKER:
+        // start, use or stop a pool of worker processes
+        worker_handler(st);
+        return 1;
+    case BUILTIN_KILL:
+        // signal jobs, a range of them at a time
+        kill_handler(st);
+        return 1;
+    case BUILTIN_WAIT:
+        // wait for background jobs to finish
+        wait_handler(st);
+        return 1;
+    case BUILTIN_EXPORT:
+        // set or list environment variables
+        export_handler(st);
+        return 1;
+    case BUILTIN_UNSET:
+        // remove environment variables
+        unset_handler(st);
+        return 1;
     default:
         break;
     }
+    return 0;
+}
 
-    // if no built-in command is matched, proceed with external commands
-    if (tok.builtins == BUILTIN_NONE)
+// redir_flags - the open flags of a redirection to a file
+static int redir_flags(int op)
+{
+    switch (op)
     {
-        // block certain signals to handle race conditions
-        sigemptyset(&set);
-        sigaddset(&set, SIGCHLD);
-        sigaddset(&set, SIGTSTP);
-        sigaddset(&set, SIGINT);
-        sigprocmask(SIG_BLOCK, &set, NULL);
-
-        // create a child process
-        pid = fork();
+    case REDIR_OUT:
+        return O_WRONLY | O_CREAT | O_TRUNC;
+    case REDIR_APPEND:
+        return O_WRONLY | O_CREAT | O_APPEND;
+    case REDIR_RDWR:
+        return O_RDWR | O_CREAT;
+    default:
+        return O_RDONLY;
+    }
+}
 
-        // handle fork error
-        if (pid < 0)
-            unix_error("error with fork");
+// redirect - apply the redirections of st to this process, in order.
+// A here-document uses the descriptor the shell made for it, if any.
+// Returns 0, or -1 with errno set.
+int redirect(struct cmdline_stage *st)
+{
+    struct redirection *r;
+    int i, fd;
 
-        // child process code
-        if (pid == 0)
+    for (i = 0; i < st->nredirs; i++)
+    {
+        r = &st->redirs[i];
+        switch (r->op)
         {
-            // set process group ID for the child
-            setpgid(0, 0);
-            // unblock signals in child
-            sigprocmask(SIG_UNBLOCK, &set, NULL);
+        case REDIR_DUP:
+            fd = r->src;
+            break;
+        case REDIR_CLOSE:
+            close(r->fd);
+            continue;
+        case REDIR_HERE:
+            fd = r->src >= 0 ? r->src : here_fd(r->word);
+            break;
+        case REDIR_HEREDOC:
+            errno = EINVAL;
+            return -1;
+        default:
+            fd = open(r->word, redir_flags(r->op) | O_CLOEXEC, 0666);
+            break;
+        }
+        if (fd < 0)
+            return -1;
 
-            // handle input redirection
-            if (tok.infile != NULL)
-            {
-                int in_fd = open(tok.infile, O_RDONLY);
-                if (in_fd < 0)
-                {
-                    unix_error("error opening file");
-                }
-                dup2(in_fd, STDIN_FILENO);
-                close(in_fd);
-            }
+        // the target must survive exec, even if it is the fd just opened
+        if (fd == r->fd ? fcntl(fd, F_SETFD, 0) < 0 : dup2(fd, r->fd) < 0)
+            return -1;
+        if (fd != r->fd && fd != r->src)
+            close(fd);
+    }
+    return 0;
+}
 
-            // handle output redirection
-            if (tok.outfile != NULL)
-            {
-                int out_fd = open(tok.outfile, O_WRONLY);
-                if (out_fd < 0)
-                {
-                    unix_error("error opening file");
-                }
-                dup2(out_fd, STDOUT_FILENO);
-                close(out_fd);
-            }
+// here_fds - make the pipe or memfd of each here-document of st, for a
+// child to dup. Returns 0, or -1 with errno set.
+static int here_fds(struct cmdline_stage *st)
+{
+    int i;
 
-            // execute the command
-            if (execve(tok.argv[0], tok.argv, environ) < 0)
-            {
-                printf("%s: Command not found.\n", tok.argv[0]);
-                exit(0);
-            }
-        }
+    for (i = 0; i < st->nredirs; i++)
+        if (st->redirs[i].op == REDIR_HERE &&
+            (st->redirs[i].src = here_fd(st->redirs[i].word)) < 0)
+            return -1;
+    return 0;
+}
+
+// redirects - does st redirect descriptor fd?
+int redirects(struct cmdline_stage *st, int fd)
+{
+    int i;
+
+    for (i = 0; i < st->nredirs; i++)
+        if (st->redirs[i].fd == fd)
+            return 1;
+    return 0;
+}
 
-        // parent process code
-        // add the child process to the job list
-        addjob(job_list, pid, bg + 1, cmdline);
-        // unblock signals in parent
-        sigprocmask(SIG_UNBLOCK, &set, NULL);
+// run_builtin - run the builtin st in the shell itself, with its
+// redirections applied while it runs and undone after
+static void run_builtin(struct cmdline_stage *st)
+{
+    int i, j, *saved = NULL;
 
-        // if it's a background process, print its details
-        if (bg)
+    // keep a copy of every descriptor it redirects (-1 if it was closed)
+    if (st->nredirs > 0)
+    {
+        fflush(stdout);
+        saved = arena_alloc(&cmd_arena, st->nredirs * sizeof(int));
+        for (i = 0; i < st->nredirs; i++)
         {
-            printf("[%d] (%d) %s\n", pid2jid(pid), pid, cmdline);
+            saved[i] = -2;
+            for (j = 0; j < i; j++)
+                if (st->redirs[j].fd == st->redirs[i].fd)
+                    break;
+            if (j == i)
+                saved[i] = fcntl(st->redirs[i].fd, F_DUPFD_CLOEXEC, 10);
         }
-        // if it's a foreground process, wait for it to complete
+        if (redirect(st) < 0)
+            fprintf(stderr, "error opening file: %s\n", strerror(errno));
         else
-        {
-            // block all signals
-            sigset_t mask, prev_mask;
-            sigfillset(&mask);
-            sigprocmask(SIG_SETMASK, &mask, &prev_mask);
-
-            // wait for SIGCHLD signal
-            while (pid == fgpid(job_list))
-                sigsuspend(&prev_mask);
+            builtin_cmd(st);
+        fflush(stdout);
 
-            // restore the signal mask
-            sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+        // put them back, last redirection first
+        for (i = st->nredirs - 1; i >= 0; i--)
+        {
+            if (saved[i] == -2)
+                continue;
+            if (saved[i] >= 0)
+            {
+                dup2(saved[i], st->redirs[i].fd);
+                close(saved[i]);
+            }
+            else
+                close(st->redirs[i].fd);
         }
+        return;
     }
-    return;
+    builtin_cmd(st);
 }
-/*
- * parseline - Parse the command line and build the argv array.
- *
- * Parameters:
- *   cmdline:  The command line, in the form:
- *
- *                command [arguments...] [< infile] [> oufile] [&]
- *
- *   tok:      Pointer to a cmdline_tokens structure. The elements of this
- *             structure will be populated with the parsed tokens. Characters
- *             enclosed in single or double quotes are treated as a single
- *             argument.
- * Returns:
- *   1:        if the user has requested a BG job
- *   0:        if the user has requested a FG job
- *  -1:        if cmdline is incorrectly formatted
- *
- * Note:       The string elements of tok (e.g., argv[], infile, outfile)
- *             are statically allocated inside parseline() and will be
- *             overwritten the next time this function is invoked.
- */
-int parseline(const char *cmdline, struct cmdline_tokens *tok)
-{
-
-    static char array[MAXLINE_TSH];    /* holds local copy of command line */
-    const char delims[10] = " \t\r\n"; /* argument delimiters (white-space) */
-    char *buf = array;                 /* ptr that traverses command line */
-    char *next;                        /* ptr to the end of the current arg */
-    char *endbuf;                      /* ptr to end of cmdline string */
-    int is_bg;                         /* background job? */
-
-    int parsing_state; /* indicates if the next token is the
-                          input or output file */
 
-    if (cmdline == NULL)
-    {
-        (void)fprintf(stderr, "Error: command line is NULL\n");
-        return -1;
-    }
+// launch_fork - start st, whose program lives at path, in a forked
+// child, the classic way. The caller has blocked the signals in set;
+// the child unblocks them. A failed execve is reported back through a
+// close-on-exec pipe, so the parent learns its errno. Returns -1 and
+// sets *err if the program could not be executed. A builtin stage of a
+// pipeline runs in the child instead of a program (path is NULL).
+pid_t launch_fork(struct cmdline_stage *st, const char *path,
+                  struct launch_t *how, sigset_t *set, int *err)
+{
+    int errpipe[2];
+    ssize_t n;
 
-    (void)strncpy(buf, cmdline, MAXLINE_TSH);
-    endbuf = buf + strlen(buf);
+    if (pipe2(errpipe, O_CLOEXEC) < 0)
+        unix_error("error with pipe");
 
-    tok->infile = NULL;
-    tok->outfile = NULL;
+    // create a child process
+    TRACE(TR_FORK, 'B', 0);
+    pid_t pid = fork();
 
-    /* Build the argv list */
-    parsing_state = ST_NORMAL;
-    tok->argc = 0;
+    // handle fork error
+    if (pid < 0)
+        unix_error("error with fork");
 
-    while (buf < endbuf)
+    // child process code
+    if (pid == 0)
     {
-        /* Skip the white-spaces */
-        buf += strspn(buf, delims);
-        if (buf >= endbuf)
-            break;
-
-        /* Check for I/O redirection specifiers */
-        if (*buf == '<')
+        close(errpipe[0]);
+        // join the pipeline's process group, or start a new one
+        setpgid(0, how->pgid);
+        // unblock signals in child
+        sigprocmask(SIG_UNBLOCK, set, NULL);
+        // run where the job was placed, before anything is allocated
+        if (how->place != NULL && place_self(how->place) < 0)
         {
-            if (tok->infile)
-            {
-                (void)fprintf(stderr, "Error: Ambiguous I/O redirection\n");
-                return -1;
-            }
-            parsing_state |= ST_INFILE;
-            buf++;
-            continue;
+            fprintf(stderr, "taskset: %s\n", strerror(errno));
+            _exit(1);
         }
-        if (*buf == '>')
+        if (how->limits != NULL && limit_self(how->limits) < 0)
         {
-            if (tok->outfile)
-            {
-                (void)fprintf(stderr, "Error: Ambiguous I/O redirection\n");
-                return -1;
-            }
-            parsing_state |= ST_OUTFILE;
-            buf++;
-            continue;
+            fprintf(stderr, "limit: %s\n", strerror(errno));
+            _exit(1);
         }
 
-        if (*buf == '\'' || *buf == '\"')
-        {
-            /* Detect quoted tokens */
-            buf++;
-            next = strchr(buf, *(buf - 1));
-        }
-        else
+        // connect the pipes first, so that files can override them
+        if (how->in_fd >= 0)
+            dup2(how->in_fd, STDIN_FILENO);
+        if (how->out_fd >= 0)
+            dup2(how->out_fd, STDOUT_FILENO);
+        if (how->err_fd >= 0)
+            dup2(how->err_fd, STDERR_FILENO);
+
+        // handle the redirections, in order; the child must _exit on
+        // failure, as exit() would rewind the stdin buffer it shares
+        // with the shell
+        if (redirect(st) < 0)
         {
-            /* Find next delimiter */
-            next = buf + strcspn(buf, delims);
+            fprintf(stderr, "error opening file: %s\n", strerror(errno));
+            _exit(1);
         }
 
-        if (next == NULL)
+        // a builtin in a pipeline runs right here in the child, where
+        // its redirections are already in place
+        if (path == NULL)
         {
-            /* Returned by strchr(); this means that the closing
-               quote was not found. */
-            (void)fprintf(stderr, "Error: unmatched %c.\n", *(buf - 1));
-            return -1;
+            close(errpipe[1]);
+            // what it reads comes from the pipe, not the shell's input
+            initreader(&cmd_input, STDIN_FILENO, LINEBLOCK);
+            if (audit_log.fd >= 0)
+                audit_forget();
+            builtin_cmd(st);
+            fflush(stdout);
+            if (audit_log.fd >= 0)
+                audit_flush();
+            _exit(0);
         }
 
-        /* Terminate the token */
-        *next = '\0';
+        // execute the command, telling the parent if that fails
+        execve(path, st->argv, how->envp);
+        *err = errno;
+        n = write(errpipe[1], err, sizeof(*err));
+        _exit(127);
+    }
 
-        /* Record the token as either the next argument or the i/o file */
-        switch (parsing_state)
-        {
-        case ST_NORMAL:
-            tok->argv[tok->argc++] = buf;
-            break;
-        case ST_INFILE:
-            tok->infile = buf;
-            break;
-        case ST_OUTFILE:
-            tok->outfile = buf;
-            break;
-        default:
-            (void)fprintf(stderr, "Error: Ambiguous I/O redirection\n");
-            return -1;
-        }
-        parsing_state = ST_NORMAL;
+    // parent process code
+    // the pipe reaches EOF without data once the child has exec'd
+    TRACE(TR_FORK, 'E', pid);
+    TRACE(TR_EXEC, 'B', pid);
+    close(errpipe[1]);
+    while ((n = read(errpipe[0], err, sizeof(*err))) < 0 && errno == EINTR)
+        ;
+    close(errpipe[0]);
+    TRACE(TR_EXEC, 'E', pid);
+    return n == sizeof(*err) ? -1 : pid;
+}
 
-        /* Check if argv is full */
-        if (tok->argc >= MAXARGS - 1)
-            break;
+// launch_spawn - start st, whose program lives at path, with
+// posix_spawn, which avoids copying the shell's page tables. The process
+// group, the child's signal mask (child_mask, the mask from before eval
+// blocked signals), the pipes and the redirections are described as
+// spawn attributes and file actions. Returns -1 and sets *err on failure.
+pid_t launch_spawn(struct cmdline_stage *st, const char *path,
+                   struct launch_t *how, sigset_t *child_mask, int *err)
+{
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    struct redirection *r;
+    pid_t pid;
+    int i;
 
-        buf = next + 1;
-    }
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP |
+                                        POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, how->pgid);
+    posix_spawnattr_setsigmask(&attr, child_mask);
 
-    if (parsing_state != ST_NORMAL)
+    posix_spawn_file_actions_init(&actions);
+    if (how->in_fd >= 0)
+        posix_spawn_file_actions_adddup2(&actions, how->in_fd, STDIN_FILENO);
+    if (how->out_fd >= 0)
+        posix_spawn_file_actions_adddup2(&actions, how->out_fd,
+                                         STDOUT_FILENO);
+    if (how->err_fd >= 0)
+        posix_spawn_file_actions_adddup2(&actions, how->err_fd,
+                                         STDERR_FILENO);
+    for (i = 0; i < st->nredirs; i++)
     {
-        (void)fprintf(stderr,
-                      "Error: must provide file name for redirection\n");
-        return -1;
+        r = &st->redirs[i];
+        if (r->op == REDIR_DUP || r->op == REDIR_HERE)
+            posix_spawn_file_actions_adddup2(&actions, r->src, r->fd);
+        else if (r->op == REDIR_CLOSE)
+            posix_spawn_file_actions_addclose(&actions, r->fd);
+        else
+            posix_spawn_file_actions_addopen(&actions, r->fd, r->word,
+                                             redir_flags(r->op), 0666);
     }
 
-    /* The argument list must end with a NULL pointer */
-    tok->argv[tok->argc] = NULL;
+    TRACE(TR_SPAWN, 'B', 0);
+    *err = posix_spawn(&pid, path, &actions, &attr, st->argv, how->envp);
+    TRACE(TR_SPAWN, 'E', *err ? 0 : pid);
 
-    if (tok->argc == 0) /* ignore blank line */
-        return 1;
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
 
-    if (!strcmp(tok->argv[0], "quit"))
-    { /* quit command */
-        tok->builtins = BUILTIN_QUIT;
+    return *err ? -1 : pid;
+}
+
+// launch - resolve argv[0] through the command hash and start it with
+// the selected launch engine. If a hashed path has disappeared (ENOENT),
+// the entry is dropped and PATH is searched once more. Builtins in a
+// pipeline always take the fork engine. Returns -1 after printing a
+// message if the command can't be started.
+pid_t launch(struct cmdline_stage *st, struct launch_t *how, sigset_t *set,
+             sigset_t *child_mask)
+{
+    const char *path;
+    int cached, err;
+    pid_t pid;
+
+    how->envp = env_for(st);
+    if (st->builtins != BUILTIN_NONE)
+        return launch_fork(st, NULL, how, set, &err);
+
+    while (1)
+    {
+        path = hash_lookup(st->argv[0], &cached);
+        if (path == NULL)
+        {
+            printf("%s: Command not found.\n", st->argv[0]);
+            return -1;
+        }
+
+        // posix_spawn can't set a placement or limits, so those fork
+        if (use_spawn && how->place == NULL && how->limits == NULL)
+            pid = launch_spawn(st, path, how, child_mask, &err);
+        else
+            pid = launch_fork(st, path, how, set, &err);
+
+        if (pid >= 0)
+            return pid;
+        // a cached path is only stale if its program is gone: a spawn
+        // whose file action failed also says ENOENT
+        if (err != ENOENT || !cached || access(path, X_OK) == 0)
+            break;
+        hash_forget(st->argv[0]);
     }
-    else if (!strcmp(tok->argv[0], "jobs"))
-    { /* jobs command */
-        tok->builtins = BUILTIN_JOBS;
+
+    // a failed spawn file action reports the same errno as a failed
+    // exec, so tell them apart by looking at the program itself
+    if (use_spawn && how->place == NULL && how->limits == NULL &&
+        access(path, X_OK) == 0)
+        fprintf(stderr, "error opening file: %s\n", strerror(err));
+    else
+        printf("%s: Command not found.\n", st->argv[0]);
+    return -1;
+}
+
+// hash_handler - list the command hash, or clear it with -r. Names
+// given as arguments are looked up and remembered.
+void hash_handler(struct cmdline_stage *st)
+{
+    int i, cached;
+
+    if (st->argc == 1)
+    {
+        fflush(stdout);
+        hash_list(STDOUT_FILENO);
+        return;
     }
-    else if (!strcmp(tok->argv[0], "bg"))
-    { /* bg command */
-        tok->builtins = BUILTIN_BG;
+    for (i = 1; i < st->argc; i++)
+    {
+        if (!strcmp(st->argv[i], "-r"))
+            hash_clear();
+        else if (hash_lookup(st->argv[i], &cached) == NULL)
+            printf("hash: %s: not found\n", st->argv[i]);
     }
-    else if (!strcmp(tok->argv[0], "fg"))
-    { /* fg command */
-        tok->builtins = BUILTIN_FG;
+}
+
+// export_handler - export NAME=value... sets variables, export alone
+// lists them. A NAME without a value is already exported, if it is set.
+void export_handler(struct cmdline_stage *st)
+{
+    int i;
+
+    if (st->argc == 1)
+    {
+        for (i = 0; i < env_store.n; i++)
+            printf("export %s\n", env_store.vars[i]);
+        return;
     }
-    else
+    for (i = 1; i < st->argc; i++)
     {
-        tok->builtins = BUILTIN_NONE;
+        if (env_assignment(st->argv[i]))
+            env_set(st->argv[i]);
+        else if (strchr(st->argv[i], '=') != NULL || st->argv[i][0] == '\0')
+            printf("export: %s: not a valid name\n", st->argv[i]);
     }
+}
 
-    /* Should the job run in the background? */
-    if ((is_bg = (*tok->argv[tok->argc - 1] == '&')) != 0)
-        tok->argv[--tok->argc] = NULL;
+// unset_handler - unset NAME... removes variables from the environment
+void unset_handler(struct cmdline_stage *st)
+{
+    int i;
 
-    return is_bg;
+    for (i = 1; i < st->argc; i++)
+        env_unset(st->argv[i]);
+}
+
+// cat_handler - tsh-cat [file...]: copy the files (or stdin) to stdout
+// with copy_file_range, splice or sendfile, so no bytes pass through
+// user space and no cat process is forked. Its redirections are
+// applied to stdin and stdout by then.
+void cat_handler(struct cmdline_stage *st)
+{
+    int i, fd, in_fd = STDIN_FILENO, out_fd = STDOUT_FILENO;
+
+    fflush(stdout);
+    builtin_intr = 0;
+
+    if (st->argc == 1 && copyfd(in_fd, out_fd) < 0)
+        fprintf(stderr, "tsh-cat: %s\n", strerror(errno));
+    for (i = 1; i < st->argc && !builtin_intr; i++)
+    {
+        if ((fd = open(st->argv[i], O_RDONLY | O_CLOEXEC)) < 0)
+        {
+            fprintf(stderr, "tsh-cat: %s: %s\n", st->argv[i], strerror(errno));
+            continue;
+        }
+        if (copyfd(fd, out_fd) < 0)
+            fprintf(stderr, "tsh-cat: %s: %s\n", st->argv[i], strerror(errno));
+        close(fd);
+    }
+}
+
+// tee_handler - tsh-tee [-a] file...: copy stdin to stdout and to each
+// file (appending with -a), duplicating the data with tee(2) and
+// splice(2) instead of reading and writing it.
+void tee_handler(struct cmdline_stage *st)
+{
+    int i, nout = 0, flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int in_fd = STDIN_FILENO, out_fd = STDOUT_FILENO, *out_fds;
+
+    if (st->argc > 1 && !strcmp(st->argv[1], "-a"))
+        flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+    if ((out_fds = malloc(st->argc * sizeof(int))) == NULL)
+        unix_error("malloc error");
+    fflush(stdout);
+    builtin_intr = 0;
+
+    out_fds[nout++] = out_fd;
+    for (i = 1; i < st->argc; i++)
+    {
+        if (i == 1 && !strcmp(st->argv[i], "-a"))
+            continue;
+        if ((out_fds[nout] = open(st->argv[i], flags, 0666)) < 0)
+            fprintf(stderr, "tsh-tee: %s: %s\n", st->argv[i], strerror(errno));
+        else
+            nout++;
+    }
+
+    if (teefd(in_fd, out_fds, nout) < 0)
+        fprintf(stderr, "tsh-tee: %s\n", strerror(errno));
+
+    for (i = 1; i < nout; i++)
+        close(out_fds[i]);
+    free(out_fds);
+}
+
+// remote_dir - the directory the control sockets of remote's ssh
+// masters live in: $TSH_REMOTE_DIR, else tsh-ssh in $XDG_RUNTIME_DIR,
+// else /tmp/tsh-ssh-<uid>. NULL if it can't be made.
+static const char *remote_dir(void)
+{
+    static char *dir;
+    const char *env;
+
+    if (dir != NULL)
+        return dir;
+    if ((dir = malloc(PATH_MAX)) == NULL)
+        unix_error("malloc error");
+    if ((env = getenv("TSH_REMOTE_DIR")) != NULL && *env != '\0')
+        snprintf(dir, PATH_MAX, "%s", env);
+    else if ((env = getenv("XDG_RUNTIME_DIR")) != NULL && *env != '\0')
+        snprintf(dir, PATH_MAX, "%s/tsh-ssh", env);
+    else
+        snprintf(dir, PATH_MAX, "/tmp/tsh-ssh-%d", (int)getuid());
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "remote: %s: %s\n", dir, strerror(errno));
+        free(dir);
+        dir = NULL;
+    }
+    return dir;
+}
+
+// remote_quote - args[0..n-1] as one string the remote shell splits
+// back into the same words, each in single quotes
+static char *remote_quote(char **args, int n)
+{
+    size_t len = 1;
+    char *q, *p;
+    const char *a;
+    int i;
+
+    for (i = 0; i < n; i++)
+        for (len += 3, a = args[i]; *a != '\0'; a++)
+            len += *a == '\'' ? 4 : 1;
+    p = q = arena_alloc(&cmd_arena, len);
+    for (i = 0; i < n; i++)
+    {
+        if (i > 0)
+            *p++ = ' ';
+        *p++ = '\'';
+        for (a = args[i]; *a != '\0'; a++)
+        {
+            if (*a == '\'')
+            {
+                memcpy(p, "'\\''", 4);
+                p += 4;
+            }
+            else
+                *p++ = *a;
+        }
+        *p++ = '\'';
+    }
+    *p = '\0';
+    return q;
+}
+
+// remote_argv - the argv of an ssh that runs cmd on host through the
+// host's master connection, starting the master (which stays for
+// $TSH_REMOTE_PERSIST, 600 seconds by default, after its last use) if
+// there is none. op, if not NULL, is an ssh -O control command instead.
+static char **remote_argv(const char *host, const char *cmd, const char *op,
+                          int tty, int *argc)
+{
+    const char *dir, *persist = getenv("TSH_REMOTE_PERSIST");
+    char **argv = arena_alloc(&cmd_arena, 16 * sizeof(char *));
+    char *path, *keep;
+    int n = 0;
+
+    if ((dir = remote_dir()) == NULL)
+        return NULL;
+    path = arena_alloc(&cmd_arena, strlen(dir) + 32);
+    sprintf(path, "ControlPath=%s/%%r@%%h:%%p", dir);
+    keep = arena_alloc(&cmd_arena, 32);
+    snprintf(keep, 32, "ControlPersist=%s",
+             persist != NULL && *persist != '\0' ? persist : "600");
+    argv[n++] = "ssh";
+    argv[n++] = "-o";
+    argv[n++] = "ControlMaster=auto";
+    argv[n++] = "-o";
+    argv[n++] = path;
+    argv[n++] = "-o";
+    argv[n++] = keep;
+    if (tty)
+        argv[n++] = "-t";
+    if (op != NULL)
+    {
+        argv[n++] = "-O";
+        argv[n++] = (char *)op;
+    }
+    argv[n++] = (char *)host;
+    if (cmd != NULL)
+        argv[n++] = (char *)cmd;
+    argv[n] = NULL;
+    *argc = n;
+    return argv;
+}
+
+// remote_prefix - turn "remote [-t] host cmd..." at the start of st into
+// the ssh that runs cmd on host, so it is an ordinary job: it takes the
+// foreground, the redirections and ctrl-c, and its output streams
+// straight from ssh to wherever stdout goes. -t gives it a terminal, so
+// that ctrl-c, which ends the local ssh, hangs the remote command up as
+// well. "remote -x host" closes the host's master; remote alone lists
+// the masters and leaves st empty. Returns -1 after a message.
+static int remote_prefix(struct cmdline_stage *st)
+{
+    const char *dir, *op = NULL;
+    int i = 1, tty = 0, argc;
+    char **argv;
+    struct dirent *de;
+    DIR *d;
+
+    if (st->argc == 1)
+    {
+        // every socket in the directory is a master, named user@host:port
+        if ((dir = remote_dir()) != NULL && (d = opendir(dir)) != NULL)
+        {
+            while ((de = readdir(d)) != NULL)
+                if (de->d_name[0] != '.')
+                    printf("%s\n", de->d_name);
+            closedir(d);
+        }
+        st->argc = 0;
+        st->argv[0] = NULL;
+        return 0;
+    }
+    if (!strcmp(st->argv[i], "-t"))
+    {
+        tty = 1;
+        i++;
+    }
+    else if (!strcmp(st->argv[i], "-x"))
+    {
+        op = "exit";
+        i++;
+    }
+    if (i >= st->argc || (op == NULL && i + 1 >= st->argc))
+    {
+        printf("usage: remote [-t] host command | remote -x host\n");
+        return -1;
+    }
+    argv = remote_argv(st->argv[i], op ? NULL : remote_quote(st->argv + i + 1,
+                                                            st->argc - i - 1),
+                       op, tty, &argc);
+    if (argv == NULL)
+        return -1;
+    st->argv = argv;
+    st->argc = argc;
+    return 0;
+}
+
+// remote_task - make the task tok, parsed from line, one ssh that hands
+// the whole line to host's shell
+static void remote_task(struct cmdline_tokens *tok, char *line,
+                        const char *host)
+{
+    struct cmdline_stage *st = &tok->stage[0];
+    size_t len = strlen(line);
+    char *cmd = arena_alloc(&cmd_arena, len + 1);
+    char **argv;
+    int argc;
+
+    memcpy(cmd, line, len + 1);
+    while (len > 0 && (cmd[len - 1] == '\n' || cmd[len - 1] == '&' ||
+                       cmd[len - 1] == ' '))
+        cmd[--len] = '\0';
+    if ((argv = remote_argv(host, cmd, NULL, 0, &argc)) == NULL)
+        return;
+    tok->nstages = 1;
+    st->argv = argv;
+    st->argc = argc;
+    st->nredirs = 0;
+    st->nassigns = 0;
+    st->builtins = BUILTIN_NONE;
+}
+
+// run_task - start line as the next task of a parallel run, in the
+// background through the usual parse and launch path. With group set
+// everything it writes goes to a memfd of its own instead of stdout.
+// The body of a << here-document is read from lr, after the line.
+static void run_task(char *line, struct linereader *lr, int group)
+{
+    struct arena_mark mark = arena_mark(&cmd_arena);
+    struct cmdline_tokens tok;
+    struct task_t *t;
+    int bg, status, idx, saved_out = -1, saved_err = -1;
+    sigset_t mask, prev_mask;
+
+    // blank lines are no task
+    bg = parseline(line, &tok, &cmd_arena);
+    if (bg != -1)
+        line = read_heredocs(line, &tok, lr, &cmd_arena);
+    if (bg != -1 && tok.stage[0].argv[0] == NULL)
+    {
+        arena_release(&cmd_arena, mark);
+        return;
+    }
+
+    // the reaper indexes tasks[], so it may only move with signals blocked
+    sigfillset(&mask);
+    sigprocmask(SIG_BLOCK, &mask, &prev_mask);
+    if (task_runner.ntasks == task_runner.cap)
+    {
+        int cap = task_runner.cap ? 2 * task_runner.cap : INITJOBS;
+        struct task_t *tasks = realloc(task_runner.tasks,
+                                       cap * sizeof(struct task_t));
+        if (tasks == NULL)
+            unix_error("realloc error");
+        task_runner.tasks = tasks;
+        task_runner.cap = cap;
+    }
+    idx = task_runner.ntasks++;
+    t = &task_runner.tasks[idx];
+    if ((t->cmdline = strdup(line)) == NULL)
+        unix_error("strdup error");
+    t->status = 0;
+    t->out_fd = -1;
+    t->done = 0;
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+
+    // point stdout and stderr at the task's memfd while it starts
+    if (group)
+    {
+        if ((t->out_fd = memfd_create("tsh-task", MFD_CLOEXEC)) < 0)
+            unix_error("memfd_create error");
+        fflush(stdout);
+        saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+        saved_err = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+        dup2(t->out_fd, STDOUT_FILENO);
+        dup2(t->out_fd, STDERR_FILENO);
+    }
+
+    // with --hosts the whole line runs on the next host, its shell
+    // parsing it there
+    if (task_runner.nhosts > 0 && bg != -1)
+        remote_task(&tok, line, task_runner.hosts[idx % task_runner.nhosts]);
+
+    // deal the task out to the next CPU or node
+    if (task_runner.spread != SPREAD_NONE &&
+        spread_placement(task_runner.spread,
+                         task_runner.spread_ids[idx % task_runner.nspread],
+                         &task_runner.place) < 0)
+        fprintf(stderr, "parallel: can't place task %d\n", idx + 1);
+
+    // a command that doesn't leave a job behind is done right away
+    task_runner.cur = idx;
+    status = bg == -1 ? W_EXITCODE(2, 0) : eval_tokens(line, &tok, 1);
+    task_runner.cur = -1;
+    if (status != -1)
+    {
+        t->status = status;
+        t->done = 1;
+    }
+
+    if (group)
+    {
+        fflush(stdout);
+        dup2(saved_out, STDOUT_FILENO);
+        dup2(saved_err, STDERR_FILENO);
+        close(saved_out);
+        close(saved_err);
+    }
+    arena_release(&cmd_arena, mark);
+}
+
+// flush_tasks - print the held back output of every task that is done
+static void flush_tasks(void)
+{
+    int i;
+    struct task_t *t;
+
+    for (i = 0; i < task_runner.ntasks; i++)
+    {
+        t = &task_runner.tasks[i];
+        if (!t->done || t->out_fd < 0)
+            continue;
+        fflush(stdout);
+        if (lseek(t->out_fd, 0, SEEK_SET) < 0 ||
+            copyfd(t->out_fd, STDOUT_FILENO) < 0)
+            fprintf(stderr, "parallel: %s\n", strerror(errno));
+        close(t->out_fd);
+        t->out_fd = -1;
+    }
+}
+
+// interrupt_tasks - pass a ctrl-c on to every running task, waking the
+// stopped ones so that they see it
+static void interrupt_tasks(void)
+{
+    int i;
+    struct job_t *job;
+
+    for (i = 1; i <= job_list.maxjid; i++)
+    {
+        job = &job_list.jobs[i];
+        if (job->pid == 0 || job->task < 0)
+            continue;
+        kill(-(job->pid), SIGINT);
+        if (job->state == ST)
+            resumejob(&job_list, job, BG);
+    }
+}
+
+// spread_ids - list the CPUs the shell may run on (SPREAD_CPUS), or the
+// online NUMA nodes (SPREAD_NODES), in ids[]. Returns how many, or -1.
+static int spread_ids(int spread, int *ids, int max)
+{
+    cpu_set_t set;
+    int cpu, n = 0;
+
+    if (spread == SPREAD_NODES)
+        return read_idlist("/sys/devices/system/node/online", ids, max);
+    if (sched_getaffinity(0, sizeof(set), &set) < 0)
+        return -1;
+    for (cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++)
+        if (CPU_ISSET(cpu, &set))
+            ids[n++] = cpu;
+    return n;
+}
+
+// parallel_handler - parallel [-j N] [-g] [file]: run the command lines
+// of file (or of stdin) as background jobs, N at a time (by default as
+// many as there are online CPUs), starting the next line as soon as the
+// reaper reports a task done. With -g the output of a task is held back
+// and printed in one piece once it is done. --spread cpus (or nodes)
+// deals the tasks out round-robin to the CPUs (or NUMA nodes) the
+// shell may use. Tasks that failed are listed with their exit status
+// at the end. ctrl-c stops reading lines and is passed on to the tasks
+// still running.
+void parallel_handler(struct cmdline_stage *st)
+{
+    struct linereader file, *lr = &cmd_input;
+    int i, fd = -1, null_fd, group = 0, spread = SPREAD_NONE, nfailed = 0;
+    long njobs = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *name, *hosts = NULL;
+    char *line, *h;
+    struct task_t *t;
+    sigset_t mask, prev_mask;
+
+    for (i = 1; i < st->argc && st->argv[i][0] == '-'; i++)
+    {
+        if (!strcmp(st->argv[i], "-g"))
+            group = 1;
+        else if (!strcmp(st->argv[i], "--spread") && i + 1 < st->argc)
+        {
+            name = st->argv[++i];
+            if (!strcmp(name, "cpus"))
+                spread = SPREAD_CPUS;
+            else if (!strcmp(name, "nodes"))
+                spread = SPREAD_NODES;
+            else
+            {
+                printf("parallel: --spread takes cpus or nodes\n");
+                return;
+            }
+        }
+        else if (!strcmp(st->argv[i], "--hosts") && i + 1 < st->argc)
+            hosts = st->argv[++i];
+        else if (!strncmp(st->argv[i], "-j", 2))
+        {
+            name = st->argv[i][2] ? &st->argv[i][2] : st->argv[++i];
+            if (name == NULL || (njobs = atol(name)) < 1)
+            {
+                printf("parallel: -j needs a positive number\n");
+                return;
+            }
+        }
+        else
+        {
+            printf("usage: parallel [-j N] [-g] [--spread cpus|nodes] "
+                   "[--hosts host,...] [file]\n");
+            return;
+        }
+    }
+    if (njobs < 1)
+        njobs = 1;
+    if (task_runner.active)
+    {
+        printf("parallel: already running\n");
+        return;
+    }
+
+    // the lines come from the file, else from a redirected stdin, which
+    // the tasks are kept from reading, else from wherever the shell
+    // reads its own commands
+    if (i < st->argc)
+    {
+        if ((fd = open(st->argv[i], O_RDONLY | O_CLOEXEC)) < 0)
+        {
+            fprintf(stderr, "parallel: %s: %s\n", st->argv[i],
+                    strerror(errno));
+            return;
+        }
+        initreader(&file, fd, LINEBLOCK);
+        lr = &file;
+    }
+    else if (redirects(st, STDIN_FILENO))
+    {
+        if ((fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3)) < 0 ||
+            (null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+        {
+            fprintf(stderr, "parallel: %s\n", strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+        dup2(null_fd, STDIN_FILENO);
+        close(null_fd);
+        initreader(&file, fd, LINEBLOCK);
+        lr = &file;
+    }
+
+    // the CPUs (those the shell may use) or nodes to deal tasks out to
+    if (spread != SPREAD_NONE)
+    {
+        int max = spread == SPREAD_CPUS ? CPU_SETSIZE : NODEBITS;
+        if (task_runner.spread_ids == NULL &&
+            (task_runner.spread_ids = malloc(
+                 (CPU_SETSIZE > NODEBITS ? CPU_SETSIZE : NODEBITS) *
+                 sizeof(int))) == NULL)
+            unix_error("malloc error");
+        task_runner.nspread = spread_ids(spread, task_runner.spread_ids, max);
+        if (task_runner.nspread <= 0)
+        {
+            printf("parallel: no %s to spread over\n",
+                   spread == SPREAD_CPUS ? "CPUs" : "NUMA nodes");
+            spread = SPREAD_NONE;
+        }
+    }
+
+    // the hosts to deal the lines out to, in turn
+    if (hosts != NULL)
+    {
+        if ((h = task_runner.hostbuf = strdup(hosts)) == NULL)
+            unix_error("strdup error");
+        task_runner.hosts = arena_alloc(&cmd_arena,
+                                        (strlen(h) / 2 + 1) * sizeof(char *));
+        for (name = strtok(h, ","); name != NULL; name = strtok(NULL, ","))
+            task_runner.hosts[task_runner.nhosts++] = (char *)name;
+    }
+
+    task_runner.active = 1;
+    task_runner.group = group;
+    task_runner.spread = spread;
+    builtin_intr = 0;
+    sigfillset(&mask);
+    while (1)
+    {
+        // wait for a free slot
+        sigprocmask(SIG_BLOCK, &mask, &prev_mask);
+        while (task_runner.nrunning >= njobs && !builtin_intr)
+            wait_child_event(&prev_mask);
+        sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+        flush_tasks();
+
+        if (builtin_intr || (line = readline_src(lr)) == NULL)
+            break;
+        run_task(line, lr, group);
+    }
+
+    // wait for the rest, passing every ctrl-c on to them
+    sigprocmask(SIG_BLOCK, &mask, &prev_mask);
+    while (task_runner.nrunning > 0)
+    {
+        if (builtin_intr)
+        {
+            interrupt_tasks();
+            builtin_intr = 0;
+        }
+        wait_child_event(&prev_mask);
+    }
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+    flush_tasks();
+
+    // report the tasks that failed, then forget the run
+    for (i = 0; i < task_runner.ntasks; i++)
+    {
+        t = &task_runner.tasks[i];
+        if (t->status != 0)
+        {
+            nfailed++;
+            if (WIFSIGNALED(t->status))
+                printf("parallel: task %d (%s) terminated by signal %d\n",
+                       i + 1, t->cmdline, WTERMSIG(t->status));
+            else
+                printf("parallel: task %d (%s) exited with status %d\n",
+                       i + 1, t->cmdline, WEXITSTATUS(t->status));
+        }
+        free(t->cmdline);
+    }
+    if (nfailed > 0)
+        printf("parallel: %d of %d tasks failed\n", nfailed,
+               task_runner.ntasks);
+    task_runner.ntasks = 0;
+    task_runner.active = 0;
+    task_runner.group = 0;
+    task_runner.spread = SPREAD_NONE;
+    free(task_runner.hostbuf);
+    task_runner.hostbuf = NULL;
+    task_runner.nhosts = 0;
+
+    if (fd >= 0)
+    {
+        close(fd);
+        free(file.buf);
+    }
+}
+
+// taskset_prefix - parse "taskset [-m nodes | -i nodes] cpus" at the
+// start of st into place: the CPUs the command may run on, and the
+// NUMA nodes its memory is bound to (-m) or interleaved over (-i).
+// A builtin that runs in the shell itself is not moved. Returns the
+// number of words it took up, or -1 after a message.
+static int taskset_prefix(struct cmdline_stage *st, struct placement *place)
+{
+    unsigned long cpus[CPU_SETSIZE / (8 * sizeof(unsigned long))];
+    int i = 1, cpu;
+
+    memset(place, 0, sizeof(*place));
+    place->mpol = MPOL_DEFAULT;
+    if (i + 1 < st->argc &&
+        (!strcmp(st->argv[i], "-m") || !strcmp(st->argv[i], "-i")))
+    {
+        place->mpol = st->argv[i][1] == 'm' ? MPOL_BIND : MPOL_INTERLEAVE;
+        if (parse_idlist(st->argv[i + 1], place->nodes, NODEBITS) <= 0)
+        {
+            printf("taskset: bad node list: %s\n", st->argv[i + 1]);
+            return -1;
+        }
+        i += 2;
+    }
+    if (i >= st->argc || parse_idlist(st->argv[i], cpus, CPU_SETSIZE) <= 0)
+    {
+        printf("usage: taskset [-m nodes | -i nodes] cpus command\n");
+        return -1;
+    }
+
+    place->has_cpus = 1;
+    CPU_ZERO(&place->cpus);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (cpus[cpu / (8 * sizeof(unsigned long))] &
+            (1UL << (cpu % (8 * sizeof(unsigned long)))))
+            CPU_SET(cpu, &place->cpus);
+    return i + 1;
+}
+
+// parse_rlim - parse a limit given as a number or "unlimited",
+// multiplied by scale. Returns 0, or -1 if it is malformed.
+static int parse_rlim(const char *arg, rlim_t scale, rlim_t *val)
+{
+    char *end;
+    unsigned long long n;
+
+    if (!strcmp(arg, "unlimited"))
+    {
+        *val = RLIM_INFINITY;
+        return 0;
+    }
+    errno = 0;
+    n = strtoull(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno != 0 || *arg == '-')
+        return -1;
+    *val = n * scale;
+    return 0;
+}
+
+// limit_prefix - parse "limit [-t secs] [-v kbytes] [-n files]
+// [-m bytes] [-c percent] cmd" at the start of st into lim. -t, -v
+// and -n are set with setrlimit in every child (soft and hard); -m
+// (memory.max, which takes K, M and G suffixes) and -c (cpu.max, in
+// percent of one CPU) put the job in a cgroup of its own. Returns the
+// number of words it took up, or -1 after a message.
+static int limit_prefix(struct cmdline_stage *st, struct limits *lim)
+{
+    const char *arg;
+    size_t len;
+    rlim_t pct;
+    int i;
+
+    memset(lim, 0, sizeof(*lim));
+    lim->cgfd = -1;
+    for (i = 1; i + 1 < st->argc && st->argv[i][0] == '-'; i += 2)
+    {
+        arg = st->argv[i + 1];
+        if (!strcmp(st->argv[i], "-t") && parse_rlim(arg, 1, &lim->cpu) == 0)
+            lim->set |= LIMIT_CPU;
+        else if (!strcmp(st->argv[i], "-v") &&
+                 parse_rlim(arg, 1024, &lim->as) == 0)
+            lim->set |= LIMIT_AS;
+        else if (!strcmp(st->argv[i], "-n") &&
+                 parse_rlim(arg, 1, &lim->nofile) == 0)
+            lim->set |= LIMIT_NOFILE;
+        else if (!strcmp(st->argv[i], "-m") &&
+                 (len = strspn(arg, "0123456789")) > 0 &&
+                 strlen(arg) <= len + 1 && strchr("KMG", arg[len]) != NULL &&
+                 strlen(arg) < sizeof(lim->memory_max))
+        {
+            strcpy(lim->memory_max, arg);
+            lim->set |= LIMIT_CGROUP;
+        }
+        else if (!strcmp(st->argv[i], "-c") && parse_rlim(arg, 1, &pct) == 0 &&
+                 pct != RLIM_INFINITY && pct > 0)
+        {
+            snprintf(lim->cpu_max, sizeof(lim->cpu_max), "%llu 100000",
+                     (unsigned long long)pct * 1000);
+            lim->set |= LIMIT_CGROUP;
+        }
+        else
+            break;
+    }
+    if (lim->set == 0 || i >= st->argc || st->argv[i][0] == '-')
+    {
+        printf("usage: limit [-t secs] [-v kbytes] [-n files] [-m bytes] "
+               "[-c percent] command\n");
+        return -1;
+    }
+    return i;
+}
+
+// prefix_builtin - whether b is one of the prefixes (time, taskset,
+// limit, memo, remote), which only count at the start of a line
+static int prefix_builtin(int b)
+{
+    return b == BUILTIN_TIME || b == BUILTIN_TASKSET || b == BUILTIN_LIMIT ||
+           b == BUILTIN_MEMO || b == BUILTIN_REMOTE;
+}
+
+// memo_prefix - parse "memo [-i file]... cmd" at the start of st into m:
+// the files, besides those it redirects from, the command's result
+// depends on. memo alone reports what the cache has done. Returns the
+// number of words it took up, 0 if there is no command, or -1 after a
+// message.
+static int memo_prefix(struct cmdline_stage *st, struct memo_t *m)
+{
+    int i;
+
+    m->inputs = arena_alloc(&cmd_arena, st->argc * sizeof(char *));
+    m->ninputs = 0;
+    for (i = 1; i + 1 < st->argc && !strcmp(st->argv[i], "-i"); i += 2)
+        m->inputs[m->ninputs++] = st->argv[i + 1];
+    if (st->argc == 1)
+    {
+        memo_open();
+        printf("memo: %lu hits, %lu misses, %lu uncached, %lu evicted\n",
+               memo_stats.hits, memo_stats.misses, memo_stats.uncached,
+               memo_stats.evictions);
+        if (memo_stats.dir != NULL)
+            printf("memo: %lld of %lld bytes in %s\n", memo_stats.bytes,
+                   memo_stats.limit, memo_stats.dir);
+        return 0;
+    }
+    if (i >= st->argc || st->argv[i][0] == '-')
+    {
+        printf("usage: memo [-i file]... command\n");
+        return -1;
+    }
+    return i;
+}
+
+// ulimit_handler - ulimit [-H | -S] [-a | -t | -v | -n] [limit]: show
+// (all of them with -a or no option) or set the shell's CPU time,
+// address space and open files limits, which every job inherits. A
+// new limit sets both the soft and the hard limit, unless -S or -H
+// picks one.
+void ulimit_handler(struct cmdline_stage *st)
+{
+    static const struct
+    {
+        char opt;
+        int resource;
+        rlim_t scale;
+        const char *name;
+    } res[] = {{'t', RLIMIT_CPU, 1, "cpu time (seconds, -t)"},
+               {'v', RLIMIT_AS, 1024, "virtual memory (kbytes, -v)"},
+               {'n', RLIMIT_NOFILE, 1, "open files (-n)"}};
+    int i, k, nres = sizeof(res) / sizeof(res[0]);
+    int soft = 0, hard = 0, pick = -1, all = 0;
+    const char *p;
+    struct rlimit rl;
+    rlim_t val, cur;
+
+    for (i = 1; i < st->argc && st->argv[i][0] == '-'; i++)
+    {
+        for (p = &st->argv[i][1]; *p != '\0'; p++)
+        {
+            for (k = 0; k < nres && res[k].opt != *p; k++)
+                ;
+            if (*p == 'S')
+                soft = 1;
+            else if (*p == 'H')
+                hard = 1;
+            else if (*p == 'a')
+                all = 1;
+            else if (k < nres)
+                pick = k;
+            else
+            {
+                printf("usage: ulimit [-H | -S] [-a | -t | -v | -n] "
+                       "[limit]\n");
+                return;
+            }
+        }
+    }
+
+    // show one limit, or all of them
+    if (i >= st->argc)
+    {
+        fflush(stdout);
+        for (k = 0; k < nres; k++)
+        {
+            if (!(all || pick < 0 || pick == k))
+                continue;
+            getrlimit(res[k].resource, &rl);
+            cur = hard ? rl.rlim_max : rl.rlim_cur;
+            if (all || pick < 0)
+                printf("%-28s ", res[k].name);
+            if (cur == RLIM_INFINITY)
+                printf("unlimited\n");
+            else
+                printf("%llu\n", (unsigned long long)(cur / res[k].scale));
+        }
+        return;
+    }
+
+    if (pick < 0 || all || parse_rlim(st->argv[i], res[pick].scale, &val) < 0)
+    {
+        printf("usage: ulimit [-H | -S] [-a | -t | -v | -n] [limit]\n");
+        return;
+    }
+    getrlimit(res[pick].resource, &rl);
+    if (!hard || soft)
+        rl.rlim_cur = val;
+    if (!soft || hard)
+        rl.rlim_max = val;
+    if (setrlimit(res[pick].resource, &rl) < 0)
+        printf("ulimit: %s\n", strerror(errno));
+}
+
+#define BENCH_LINES 64    /* lines in the parseline() corpus */
+#define BENCH_LINELEN 8192 /* approximate length of each of them */
+#define BENCH_REAP 1000    /* children that exit at once per reap round */
+
+// ns_now - the CLOCK_MONOTONIC time in nanoseconds
+static long long ns_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// bench -o appends each result to this file, as a JSON line
+static FILE *bench_log;
+
+// bench_report - print the p50 and p99 of n samples (in nanoseconds),
+// plus an optional note. With bench -o the result is recorded, under
+// $TSH_BENCH_LABEL (a commit, say), so runs can be compared over time.
+static void bench_report(const char *name, long long *ns, int n,
+                         const char *note)
+{
+    int p99 = n * 99 / 100;
+    const char *label = getenv("TSH_BENCH_LABEL");
+
+    qsort(ns, n, sizeof(long long), cmp_ll);
+    printf("%-12s %7d  p50 %11.2fus  p99 %11.2fus%s%s\n", name, n,
+           ns[n / 2] / 1000.0, ns[p99 < n ? p99 : n - 1] / 1000.0,
+           note ? "  " : "", note ? note : "");
+    if (bench_log != NULL)
+        fprintf(bench_log,
+                "{\"label\":\"%s\",\"time\":%ld,\"bench\":\"%s\",\"n\":%d,"
+                "\"p50_ns\":%lld,\"p99_ns\":%lld}\n",
+                label ? label : "", (long)time(NULL), name, n, ns[n / 2],
+                ns[p99 < n ? p99 : n - 1]);
+}
+
+// bench_startup - time from exec of the shell to its first prompt
+static int bench_startup(long long *ns, int runs)
+{
+    sigset_t mask, prev_mask;
+    char buf[64];
+    int in[2], out[2], n, got, status;
+    pid_t pid;
+    long long t0;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    for (n = 0; n < runs && !builtin_intr; n++)
+    {
+        // keep the reaper off this child, whose exit we collect here
+        sigprocmask(SIG_BLOCK, &mask, &prev_mask);
+        if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0)
+            unix_error("error with pipe");
+        fflush(stdout);
+        t0 = ns_now();
+        if ((pid = fork()) < 0)
+            unix_error("error with fork");
+        if (pid == 0)
+        {
+            dup2(in[0], STDIN_FILENO);
+            dup2(out[1], STDOUT_FILENO);
+            sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+            execl("/proc/self/exe", "tsh", (char *)NULL);
+            _exit(127);
+        }
+        close(in[0]);
+        close(out[1]);
+        for (got = 0; got < (int)strlen(prompt);)
+        {
+            ssize_t r = read(out[0], buf, sizeof(buf));
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                break;
+            got += r;
+        }
+        ns[n] = ns_now() - t0;
+        close(in[1]); /* end of file: the shell exits */
+        close(out[0]);
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+            ;
+        sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+        if (got < (int)strlen(prompt))
+            return -1;
+    }
+    return n;
+}
+
+// bench_eval - time eval() of line, runs times, after a few warm-ups
+static int bench_eval(long long *ns, int runs, const char *line)
+{
+    char cmd[MAXLINE_TSH];
+    long long t0;
+    int n;
+
+    for (n = 0; n < 8; n++)
+    {
+        strcpy(cmd, line);
+        eval(cmd);
+    }
+    for (n = 0; n < runs && !builtin_intr; n++)
+    {
+        strcpy(cmd, line);
+        t0 = ns_now();
+        eval(cmd);
+        ns[n] = ns_now() - t0;
+    }
+    return n;
+}
+
+// bench_corpus - make the same BENCH_LINES long command lines every
+// time: four-stage pipelines of words and quoted strings, reading a
+// file and writing one
+static char *bench_corpus(void)
+{
+    static const char *quoted[] = {" 'a quoted string'", " \"double quoted\""};
+    unsigned seed = 12345;
+    char *corpus, *p, *stage;
+    int i, s, k, len;
+
+    if ((corpus = malloc(BENCH_LINES * (BENCH_LINELEN + 256))) == NULL)
+        unix_error("malloc error");
+    for (p = corpus, i = 0; i < BENCH_LINES; i++)
+    {
+        for (s = 0; s < 4; s++)
+        {
+            stage = p;
+            p += sprintf(p, "%scmd%d", s ? " | " : "", s);
+            while (p - stage < BENCH_LINELEN / 4)
+            {
+                seed = seed * 1103515245 + 12345;
+                if ((seed >> 16) % 8 == 0)
+                {
+                    p += sprintf(p, "%s", quoted[(seed >> 20) % 2]);
+                    continue;
+                }
+                *p++ = (seed >> 24) % 3 ? ' ' : '\t';
+                for (k = 0, len = 1 + (seed >> 12) % 16; k < len; k++)
+                    *p++ = 'a' + (seed >> k) % 26;
+            }
+            if (s == 0)
+                p += sprintf(p, " < infile");
+        }
+        p += sprintf(p, " > outfile") + 1;
+    }
+    return corpus;
+}
+
+// bench_parse - time parseline() on each line of the corpus, runs
+// passes; *bytes gets the corpus size
+static int bench_parse(long long *ns, int runs, size_t *bytes)
+{
+    char *corpus = bench_corpus(), *line;
+    struct cmdline_tokens tok;
+    struct arena_mark mark;
+    long long t0;
+    int n = 0, r, i;
+
+    *bytes = 0;
+    for (line = corpus, i = 0; i < BENCH_LINES; i++)
+    {
+        *bytes += strlen(line);
+        line += strlen(line) + 1;
+    }
+    for (r = 0; r < runs && !builtin_intr; r++)
+    {
+        for (line = corpus, i = 0; i < BENCH_LINES; i++)
+        {
+            mark = arena_mark(&cmd_arena);
+            t0 = ns_now();
+            parseline(line, &tok, &cmd_arena);
+            ns[n++] = ns_now() - t0;
+            arena_release(&cmd_arena, mark);
+            line += strlen(line) + 1;
+        }
+    }
+    free(corpus);
+    return n;
+}
+
+// bench_reap - time how long the reaper takes to collect BENCH_REAP
+// background jobs whose processes all exit at once, runs rounds
+static int bench_reap(long long *ns, int runs)
+{
+    sigset_t mask, prev_mask;
+    pid_t pids[BENCH_REAP];
+    int gate[2], n, i, k;
+    char c;
+    long long t0;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    for (n = 0; n < runs && !builtin_intr; n++)
+    {
+        // the children wait at a pipe, so that they all exit when the
+        // shell closes it
+        if (pipe2(gate, O_CLOEXEC) < 0)
+            unix_error("error with pipe");
+        fflush(stdout);
+        sigprocmask(SIG_BLOCK, &mask, &prev_mask);
+        for (i = 0; i < BENCH_REAP; i++)
+        {
+            if ((pids[i] = fork()) < 0)
+                unix_error("error with fork");
+            if (pids[i] == 0)
+            {
+                setpgid(0, 0);
+                close(gate[1]);
+                while (read(gate[0], &c, 1) < 0 && errno == EINTR)
+                    ;
+                _exit(0);
+            }
+            addjob(&job_list, &pids[i], 1, BG, "bench reap");
+        }
+        close(gate[0]);
+
+        t0 = ns_now();
+        close(gate[1]);
+        for (k = 0; k < BENCH_REAP;)
+        {
+            if (getjobpid(&job_list, pids[k]) == NULL)
+                k++;
+            else
+                wait_child_event(&prev_mask);
+        }
+        ns[n] = ns_now() - t0;
+        sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+    }
+    return n;
+}
+
+// bench_handler - bench [-n runs] [-o file] [startup|eval|builtin|parse|reap...]:
+// measure the shell's hot paths and print the p50 and p99 of each: the
+// time from exec to the first prompt, eval() of /bin/true with the fork
+// and the spawn engine, dispatch of a builtin (hash of a path, which
+// does no work), parseline() of long synthetic lines, and the reaping
+// of BENCH_REAP jobs that exit at once. The inputs are the same every
+// time, so runs can be compared; -o appends the results to file (see
+// bench_report). ctrl-c cuts a benchmark short.
+void bench_handler(struct cmdline_stage *st)
+{
+    static const char *names[] = {"startup", "eval", "builtin", "parse",
+                                  "reap"};
+    static const int defruns[] = {20, 500, 10000, 50, 5};
+    int nbench = sizeof(names) / sizeof(names[0]);
+    int i, b, n, runs = 0, first;
+    int want[sizeof(names) / sizeof(names[0])] = {0};
+    int saved_spawn = use_spawn;
+    long long *ns, total;
+    size_t bytes;
+    char note[MAXLINE_TSH];
+    const char *log = NULL;
+
+    for (first = 1; first < st->argc && st->argv[first][0] == '-'; first++)
+    {
+        if (!strcmp(st->argv[first], "-n") && first + 1 < st->argc &&
+            (runs = atoi(st->argv[first + 1])) > 0)
+            first++;
+        else if (!strcmp(st->argv[first], "-o") && first + 1 < st->argc)
+            log = st->argv[++first];
+        else
+        {
+            printf("usage: bench [-n runs] [-o file] [startup|eval|builtin|"
+                   "parse|reap...]\n");
+            return;
+        }
+    }
+    for (i = first; i < st->argc; i++)
+    {
+        for (b = 0; b < nbench && strcmp(st->argv[i], names[b]); b++)
+            ;
+        if (b == nbench)
+        {
+            printf("bench: unknown benchmark %s\n", st->argv[i]);
+            return;
+        }
+        want[b] = 1;
+    }
+    if (first == st->argc)
+        for (b = 0; b < nbench; b++)
+            want[b] = 1;
+    if (log != NULL && (bench_log = fopen(log, "ae")) == NULL)
+    {
+        fprintf(stderr, "bench: %s: %s\n", log, strerror(errno));
+        return;
+    }
+
+    builtin_intr = 0;
+    for (b = 0; b < nbench && !builtin_intr; b++)
+    {
+        if (!want[b])
+            continue;
+        n = runs > 0 ? runs : defruns[b];
+        if (b == 3)
+            n *= BENCH_LINES;
+        if ((ns = malloc(2 * n * sizeof(long long))) == NULL)
+            unix_error("malloc error");
+
+        switch (b)
+        {
+        case 0:
+            if ((n = bench_startup(ns, n)) <= 0)
+                printf("bench: startup: the shell gave no prompt\n");
+            else
+                bench_report("startup", ns, n, NULL);
+            break;
+        case 1:
+            use_spawn = 0;
+            if ((n = bench_eval(ns, n, "/bin/true")) > 0)
+                bench_report("eval-fork", ns, n, NULL);
+            use_spawn = 1;
+            if ((n = bench_eval(ns, n, "/bin/true")) > 0)
+                bench_report("eval-spawn", ns, n, NULL);
+            use_spawn = saved_spawn;
+            break;
+        case 2:
+            if ((n = bench_eval(ns, n, "hash /bin/true")) > 0)
+                bench_report("builtin", ns, n, NULL);
+            break;
+        case 3:
+            if ((n = bench_parse(ns, n / BENCH_LINES, &bytes)) > 0)
+            {
+                for (total = 0, i = 0; i < n; i++)
+                    total += ns[i];
+                snprintf(note, sizeof(note), "%zu-byte lines, %.1f MB/s",
+                         bytes / BENCH_LINES,
+                         (double)bytes * (n / BENCH_LINES) * 1000.0 / total);
+                bench_report("parse", ns, n, note);
+            }
+            break;
+        case 4:
+            if ((n = bench_reap(ns, n)) > 0)
+            {
+                snprintf(note, sizeof(note), "per %d jobs", BENCH_REAP);
+                bench_report("reap", ns, n, note);
+            }
+            break;
+        }
+        fflush(stdout);
+        free(ns);
+    }
+    if (bench_log != NULL)
+    {
+        fclose(bench_log);
+        bench_log = NULL;
+    }
+}
+
+// trace_handler - trace [on | off | dump [file]]: turn tracing on or
+// off, or write the trace so far to file (stdout by default) as Chrome
+// trace JSON, which chrome://tracing and Perfetto load. Without an
+// argument, tells whether tracing is on.
+void trace_handler(struct cmdline_stage *st)
+{
+    int fd = STDOUT_FILENO;
+
+    if (st->argc == 1)
+    {
+        printf("trace: %s, %u events\n", trace_on ? "on" : "off",
+               atomic_load(&trace_head));
+        return;
+    }
+    if (!strcmp(st->argv[1], "on"))
+    {
+        trace_pid = getpid();
+        trace_on = 1;
+        return;
+    }
+    if (!strcmp(st->argv[1], "off"))
+    {
+        trace_on = 0;
+        return;
+    }
+    if (strcmp(st->argv[1], "dump") != 0 || st->argc > 3)
+    {
+        printf("usage: trace [on | off | dump [file]]\n");
+        return;
+    }
+
+    fflush(stdout);
+    if (st->argc == 3 &&
+        (fd = open(st->argv[2], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   0666)) < 0)
+    {
+        fprintf(stderr, "trace: %s: %s\n", st->argv[2], strerror(errno));
+        return;
+    }
+    if (trace_dump(fd) < 0)
+        fprintf(stderr, "trace: %s\n", strerror(errno));
+    if (fd != STDOUT_FILENO)
+        close(fd);
+}
+
+// find_pool - the worker pool called name, or NULL. A pool whose job
+// is gone (its workers were killed) is forgotten on the way.
+static struct pool_t *find_pool(const char *name)
+{
+    struct pool_t *p;
+    int i, w;
+
+    for (i = 0; i < worker_pools.n; i++)
+    {
+        p = &worker_pools.pools[i];
+        if (strcmp(p->name, name) != 0)
+            continue;
+        if (getjobpid(&job_list, p->pgid) != NULL)
+            return p;
+        for (w = 0; w < p->n; w++)
+            if (p->fds[w] >= 0)
+                close(p->fds[w]);
+        worker_pools.pools[i] = worker_pools.pools[--worker_pools.n];
+        return NULL;
+    }
+    return NULL;
+}
+
+// pool_gone - forget worker w of pool p, whose socket has closed
+static void pool_gone(struct pool_t *p, int w)
+{
+    fprintf(stderr, "worker: %s: worker %d exited\n", p->name, w + 1);
+    close(p->fds[w]);
+    p->fds[w] = -1;
+    p->busy[w] = 0;
+}
+
+// pool_send - send request line to worker w of pool p. Returns 0, or
+// -1 if the worker has gone.
+static int pool_send(struct pool_t *p, int w, const char *line, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        // MSG_NOSIGNAL: a dead worker is an error here, not a SIGPIPE
+        n = send(p->fds[w], line, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            pool_gone(p, w);
+            return -1;
+        }
+        line += n;
+        len -= n;
+    }
+    p->busy[w] = 1;
+    p->requests++;
+    return 0;
+}
+
+// pool_reply - copy the reply of worker w of pool p, up to its NUL, to
+// out_fd, or drop it if out_fd is -1. Returns 0, or -1 if the worker
+// has gone or ctrl-c cut the wait short; the worker then stays busy,
+// and the rest of its reply is dropped before its next request.
+static int pool_reply(struct pool_t *p, int w, int out_fd)
+{
+    char buf[REPLYBLOCK];
+    struct pollfd pfd;
+    ssize_t n;
+    char *nul;
+
+    pfd.fd = p->fds[w];
+    pfd.events = POLLIN;
+    while (1)
+    {
+        // poll, unlike a restarted recv, returns to check for ctrl-c
+        if (poll(&pfd, 1, -1) < 0)
+        {
+            if (errno == EINTR && !builtin_intr)
+                continue;
+            return -1;
+        }
+        if ((n = recv(pfd.fd, buf, sizeof(buf), 0)) < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            pool_gone(p, w);
+            return -1;
+        }
+        nul = memchr(buf, '\0', n);
+        if (out_fd >= 0 && writeall(out_fd, buf, nul ? nul - buf : n) < 0)
+            out_fd = -1;
+        if (nul != NULL)
+        {
+            p->busy[w] = 0;
+            return 0;
+        }
+    }
+}
+
+// pool_pick - the next worker of pool p in turn that is alive and not
+// listed in skip, or -1 if there is none
+static int pool_pick(struct pool_t *p, const char *skip)
+{
+    int i, w;
+
+    for (i = 0; i < p->n; i++)
+    {
+        w = (p->next + i) % p->n;
+        if (p->fds[w] >= 0 && !(skip && skip[w]))
+        {
+            p->next = (w + 1) % p->n;
+            return w;
+        }
+    }
+    return -1;
+}
+
+// start_pool - worker start name [-n N] command [args...]: start N
+// workers (one by default) of the program, as one background job
+static void start_pool(struct cmdline_stage *st)
+{
+    struct cmdline_stage prog;
+    struct launch_t how;
+    struct pool_t *p;
+    sigset_t set, prev_set, child_mask;
+    pid_t pids[MAXWORKERS], pid;
+    int i, n = 1, arg = 3, sv[2], npids = 0;
+    char *cmdline;
+    size_t len;
+
+    if (st->argc > 4 && !strcmp(st->argv[3], "-n"))
+    {
+        n = atoi(st->argv[4]);
+        arg = 5;
+    }
+    if (st->argc <= arg || n < 1 || n > MAXWORKERS ||
+        strlen(st->argv[2]) >= sizeof(p->name))
+    {
+        printf("usage: worker start name [-n 1-%d] command [args...]\n",
+               MAXWORKERS);
+        return;
+    }
+    if (find_pool(st->argv[2]) != NULL)
+    {
+        printf("worker: %s: already running\n", st->argv[2]);
+        return;
+    }
+    prog.argc = st->argc - arg;
+    prog.argv = st->argv + arg;
+    prog.nredirs = 0;
+    prog.redirs = NULL;
+    prog.nassigns = 0;
+    prog.assigns = NULL;
+    if ((prog.builtins = builtin_id(prog.argv[0])) != BUILTIN_NONE)
+    {
+        printf("worker: %s: not a program\n", prog.argv[0]);
+        return;
+    }
+
+    if (worker_pools.n == worker_pools.cap)
+    {
+        int cap = worker_pools.cap ? 2 * worker_pools.cap : 4;
+        struct pool_t *pools = realloc(worker_pools.pools,
+                                       cap * sizeof(struct pool_t));
+        if (pools == NULL)
+            unix_error("realloc error");
+        worker_pools.pools = pools;
+        worker_pools.cap = cap;
+    }
+    p = &worker_pools.pools[worker_pools.n];
+    memset(p, 0, sizeof(*p));
+    strcpy(p->name, st->argv[2]);
+    p->n = n;
+
+    // the job is listed as the command that started it
+    for (i = 0, len = 1; i < st->argc; i++)
+        len += strlen(st->argv[i]) + 1;
+    cmdline = arena_alloc(&cmd_arena, len);
+    for (i = 0, cmdline[0] = '\0'; i < st->argc; i++)
+    {
+        strcat(cmdline, st->argv[i]);
+        strcat(cmdline, i < st->argc - 1 ? " " : "");
+    }
+
+    fflush(stdout);
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGTSTP);
+    sigaddset(&set, SIGINT);
+    sigprocmask(SIG_BLOCK, &set, &prev_set);
+    child_mask = prev_set;
+    sigdelset(&child_mask, SIGCHLD);
+
+    // each worker gets one end of a socket pair as stdin and stdout
+    how.pgid = 0;
+    how.err_fd = -1;
+    how.place = NULL;
+    how.limits = NULL;
+    for (i = 0; i < n; i++)
+    {
+        p->fds[i] = -1;
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        {
+            fprintf(stderr, "worker: socketpair: %s\n", strerror(errno));
+            break;
+        }
+        how.in_fd = how.out_fd = sv[1];
+        pid = launch(&prog, &how, &set, &child_mask);
+        close(sv[1]);
+        if (pid < 0)
+        {
+            close(sv[0]);
+            break;
+        }
+        if (how.pgid == 0)
+            how.pgid = pid;
+        p->fds[i] = sv[0];
+        pids[npids++] = pid;
+    }
+    p->n = npids;
+
+    if (npids > 0)
+    {
+        addjob(&job_list, pids, npids, BG, cmdline);
+        p->pgid = how.pgid;
+        worker_pools.n++;
+        printf("[%d] (%d) %s\n", pid2jid(how.pgid), how.pgid, cmdline);
+    }
+    sigprocmask(SIG_SETMASK, &prev_set, NULL);
+}
+
+// pool_request - send the request line of len bytes to the next worker
+// of p and write its reply to stdout. Returns -1 if it got no reply.
+static int pool_request(struct pool_t *p, const char *line, size_t len)
+{
+    int w;
+
+    while ((w = pool_pick(p, NULL)) >= 0)
+    {
+        // a reply left over from an interrupted request goes first
+        if (p->busy[w] && pool_reply(p, w, -1) < 0)
+            continue;
+        if (pool_send(p, w, line, len) < 0)
+            continue;
+        return pool_reply(p, w, STDOUT_FILENO);
+    }
+    fprintf(stderr, "worker: %s: no workers left\n", p->name);
+    return -1;
+}
+
+// pool_stream - send each line of lr to the workers of p, keeping all
+// of them busy, and write the replies to stdout in the order of the
+// lines. The line a worker is busy with stays queued in order[].
+static void pool_stream(struct pool_t *p, struct linereader *lr)
+{
+    int order[MAXWORKERS], head = 0, count = 0, w, eof = 0;
+    char queued[MAXWORKERS] = {0};
+    char *line;
+    size_t len;
+
+    fflush(stdout);
+    builtin_intr = 0;
+
+    // drop replies left over from an interrupted request
+    for (w = 0; w < p->n; w++)
+        if (p->fds[w] >= 0 && p->busy[w])
+            pool_reply(p, w, -1);
+
+    while (!builtin_intr)
+    {
+        while (!eof && (w = pool_pick(p, queued)) >= 0)
+        {
+            if ((line = readline_src(lr)) == NULL)
+            {
+                eof = 1;
+                break;
+            }
+            len = strlen(line);
+            line[len] = '\n';
+            if (pool_send(p, w, line, len + 1) < 0)
+            {
+                fprintf(stderr, "worker: %s: request lost: %.*s\n", p->name,
+                        (int)len, line);
+                continue;
+            }
+            queued[w] = 1;
+            order[(head + count++) % MAXWORKERS] = w;
+        }
+        if (count == 0)
+            break;
+
+        w = order[head];
+        head = (head + 1) % MAXWORKERS;
+        count--;
+        queued[w] = 0;
+        if (pool_reply(p, w, STDOUT_FILENO) < 0 && builtin_intr)
+            break;
+    }
+}
+
+// worker_handler - worker pools, for programs that are run over and
+// over. worker start name [-n N] command [args...] starts a pool;
+// worker name request... sends the request to the next worker in turn
+// and prints its reply; worker name alone sends every line of stdin
+// and prints the replies in order; worker stop name closes the
+// workers' sockets, which ends them.
+// Without arguments, lists the pools.
+void worker_handler(struct cmdline_stage *st)
+{
+    struct linereader file, *lr = &cmd_input;
+    struct pool_t *p;
+    int i, fd, live;
+    size_t len;
+    char *line;
+
+    if (st->argc == 1)
+    {
+        for (i = 0; i < worker_pools.n; i++)
+        {
+            p = &worker_pools.pools[i];
+            if (find_pool(p->name) != p)
+            {
+                i--;
+                continue;
+            }
+            for (fd = live = 0; fd < p->n; fd++)
+                live += p->fds[fd] >= 0;
+            printf("%s: %d of %d workers, %lu requests, job %%%d\n", p->name,
+                   live, p->n, p->requests, pid2jid(p->pgid));
+        }
+        return;
+    }
+    if (!strcmp(st->argv[1], "start"))
+    {
+        if (st->argc < 4)
+            printf("usage: worker start name [-n 1-%d] command [args...]\n",
+                   MAXWORKERS);
+        else
+            start_pool(st);
+        return;
+    }
+    if (!strcmp(st->argv[1], "stop") && st->argc == 3)
+    {
+        if ((p = find_pool(st->argv[2])) == NULL)
+            printf("worker: %s: no such pool\n", st->argv[2]);
+        else
+        {
+            // closed sockets are the workers' EOF; one that ignores it
+            // stays a job of its own
+            for (i = 0; i < p->n; i++)
+                if (p->fds[i] >= 0)
+                    close(p->fds[i]);
+            worker_pools.pools[p - worker_pools.pools] =
+                worker_pools.pools[--worker_pools.n];
+        }
+        return;
+    }
+
+    if ((p = find_pool(st->argv[1])) == NULL)
+    {
+        printf("worker: %s: no such pool\n", st->argv[1]);
+        return;
+    }
+
+    // one request: the arguments, as one line
+    if (st->argc > 2)
+    {
+        for (i = 2, len = 1; i < st->argc; i++)
+            len += strlen(st->argv[i]) + 1;
+        line = arena_alloc(&cmd_arena, len);
+        for (i = 2, line[0] = '\0'; i < st->argc; i++)
+        {
+            strcat(line, st->argv[i]);
+            strcat(line, i < st->argc - 1 ? " " : "\n");
+        }
+        fflush(stdout);
+        builtin_intr = 0;
+        pool_request(p, line, len - 1);
+        return;
+    }
+
+    // a stream of requests, from a redirected stdin like parallel
+    if (redirects(st, STDIN_FILENO))
+    {
+        if ((fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3)) < 0)
+        {
+            fprintf(stderr, "worker: %s\n", strerror(errno));
+            return;
+        }
+        initreader(&file, fd, LINEBLOCK);
+        lr = &file;
+    }
+    pool_stream(p, lr);
+    if (lr == &file)
+    {
+        close(file.fd);
+        free(file.buf);
+    }
+}
+
+// stop_workers - end every worker pool, as the shell quits
+void stop_workers(void)
+{
+    struct pool_t *p;
+    int i, w;
+
+    for (i = 0; i < worker_pools.n; i++)
+    {
+        p = &worker_pools.pools[i];
+        for (w = 0; w < p->n; w++)
+            if (p->fds[w] >= 0)
+                close(p->fds[w]);
+        kill(-p->pgid, SIGTERM);
+        kill(-p->pgid, SIGCONT);
+    }
+    worker_pools.n = 0;
+}
+
+// shell_usage - the resource usage of the shell plus that of the
+// children it has reaped, for timing a builtin
+static void shell_usage(struct rusage *ru)
+{
+    struct rusage children;
+
+    getrusage(RUSAGE_SELF, ru);
+    getrusage(RUSAGE_CHILDREN, &children);
+    rusage_add(ru, &children);
+}
+
+// report_time - print what a timed command used to stderr: real, user
+// and system time in the format of bash's time, then its peak resident
+// set size and its voluntary and involuntary context switches. real is
+// in microseconds.
+void report_time(long long real, struct rusage *ru)
+{
+    long long user = ru->ru_utime.tv_sec * 1000000LL + ru->ru_utime.tv_usec;
+    long long sys = ru->ru_stime.tv_sec * 1000000LL + ru->ru_stime.tv_usec;
+
+    // anything buffered for stdout belongs before the report
+    fflush(stdout);
+    fprintf(stderr, "\nreal\t%lldm%lld.%03llds\n", real / 60000000,
+            real / 1000000 % 60, real / 1000 % 1000);
+    fprintf(stderr, "user\t%lldm%lld.%03llds\n", user / 60000000,
+            user / 1000000 % 60, user / 1000 % 1000);
+    fprintf(stderr, "sys\t%lldm%lld.%03llds\n", sys / 60000000,
+            sys / 1000000 % 60, sys / 1000 % 1000);
+    fprintf(stderr, "maxrss\t%ldk\nctxsw\t%ld+%ld\n", ru->ru_maxrss,
+            ru->ru_nvcsw, ru->ru_nivcsw);
+}
+
+/*
+ * eval - Evaluate the command line that the user has just typed in
+ *
+ * If the user has requested a built-in command (quit, jobs, bg or fg)
+ * then execute it immediately. Otherwise, fork a child process and
+ * run the job in the context of the child. If the job is running in
+ * the foreground, wait for it to terminate and then return.  Note:
+ * each child process must have a unique process group ID so that our
+ * background children don't receive SIGINT (SIGTSTP) from the kernel
+ * when we type ctrl-c (ctrl-z) at the keyboard.
+ *
+ * A pipeline (cmd | cmd ...) becomes a single job: its stages are
+ * connected with close-on-exec pipes and share one process group,
+ * led by the first stage that started.
+ *
+ * A leading "time" reports what the command used once it is done.
+ */
+
+void eval(char *cmdline)
+{
+    // the tokens live in the parse arena until this command is done
+    struct arena_mark mark = arena_mark(&cmd_arena);
+    struct cmdline_tokens tok;
+    int bg;
+
+    // parse the command line input
+    TRACE(TR_EVAL, 'B', 0);
+    TRACE(TR_PARSE, 'B', 0);
+    bg = parseline(cmdline, &tok, &cmd_arena);
+    TRACE(TR_PARSE, 'E', 0);
+
+    // if parsing returns -1, there is nothing to run
+    if (bg != -1)
+    {
+        cmdline = read_heredocs(cmdline, &tok, &cmd_input, &cmd_arena);
+        eval_tokens(cmdline, &tok, bg);
+    }
+
+    arena_release(&cmd_arena, mark);
+    TRACE(TR_EVAL, 'E', 0);
+}
+
+// eval_script - eval() for a line of a -f script with a parse cache:
+// take its tokens from the cache, or parse it and add them to the cache
+void eval_script(struct scriptcache *sc, char *cmdline)
+{
+    struct arena_mark mark = arena_mark(&cmd_arena);
+    struct cmdline_tokens tok;
+    unsigned long lines = cmd_input.lines;
+    int bg;
+
+    TRACE(TR_EVAL, 'B', 0);
+    if (sc->mode == CACHE_REPLAY)
+        bg = cache_tokens(sc, cmdline, &tok, &cmd_arena);
+    else
+    {
+        TRACE(TR_PARSE, 'B', 0);
+        bg = parseline(cmdline, &tok, &cmd_arena);
+        TRACE(TR_PARSE, 'E', 0);
+        // record before running: running strips prefixes off the tokens
+        cache_record(sc, cmdline, &tok, bg);
+        if (bg != -1)
+            cmdline = read_heredocs(cmdline, &tok, &cmd_input, &cmd_arena);
+    }
+
+    if (bg != -1)
+        eval_tokens(cmdline, &tok, bg);
+
+    // a command that read lines of the script makes it uncacheable
+    if (sc->mode == CACHE_RECORD && cmd_input.lines != lines)
+    {
+        free(sc->buf);
+        sc->buf = NULL;
+        sc->mode = CACHE_OFF;
+    }
+
+    arena_release(&cmd_arena, mark);
+    TRACE(TR_EVAL, 'E', 0);
+}
+
+// eval_tokens - run the parsed command line tok, in the background if
+// bg is set; cmdline is the text recorded in the job list. Returns the
+// wait status of the command (0 for a builtin), or -1 if its job is
+// still there, in the background or stopped.
+int eval_tokens(char *cmdline, struct cmdline_tokens *tok, int bg)
+{
+    // define necessary variables and data structures
+    sigset_t set, prev_set, child_mask;
+    int i, j, status, npids = 0, cap_fd = -1;
+    int fds[2];
+    pid_t pid, *pids;
+    struct launch_t how;
+    struct cmdline_stage *st = &tok->stage[0];
+    struct placement place;
+    struct limits lim;
+    struct memo_t memo;
+    struct job_t *job;
+    int n, timed = 0, memoed = 0;
+    struct timespec t0, t1;
+    struct rusage ru0, ru1;
+
+    // a parallel task may be placed by --spread, unless it says otherwise
+    how.place = NULL;
+    how.limits = NULL;
+    memo.fd = -1;
+    if (task_runner.cur >= 0 && task_runner.spread != SPREAD_NONE)
+        how.place = &task_runner.place;
+
+    // take the VAR=value words off the front of each command; alone,
+    // they set the shell's environment
+    for (i = 0; i < tok->nstages; i++)
+    {
+        struct cmdline_stage *stage = &tok->stage[i];
+        for (n = 0; n < stage->argc && env_assignment(stage->argv[n]); n++)
+            ;
+        stage->assigns = stage->argv;
+        stage->nassigns = n;
+        if (n == 0)
+            continue;
+        stage->argv += n;
+        stage->argc -= n;
+        stage->builtins = stage->argc > 0 ? builtin_id(stage->argv[0])
+                                          : BUILTIN_NONE;
+        if (i > 0 && prefix_builtin(stage->builtins))
+            stage->builtins = BUILTIN_NONE;
+    }
+    if (tok->nstages == 1 && st->argc == 0 && st->nassigns > 0)
+    {
+        for (i = 0; i < st->nassigns; i++)
+            env_set(st->assigns[i]);
+        return 0;
+    }
+
+    // strip the prefixes off the first command, noting what they ask for
+    while (prefix_builtin(st->builtins))
+    {
+        n = 1;
+        if (st->builtins == BUILTIN_TIME)
+            timed = 1;
+        else if (st->builtins == BUILTIN_TASKSET)
+        {
+            if ((n = taskset_prefix(st, &place)) < 0)
+                return W_EXITCODE(2, 0);
+            how.place = &place;
+        }
+        else if (st->builtins == BUILTIN_MEMO)
+        {
+            if ((n = memo_prefix(st, &memo)) <= 0)
+                return n < 0 ? W_EXITCODE(2, 0) : 0;
+            memoed = 1;
+        }
+        else if (st->builtins == BUILTIN_REMOTE)
+        {
+            // the command becomes an ssh through the host's master
+            if (remote_prefix(st) < 0)
+                return W_EXITCODE(2, 0);
+            if (st->argc == 0)
+                return 0;
+            n = 0;
+        }
+        else
+        {
+            if ((n = limit_prefix(st, &lim)) < 0)
+                return W_EXITCODE(2, 0);
+            how.limits = &lim;
+        }
+        st->argv += n;
+        st->argc -= n;
+        st->builtins = st->argc > 0 ? builtin_id(st->argv[0]) : BUILTIN_NONE;
+    }
+    if (st->argc == 0 && tok->nstages > 1)
+    {
+        fprintf(stderr, "Error: missing command in pipeline\n");
+        return W_EXITCODE(2, 0);
+    }
+
+    // if no command is provided, return from the function (a bare time
+    // still reports, like bash)
+    if (st->argv[0] == NULL && !(timed && !bg))
+        return 0;
+
+    // a timed builtin is measured from the shell's own usage, plus that
+    // of any children it reaps meanwhile
+    if (timed)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        shell_usage(&ru0);
+    }
+
+    // handle built-in commands, unless they are part of a pipeline; a
+    // data mover or task runner asked to run in the background gets a
+    // child of its own
+    if (tok->nstages == 1 &&
+        !(bg && (st->builtins == BUILTIN_CAT || st->builtins == BUILTIN_TEE ||
+                 st->builtins == BUILTIN_PARALLEL)) &&
+        (st->argv[0] == NULL || st->builtins != BUILTIN_NONE))
+    {
+        if (st->argv[0] != NULL)
+            run_builtin(st);
+        if (timed)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            shell_usage(&ru1);
+            rusage_since(&ru1, &ru0);
+            report_time(usecs(&t0, &t1), &ru1);
+        }
+        return 0;
+    }
+
+    // a memoized command that ran on the same inputs before is served
+    // from the cache; otherwise its stdout goes to a new entry
+    if (memoed)
+    {
+        memo_begin(&memo, tok, bg);
+        if (memo.hit)
+        {
+            if (timed)
+            {
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                shell_usage(&ru1);
+                rusage_since(&ru1, &ru0);
+                report_time(usecs(&t0, &t1), &ru1);
+            }
+            return memo.status;
+        }
+    }
+
+    // a job with memory or CPU bandwidth limits gets a cgroup of its own,
+    // which every child joins before it execs
+    if (how.limits != NULL && (how.limits->set & LIMIT_CGROUP) &&
+        cgroup_create(how.limits) < 0)
+    {
+        fprintf(stderr, "limit: cgroup: %s\n", strerror(errno));
+        return W_EXITCODE(1, 0);
+    }
+
+    // one pid per stage, freed with the rest of the command's tokens
+    pids = arena_alloc(&cmd_arena, tok->nstages * sizeof(pid_t));
+
+    // pending output goes first, and must not be copied into a child
+    fflush(stdout);
+
+    // block certain signals to handle race conditions
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGTSTP);
+    sigaddset(&set, SIGINT);
+    sigprocmask(SIG_BLOCK, &set, &prev_set);
+
+    // children start with the shell's mask, but never with SIGCHLD
+    // blocked as it is for the signalfd engine
+    child_mask = prev_set;
+    sigdelset(&child_mask, SIGCHLD);
+
+    // a captured background job writes stdout and stderr to a pipe the
+    // shell drains (one -g task of parallel already has a memfd)
+    if (bg && capture_order != CAPTURE_OFF && !task_runner.group)
+        cap_fd = capture_add();
+
+    // start the stages left to right, each reading the previous pipe
+    how.pgid = 0;
+    how.in_fd = -1;
+    how.err_fd = cap_fd;
+    for (i = 0; i < tok->nstages; i++)
+    {
+        fds[0] = fds[1] = -1;
+        if (i < tok->nstages - 1 && pipe2(fds, O_CLOEXEC) < 0)
+            unix_error("error with pipe");
+        how.out_fd = i < tok->nstages - 1 ? fds[1]
+                     : memo.fd >= 0       ? memo.fd
+                                          : cap_fd;
+
+        // a here-document is handed over as a pipe or memfd
+        if ((pid = here_fds(&tok->stage[i])) < 0)
+            fprintf(stderr, "here-document: %s\n", strerror(errno));
+
+        // create the child process with the selected launch engine
+        TRACE(TR_LAUNCH, 'B', 0);
+        if (pid == 0)
+            pid = launch(&tok->stage[i], &how, &set, &child_mask);
+        TRACE(TR_LAUNCH, 'E', pid);
+
+        // the shell keeps none of the pipe ends or here-documents a
+        // child is using
+        for (j = 0; j < tok->stage[i].nredirs; j++)
+            if (tok->stage[i].redirs[j].op == REDIR_HERE &&
+                tok->stage[i].redirs[j].src >= 0)
+            {
+                close(tok->stage[i].redirs[j].src);
+                tok->stage[i].redirs[j].src = -1;
+            }
+        if (how.in_fd >= 0)
+            close(how.in_fd);
+        if (how.out_fd >= 0 && how.out_fd != cap_fd && how.out_fd != memo.fd)
+            close(how.out_fd);
+        how.in_fd = fds[0];
+
+        // a stage that could not start just breaks its pipes
+        if (pid < 0)
+            continue;
+        if (how.pgid == 0)
+            how.pgid = pid;
+        pids[npids++] = pid;
+    }
+
+    if (cap_fd >= 0)
+        close(cap_fd);
+
+    // no stage started, nothing to wait for
+    if (npids == 0)
+    {
+        if (cap_fd >= 0)
+            capture_drop();
+        if (how.limits != NULL && how.limits->cgfd >= 0)
+            cgroup_remove(how.limits->cgfd, how.limits->cgname);
+        if (memo.fd >= 0)
+            memo_end(&memo, -1);
+        sigprocmask(SIG_SETMASK, &prev_set, NULL);
+        return W_EXITCODE(127, 0);
+    }
+
+    // parent process code
+    // add the pipeline to the job list as one job
+    addjob(&job_list, pids, npids, bg + 1, cmdline);
+    job = getjobpid(&job_list, how.pgid);
+
+    // the reaper tells whether a limit ended the job, and removes its
+    // cgroup
+    if (job != NULL && how.limits != NULL)
+    {
+        job->limits = how.limits->set;
+        job->cpulimit = how.limits->cpu;
+        job->cgfd = how.limits->cgfd;
+        strcpy(job->cgname, how.limits->cgname);
+    }
+    else if (how.limits != NULL && how.limits->cgfd >= 0)
+        cgroup_remove(how.limits->cgfd, how.limits->cgname);
+
+    // a parallel task is counted until the reaper reports it done;
+    // any other background process has its details printed
+    if (bg && task_runner.cur >= 0)
+    {
+        if (job != NULL)
+        {
+            job->task = task_runner.cur;
+            task_runner.nrunning++;
+        }
+    }
+    else if (bg)
+    {
+        printf("[%d] (%d) %s\n", pid2jid(how.pgid), how.pgid, cmdline);
+    }
+    // if it's a foreground process, wait for it with signals still
+    // blocked since the launch, so no event can slip in between
+    else
+    {
+        status = waitfg(how.pgid, &prev_set);
+        if (memo.fd >= 0 && status == -1)
+            memo_defer(&memo, getjobpid(&job_list, how.pgid));
+        else if (memo.fd >= 0)
+            memo_end(&memo, status);
+
+        // a timed job reports what its processes used, unless it only
+        // stopped (a background job is timed by jobs -v instead)
+        if (timed && status != -1)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            ru1 = job_list.fgusage;
+            sigprocmask(SIG_SETMASK, &prev_set, NULL);
+            report_time(usecs(&t0, &t1), &ru1);
+            return status;
+        }
+        sigprocmask(SIG_SETMASK, &prev_set, NULL);
+        return status;
+    }
+
+    // unblock signals in parent
+    sigprocmask(SIG_SETMASK, &prev_set, NULL);
+    return -1;
+}
+/*
+ * Token boundary scanners. scan_space() returns the first byte at or
+ * after p that is not white-space, scan_delim() the first that is
+ * white-space or the terminating NUL. Both are picked at first use:
+ * AVX2 or SSE2 on x86, NEON on arm64, else a scalar loop over tokclass
+ * (TSH_SIMD=scalar|sse2|avx2 forces one, for comparing them). The
+ * vector versions only load aligned blocks, which never cross into an
+ * unmapped page, and mask off the bytes before p.
+ */
+static const char *scan_space_init(const char *p);
+static const char *scan_delim_init(const char *p);
+static const char *(*scan_space)(const char *p) = scan_space_init;
+static const char *(*scan_delim)(const char *p) = scan_delim_init;
+
+/* scan_space_scalar - Skip white-space, one byte at a time */
+static const char *scan_space_scalar(const char *p)
+{
+    while (tokclass[(unsigned char)*p] & TC_SPACE)
+        p++;
+    return p;
+}
+
+/* scan_delim_scalar - Find white-space or the NUL, one byte at a time */
+static const char *scan_delim_scalar(const char *p)
+{
+    while (!(tokclass[(unsigned char)*p] & (TC_SPACE | TC_END)))
+        p++;
+    return p;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* SPACES16/SPACES32 - Bytes of v that are white-space, as 0xff */
+#define SPACES16(v)                                             \
+    _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),  \
+                              _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))), \
+                 _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), \
+                              _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))))
+#define SPACES32(v)                                                   \
+    _mm256_or_si256(                                                  \
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),  \
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))), \
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')), \
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))))
+
+__attribute__((target("sse2"), no_sanitize_address))
+static const char *scan_space_sse2(const char *p)
+{
+    const char *blk = (const char *)((uintptr_t)p & ~(uintptr_t)15);
+    unsigned mask = 0xffffu << (p - blk);
+
+    while (1)
+    {
+        __m128i v = _mm_load_si128((const __m128i *)blk);
+        mask &= ~_mm_movemask_epi8(SPACES16(v)) & 0xffffu;
+        if (mask)
+            return blk + __builtin_ctz(mask);
+        blk += 16;
+        mask = 0xffffu;
+    }
+}
+
+__attribute__((target("sse2"), no_sanitize_address))
+static const char *scan_delim_sse2(const char *p)
+{
+    const char *blk = (const char *)((uintptr_t)p & ~(uintptr_t)15);
+    unsigned mask = 0xffffu << (p - blk);
+
+    while (1)
+    {
+        __m128i v = _mm_load_si128((const __m128i *)blk);
+        __m128i m = _mm_or_si128(SPACES16(v),
+                                 _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        mask &= _mm_movemask_epi8(m);
+        if (mask)
+            return blk + __builtin_ctz(mask);
+        blk += 16;
+        mask = 0xffffu;
+    }
+}
+
+__attribute__((target("avx2"), no_sanitize_address))
+static const char *scan_space_avx2(const char *p)
+{
+    const char *blk = (const char *)((uintptr_t)p & ~(uintptr_t)31);
+    unsigned mask = ~0u << (p - blk);
+
+    while (1)
+    {
+        __m256i v = _mm256_load_si256((const __m256i *)blk);
+        mask &= ~(unsigned)_mm256_movemask_epi8(SPACES32(v));
+        if (mask)
+            return blk + __builtin_ctz(mask);
+        blk += 32;
+        mask = ~0u;
+    }
+}
+
+__attribute__((target("avx2"), no_sanitize_address))
+static const char *scan_delim_avx2(const char *p)
+{
+    const char *blk = (const char *)((uintptr_t)p & ~(uintptr_t)31);
+    unsigned mask = ~0u << (p - blk);
+
+    while (1)
+    {
+        __m256i v = _mm256_load_si256((const __m256i *)blk);
+        __m256i m = _mm256_or_si256(
+            SPACES32(v), _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        mask &= (unsigned)_mm256_movemask_epi8(m);
+        if (mask)
+            return blk + __builtin_ctz(mask);
+        blk += 32;
+        mask = ~0u;
+    }
+}
+#elif defined(__aarch64__)
+/* spaces_neon - Bytes of v that are white-space, as 0xff */
+static inline uint8x16_t spaces_neon(uint8x16_t v)
+{
+    return vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')),
+                             vceqq_u8(v, vdupq_n_u8('\t'))),
+                    vorrq_u8(vceqq_u8(v, vdupq_n_u8('\r')),
+                             vceqq_u8(v, vdupq_n_u8('\n'))));
+}
+
+/* mask_neon - Squeeze a byte mask into 4 bits per byte */
+static inline uint64_t mask_neon(uint8x16_t m)
+{
+    uint8x8_t nib = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(nib), 0);
+}
+
+__attribute__((no_sanitize_address))
+static const char *scan_space_neon(const char *p)
+{
+    const char *blk = (const char *)((uintptr_t)p & ~(uintptr_t)15);
+    uint64_t mask = ~0ull << (4 * (p - blk));
+
+    while (1)
+    {
+        uint8x16_t v = vld1q_u8((const uint8_t *)blk);
+        mask &= ~mask_neon(spaces_neon(v));
+        if (mask)
+            return blk + (__builtin_ctzll(mask) >> 2);
+        blk += 16;
+        mask = ~0ull;
+    }
+}
+
+__attribute__((no_sanitize_address))
+static const char *scan_delim_neon(const char *p)
+{
+    const char *blk = (const char *)((uintptr_t)p & ~(uintptr_t)15);
+    uint64_t mask = ~0ull << (4 * (p - blk));
+
+    while (1)
+    {
+        uint8x16_t v = vld1q_u8((const uint8_t *)blk);
+        mask &= mask_neon(vorrq_u8(spaces_neon(v), vceqq_u8(v, vdupq_n_u8(0))));
+        if (mask)
+            return blk + (__builtin_ctzll(mask) >> 2);
+        blk += 16;
+        mask = ~0ull;
+    }
+}
+#endif
+
+/* pick_scanners - Choose the best scanners this CPU runs */
+static void pick_scanners(void)
+{
+    const char *force = getenv("TSH_SIMD");
+
+    scan_space = scan_space_scalar;
+    scan_delim = scan_delim_scalar;
+    if (force && !strcmp(force, "scalar"))
+        return;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && !(force && !strcmp(force, "sse2")))
+    {
+        scan_space = scan_space_avx2;
+        scan_delim = scan_delim_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        scan_space = scan_space_sse2;
+        scan_delim = scan_delim_sse2;
+    }
+#elif defined(__aarch64__)
+    scan_space = scan_space_neon;
+    scan_delim = scan_delim_neon;
+#endif
+}
+
+static const char *scan_space_init(const char *p)
+{
+    pick_scanners();
+    return scan_space(p);
+}
+
+static const char *scan_delim_init(const char *p)
+{
+    pick_scanners();
+    return scan_delim(p);
+}
+
+/*
+ * redir_op - If p starts with a redirection operator, store what it
+ *    does in *op and the descriptor it redirects in *fd, and return its
+ *    length; else return 0. The operators are [n]<, [n]>, [n]>>, [n]<>,
+ *    [n]>&, [n]<&, <<< and <<.
+ */
+static int redir_op(const char *p, int *op, int *fd)
+{
+    const char *q = p;
+    long n = -1;
+
+    if (isdigit((unsigned char)*q))
+    {
+        for (n = 0; isdigit((unsigned char)*q); q++)
+            if ((n = 10 * n + (*q - '0')) > INT_MAX / 10)
+                return 0;
+    }
+
+    if (*q == '<')
+    {
+        if (n < 0 && q[1] == '<')
+        {
+            *fd = STDIN_FILENO;
+            *op = q[2] == '<' ? REDIR_HERE : REDIR_HEREDOC;
+            return q[2] == '<' ? 3 : 2;
+        }
+        *fd = n < 0 ? STDIN_FILENO : n;
+        *op = q[1] == '>' ? REDIR_RDWR : q[1] == '&' ? REDIR_DUP : REDIR_IN;
+    }
+    else if (*q == '>')
+    {
+        *fd = n < 0 ? STDOUT_FILENO : n;
+        *op = q[1] == '>' ? REDIR_APPEND : q[1] == '&' ? REDIR_DUP : REDIR_OUT;
+    }
+    else
+        return 0;
+    return q - p + (*op == REDIR_IN || *op == REDIR_OUT ? 1 : 2);
+}
+
+/*
+ * parseline - Parse the command line and build the argv array.
+ *
+ * Parameters:
+ *   cmdline:  The command line, in the form:
+ *
+ *                command [arguments...] [redirection...]
+ *                        [| command [arguments...] ...] [&]
+ *
+ *             where a redirection is [n]< file, [n]> file, [n]>> file,
+ *             [n]<> file, [n]>&m, [n]<&m (m may be - to close n),
+ *             <<< word, a here-string (the word and a newline), or
+ *             << delim, a here-document whose body read_heredocs()
+ *             reads from the lines that follow. Redirections may be
+ *             mixed in with the arguments; they are kept in order.
+ *
+ *   tok:      Pointer to a cmdline_tokens structure. The elements of this
+ *             structure will be populated with the parsed tokens, one
+ *             stage per command of the pipeline. Characters enclosed in
+ *             single or double quotes are treated as a single argument.
+ *   a:        The arena the tokens are allocated from.
+ * Returns:
+ *   1:        if the user has requested a BG job
+ *   0:        if the user has requested a FG job
+ *  -1:        if cmdline is incorrectly formatted
+ *
+ * Note:       The line is copied into the arena and split there in a
+ *             single pass, so neither its length nor the number of
+ *             arguments is limited. Token boundaries are found 16 or
+ *             32 bytes at a time by scan_space() and scan_delim(). The
+ *             string elements of tok (e.g., argv[], the redirection
+ *             words) point into the arena and stay valid until it is
+ *             released past them. parseline() keeps no state of its
+ *             own, so it is reentrant.
+ */
+int parseline(const char *cmdline, struct cmdline_tokens *tok,
+              struct arena *a)
+{
+    char *buf;                /* ptr that traverses command line */
+    char *start;              /* ptr to the start of the current arg */
+    char **argv;              /* argv of all stages, NULL-separated */
+    size_t nargv, argvcap;    /* used and allocated length of argv */
+    int stagecap;             /* allocated length of tok->stage */
+    struct cmdline_stage *st; /* stage being filled in */
+    size_t len;               /* length of the command line */
+    int i, is_bg;             /* background job? */
+    char quote, last;
+    struct redirection *r;    /* redirection being filled in */
+    int redircap;             /* allocated length of st->redirs */
+    int op, fd, n;
+
+    int parsing_state; /* indicates if the next token is the
+                          file or fd of a redirection */
+
+    if (cmdline == NULL)
+    {
+        (void)fprintf(stderr, "Error: command line is NULL\n");
+        return -1;
+    }
+
+    /* Tokens are split in place in a copy of the line */
+    len = strlen(cmdline);
+    buf = arena_alloc(a, len + 1);
+    memcpy(buf, cmdline, len + 1);
+
+    argvcap = 16;
+    nargv = 0;
+    argv = arena_alloc(a, argvcap * sizeof(char *));
+    stagecap = 4;
+    tok->stage = arena_alloc(a, stagecap * sizeof(struct cmdline_stage));
+    tok->nstages = 1;
+    st = &tok->stage[0];
+    st->nredirs = 0;
+    st->redirs = NULL;
+    st->nassigns = 0;
+    st->assigns = NULL;
+    redircap = 0;
+
+    /* Build the argv list */
+    parsing_state = ST_NORMAL;
+    st->argc = 0;
+
+    while (1)
+    {
+        /* Skip the white-spaces */
+        buf = (char *)scan_space(buf);
+        if (*buf == '\0')
+            break;
+
+        /* Check for I/O redirection specifiers */
+        if ((n = redir_op(buf, &op, &fd)) > 0)
+        {
+            if (parsing_state != ST_NORMAL)
+            {
+                (void)fprintf(stderr, "Error: Ambiguous I/O redirection\n");
+                return -1;
+            }
+            if (st->nredirs == redircap)
+            {
+                redircap = redircap ? 2 * redircap : 4;
+                st->redirs = arena_grow(
+                    a, st->redirs, st->nredirs * sizeof(struct redirection),
+                    redircap * sizeof(struct redirection));
+            }
+            r = &st->redirs[st->nredirs++];
+            r->op = op;
+            r->fd = fd;
+            r->src = -1;
+            r->word = NULL;
+            parsing_state = ST_REDIR;
+            buf += n;
+            continue;
+        }
+
+        /* A pipe ends the current stage and starts the next one */
+        if (*buf == '|')
+        {
+            if (parsing_state != ST_NORMAL)
+                break;
+            if (st->argc == 0)
+            {
+                (void)fprintf(stderr, "Error: missing command in pipeline\n");
+                return -1;
+            }
+            if (nargv == argvcap)
+            {
+                argv = arena_grow(a, argv, argvcap * sizeof(char *),
+                                  2 * argvcap * sizeof(char *));
+                argvcap *= 2;
+            }
+            argv[nargv++] = NULL;
+            if (tok->nstages == stagecap)
+            {
+                tok->stage = arena_grow(
+                    a, tok->stage, stagecap * sizeof(struct cmdline_stage),
+                    2 * stagecap * sizeof(struct cmdline_stage));
+                stagecap *= 2;
+            }
+            st = &tok->stage[tok->nstages++];
+            st->nredirs = 0;
+            st->redirs = NULL;
+            st->nassigns = 0;
+            st->assigns = NULL;
+            redircap = 0;
+            st->argc = 0;
+            buf++;
+            continue;
+        }
+
+        if (*buf == '\'' || *buf == '\"')
+        {
+            /* Detect quoted tokens */
+            quote = *buf++;
+            start = buf;
+            buf = strchrnul(buf, quote);
+            if (*buf == '\0')
+            {
+                /* The closing quote was not found */
+                (void)fprintf(stderr, "Error: unmatched %c.\n", quote);
+                return -1;
+            }
+        }
+        else
+        {
+            /* Find next delimiter */
+            start = buf;
+            buf = (char *)scan_delim(buf);
+        }
+
+        /* Terminate the token */
+        last = *buf;
+        *buf = '\0';
+
+        /* Record the token as either the next argument or the i/o file */
+        switch (parsing_state)
+        {
+        case ST_NORMAL:
+            if (nargv == argvcap)
+            {
+                argv = arena_grow(a, argv, argvcap * sizeof(char *),
+                                  2 * argvcap * sizeof(char *));
+                argvcap *= 2;
+            }
+            argv[nargv++] = start;
+            st->argc++;
+            break;
+        case ST_REDIR:
+            r = &st->redirs[st->nredirs - 1];
+            if (r->op == REDIR_DUP)
+            {
+                /* The descriptor to copy, or - to close */
+                if (!strcmp(start, "-"))
+                    r->op = REDIR_CLOSE;
+                else if (*start != '\0' && strspn(start, "0123456789") ==
+                                                (size_t)(buf - start))
+                    r->src = atoi(start);
+                else
+                {
+                    (void)fprintf(stderr, "Error: %s: bad file descriptor "
+                                          "in redirection\n", start);
+                    return -1;
+                }
+            }
+            else if (r->op == REDIR_HERE)
+            {
+                /* A here-string is the word and a newline */
+                len = buf - start;
+                r->word = arena_alloc(a, len + 2);
+                memcpy(r->word, start, len);
+                r->word[len] = '\n';
+                r->word[len + 1] = '\0';
+            }
+            else
+                r->word = start;
+            break;
+        default:
+            (void)fprintf(stderr, "Error: Ambiguous I/O redirection\n");
+            return -1;
+        }
+        parsing_state = ST_NORMAL;
+
+        /* An unquoted token may have ended the line */
+        if (last == '\0')
+            break;
+        buf++;
+    }
+
+    if (parsing_state != ST_NORMAL)
+    {
+        (void)fprintf(stderr,
+                      "Error: must provide file name for redirection\n");
+        return -1;
+    }
+
+    /* The argument list must end with a NULL pointer */
+    if (nargv == argvcap)
+        argv = arena_grow(a, argv, argvcap * sizeof(char *),
+                          (argvcap + 1) * sizeof(char *));
+    argv[nargv] = NULL;
+
+    /* Now that argv has stopped moving, point each stage at its args */
+    for (i = 0; i < tok->nstages; i++)
+    {
+        tok->stage[i].argv = argv;
+        argv += tok->stage[i].argc + 1;
+    }
+
+    if (st->argc == 0)
+    {
+        if (tok->nstages == 1) /* ignore blank line */
+            return 1;
+        (void)fprintf(stderr, "Error: missing command in pipeline\n");
+        return -1;
+    }
+
+    for (i = 0; i < tok->nstages; i++)
+    {
+        st = &tok->stage[i];
+        st->builtins = builtin_id(st->argv[0]);
+
+        /* A prefix only counts at the start of the line */
+        if (i > 0 && prefix_builtin(st->builtins))
+            st->builtins = BUILTIN_NONE;
+    }
+
+    /* Should the job run in the background? */
+    if ((is_bg = (*st->argv[st->argc - 1] == '&')) != 0)
+        st->argv[--st->argc] = NULL;
+
+    if (st->argc == 0 && tok->nstages > 1)
+    {
+        (void)fprintf(stderr, "Error: missing command in pipeline\n");
+        return -1;
+    }
+
+    return is_bg;
+}
+
+#ifdef TSH_FUZZ
+/*
+ * The fuzz target. parseline() is checked against ref_parse(), a plain
+ * byte-at-a-time parser of the same grammar, and the vector token
+ * scanners against the scalar ones; any difference aborts, so the
+ * fuzzer keeps the input. Build with
+ *     clang -g -O1 -DTSH_FUZZ -fsanitize=fuzzer,address shell.c csapp.c
+ */
+
+/* ref_space - Whether c separates words */
+static int ref_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/*
+ * ref_parse - Parse line into tok as parseline() should, with none of
+ *    its speed: words are split off one byte at a time, stages and
+ *    redirections go in fixed arrays. Returns what parseline() would.
+ */
+static int ref_parse(const char *line, struct cmdline_tokens *tok,
+                     struct arena *a)
+{
+    size_t len = strlen(line);
+    char *buf = arena_alloc(a, len + 1), *start, *w, quote;
+    char **argv = arena_alloc(a, (len + 2) * sizeof(char *));
+    struct redirection *r = NULL;
+    struct cmdline_stage *st;
+    int op, fd, n, nargv = 0, i, bg;
+
+    memcpy(buf, line, len + 1);
+    tok->stage = arena_alloc(a, (len + 1) * sizeof(struct cmdline_stage));
+    tok->nstages = 1;
+    st = &tok->stage[0];
+    memset(st, 0, sizeof(*st));
+    st->redirs = arena_alloc(a, (len + 1) * sizeof(struct redirection));
+    while (1)
+    {
+        while (ref_space(*buf))
+            buf++;
+        if (*buf == '\0')
+            break;
+        if (r == NULL && (n = redir_op(buf, &op, &fd)) > 0)
+        {
+            r = &st->redirs[st->nredirs++];
+            r->op = op;
+            r->fd = fd;
+            r->src = -1;
+            r->word = NULL;
+            buf += n;
+            continue;
+        }
+        if (r != NULL && redir_op(buf, &op, &fd) > 0)
+            return -1;
+        if (*buf == '|')
+        {
+            if (r != NULL)
+                break;
+            if (st->argc == 0)
+                return -1;
+            argv[nargv++] = NULL;
+            st = &tok->stage[tok->nstages++];
+            memset(st, 0, sizeof(*st));
+            st->redirs = arena_alloc(a, (len + 1) * sizeof(struct redirection));
+            buf++;
+            continue;
+        }
+        if (*buf == '\'' || *buf == '"')
+        {
+            quote = *buf++;
+            for (start = buf; *buf != quote; buf++)
+                if (*buf == '\0')
+                    return -1;
+        }
+        else
+            for (start = buf; *buf != '\0' && !ref_space(*buf); buf++)
+                ;
+        quote = *buf;
+        *buf = '\0';
+        if (r == NULL)
+        {
+            argv[nargv++] = start;
+            st->argc++;
+        }
+        else if (r->op == REDIR_DUP)
+        {
+            if (!strcmp(start, "-"))
+                r->op = REDIR_CLOSE;
+            else
+            {
+                for (w = start; *w >= '0' && *w <= '9'; w++)
+                    ;
+                if (w == start || *w != '\0')
+                    return -1;
+                r->src = atoi(start);
+            }
+        }
+        else if (r->op == REDIR_HERE)
+        {
+            r->word = arena_alloc(a, strlen(start) + 2);
+            sprintf(r->word, "%s\n", start);
+        }
+        else
+            r->word = start;
+        r = NULL;
+        if (quote == '\0')
+            break;
+        buf++;
+    }
+    if (r != NULL)
+        return -1;
+    argv[nargv] = NULL;
+    for (i = 0; i < tok->nstages; i++)
+    {
+        tok->stage[i].argv = argv;
+        argv += tok->stage[i].argc + 1;
+    }
+    if (st->argc == 0)
+        return tok->nstages == 1 ? 1 : -1;
+    for (i = 0; i < tok->nstages; i++)
+        tok->stage[i].builtins = builtin_id(tok->stage[i].argv[0]);
+    if ((bg = (*st->argv[st->argc - 1] == '&')) != 0)
+        st->argv[--st->argc] = NULL;
+    return st->argc == 0 && tok->nstages > 1 ? -1 : bg;
+}
+
+/* fuzz_same - Whether parseline() and ref_parse() agree on tok and ref,
+ * which both returned rc */
+static int fuzz_same(struct cmdline_tokens *tok, struct cmdline_tokens *ref,
+                     int rc)
+{
+    struct cmdline_stage *s, *t;
+    struct redirection *x, *y;
+    int i, k;
+
+    if (rc != 0 && rc != 1)
+        return 1;
+    if (tok->nstages != ref->nstages)
+        return 0;
+    for (i = 0; i < tok->nstages; i++)
+    {
+        s = &tok->stage[i];
+        t = &ref->stage[i];
+        if (s->argc != t->argc || s->nredirs != t->nredirs ||
+            s->argv[s->argc] != NULL)
+            return 0;
+        for (k = 0; k < s->argc; k++)
+            if (strcmp(s->argv[k], t->argv[k]) != 0)
+                return 0;
+        for (k = 0; k < s->nredirs; k++)
+        {
+            x = &s->redirs[k];
+            y = &t->redirs[k];
+            if (x->op != y->op || x->fd != y->fd || x->src != y->src ||
+                (x->word == NULL) != (y->word == NULL) ||
+                (x->word != NULL && strcmp(x->word, y->word) != 0))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static int quiet;
+    struct arena_mark mark = arena_mark(&cmd_arena);
+    struct cmdline_tokens tok, ref;
+    char *line = arena_alloc(&cmd_arena, size + 1);
+    size_t i;
+    int rc;
+
+    // parse errors are expected, and their messages only slow us down
+    if (!quiet++)
+        freopen("/dev/null", "w", stderr);
+
+    memcpy(line, data, size);
+    line[size] = '\0';
+    for (i = 0; i < size; i += 1 + i / 8)
+        if (scan_space(line + i) != scan_space_scalar(line + i) ||
+            scan_delim(line + i) != scan_delim_scalar(line + i))
+            abort();
+    rc = parseline(line, &tok, &cmd_arena);
+    if (rc != ref_parse(line, &ref, &cmd_arena) || !fuzz_same(&tok, &ref, rc))
+        abort();
+    arena_release(&cmd_arena, mark);
+    return 0;
+}
+#endif
+
+/*
+ * read_heredocs - Read the body of each << here-document of tok from
+ *    lr: the lines up to one that is just the delimiter, or the end of
+ *    input. The bodies are kept in a, and so is cmdline, which may point
+ *    into the buffer of lr. Returns cmdline as it is now.
+ */
+char *read_heredocs(char *cmdline, struct cmdline_tokens *tok,
+                    struct linereader *lr, struct arena *a)
+{
+    struct redirection *r;
+    size_t len, cap, n;
+    char *line, *body;
+    int i, j, moved = 0;
+
+    for (i = 0; i < tok->nstages; i++)
+    {
+        for (j = 0; j < tok->stage[i].nredirs; j++)
+        {
+            r = &tok->stage[i].redirs[j];
+            if (r->op != REDIR_HEREDOC)
+                continue;
+
+            /* Reading on may move the line the caller holds */
+            if (!moved)
+            {
+                n = strlen(cmdline) + 1;
+                cmdline = memcpy(arena_alloc(a, n), cmdline, n);
+                moved = 1;
+            }
+
+            cap = 256;
+            len = 0;
+            body = arena_alloc(a, cap);
+            while ((line = readline_src(lr)) != NULL &&
+                   strcmp(line, r->word) != 0)
+            {
+                n = strlen(line);
+                if (len + n + 2 > cap)
+                {
+                    body = arena_grow(a, body, cap, 2 * (len + n + 2));
+                    cap = 2 * (len + n + 2);
+                }
+                memcpy(body + len, line, n);
+                body[len + n] = '\n';
+                len += n + 1;
+            }
+            if (line == NULL)
+                (void)fprintf(stderr, "warning: here-document delimited by "
+                                      "end-of-file (wanted `%s')\n",
+                              r->word);
+            body[len] = '\0';
+            r->op = REDIR_HERE;
+            r->word = body;
+        }
+    }
+    return cmdline;
+}
+
+/*
+ * builtin_id - Return which builtin command (or prefix) name is, or
+ *     BUILTIN_NONE for a program
+ */
+enum builtins_t builtin_id(const char *name)
+{
+    if (!strcmp(name, "quit"))
+    { /* quit command */
+        return BUILTIN_QUIT;
+    }
+    else if (!strcmp(name, "jobs"))
+    { /* jobs command */
+        return BUILTIN_JOBS;
+    }
+    else if (!strcmp(name, "bg"))
+    { /* bg command */
+        return BUILTIN_BG;
+    }
+    else if (!strcmp(name, "fg"))
+    { /* fg command */
+        return BUILTIN_FG;
+    }
+    else if (!strcmp(name, "hash"))
+    { /* hash command */
+        return BUILTIN_HASH;
+    }
+    else if (!strcmp(name, "tsh-cat"))
+    { /* tsh-cat command */
+        return BUILTIN_CAT;
+    }
+    else if (!strcmp(name, "tsh-tee"))
+    { /* tsh-tee command */
+        return BUILTIN_TEE;
+    }
+    else if (!strcmp(name, "parallel"))
+    { /* parallel command */
+        return BUILTIN_PARALLEL;
+    }
+    else if (!strcmp(name, "ulimit"))
+    { /* ulimit command */
+        return BUILTIN_ULIMIT;
+    }
+    else if (!strcmp(name, "bench"))
+    { /* bench command */
+        return BUILTIN_BENCH;
+    }
+    else if (!strcmp(name, "trace"))
+    { /* trace command */
+        return BUILTIN_TRACE;
+    }
+    else if (!strcmp(name, "worker"))
+    { /* worker command */
+        return BUILTIN_WORKER;
+    }
+    else if (!strcmp(name, "kill"))
+    { /* kill command */
+        return BUILTIN_KILL;
+    }
+    else if (!strcmp(name, "wait"))
+    { /* wait command */
+        return BUILTIN_WAIT;
+    }
+    else if (!strcmp(name, "export"))
+    { /* export command */
+        return BUILTIN_EXPORT;
+    }
+    else if (!strcmp(name, "unset"))
+    { /* unset command */
+        return BUILTIN_UNSET;
+    }
+    else if (!strcmp(name, "time"))
+    { /* time prefix */
+        return BUILTIN_TIME;
+    }
+    else if (!strcmp(name, "taskset"))
+    { /* taskset prefix */
+        return BUILTIN_TASKSET;
+    }
+    else if (!strcmp(name, "limit"))
+    { /* limit prefix */
+        return BUILTIN_LIMIT;
+    }
+    else if (!strcmp(name, "memo"))
+    { /* memo prefix */
+        return BUILTIN_MEMO;
+    }
+    else if (!strcmp(name, "remote"))
+    { /* remote prefix */
+        return BUILTIN_REMOTE;
+    }
+    else
+    {
+        return BUILTIN_NONE;
+    }
 }
 
 /*****************
@@ -592,300 +4758,3809 @@ int parseline(const char *cmdline, struct cmdline_tokens *tok)
  *****************/
 
 /*
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP, SIGTSTP, SIGTTIN or SIGTTOU signal. The
- *     handler reaps all available zombie children, but doesn't wait
- *     for any other currently running children to terminate.
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *     a child job terminates (becomes a zombie), or stops because it
+ *     received a SIGSTOP, SIGTSTP, SIGTTIN or SIGTTOU signal. The
+ *     handler reaps all available zombie children, but doesn't wait
+ *     for any other currently running children to terminate.
+ *     With the signalfd engine (-e) SIGCHLD stays blocked and the main
+ *     loop calls reap_children() itself instead.
+ */
+void sigchld_handler(int sig)
+{
+    int olderrno = errno;
+
+    reap_children();
+    errno = olderrno;
+}
+
+/*
+ * reap_children - Reap every child that has changed state and update
+ *     the job table, from the handler or from the main loop.
+ */
+void reap_children(void)
+{
+    pid_t pid; // process ID for child
+    int stat;  // status for waitpid
+    int i;     // index of the child in its pipeline
+    struct rusage ru; // usage of a child that finished
+
+    // loop to reap all terminated child processes
+    TRACE(TR_REAP, 'B', 0);
+    while ((pid = wait4(-1, &stat, WNOHANG | WUNTRACED, &ru)) > 0)
+    {
+        // get the job from job list; a child whose exec failed has none
+        struct job_t *cur_job = getjobpid(&job_list, pid);
+        TRACE(TR_CHILD, 'i', pid);
+        if (cur_job == NULL)
+            continue;
+        for (i = 0; cur_job->procs[i] != pid; i++)
+            ;
+
+        // the job's status is that of its last stage
+        if (i == cur_job->nprocs - 1 && !WIFSTOPPED(stat))
+            cur_job->status = stat;
+
+        // check if child process was stopped
+        if (WIFSTOPPED(stat))
+        {
+            cur_job->pstate[i] = PROC_STOPPED;
+            cur_job->stopsig = WSTOPSIG(stat);
+        }
+        // otherwise it exited or was terminated by a signal
+        // (a writer killed by SIGPIPE because a later stage quit early
+        // is the normal end of a pipeline, not worth reporting)
+        else
+        {
+            cur_job->pstate[i] = PROC_DONE;
+            cur_job->nlive--;
+            rusage_add(&cur_job->ru, &ru);
+            if (WIFSIGNALED(stat) &&
+                (WTERMSIG(stat) != SIGPIPE || i == cur_job->nprocs - 1))
+                cur_job->termsig = WTERMSIG(stat);
+        }
+
+        // the job is gone once every process of the pipeline is
+        if (cur_job->nlive == 0)
+        {
+            if (cur_job->termsig)
+                notify(NOTE_TERM, cur_job, cur_job->termsig);
+            if (cur_job->limits)
+                report_limits(cur_job);
+            if (cur_job->cgfd >= 0)
+                cgroup_remove(cur_job->cgfd, cur_job->cgname);
+            if (cur_job->state == FG)
+            {
+                job_list.fgstatus = cur_job->status;
+                job_list.fgusage = cur_job->ru;
+            }
+            if (cur_job->task >= 0)
+            {
+                task_runner.tasks[cur_job->task].status = cur_job->status;
+                task_runner.tasks[cur_job->task].done = 1;
+                task_runner.nrunning--;
+            }
+            if (cur_job->memo >= 0)
+            {
+                memo_jobs.m[cur_job->memo].status = cur_job->status;
+                memo_jobs.m[cur_job->memo].done = 1;
+            }
+            deletejob(&job_list, pid); // remove the job from job list
+        }
+        // it is stopped once none of its remaining processes runs
+        else if (cur_job->state != ST && !jobrunning(cur_job))
+        {
+            setjobstate(&job_list, cur_job, ST); // set the job state to stopped
+            notify(NOTE_STOP, cur_job, cur_job->stopsig);
+            if (audit_log.fd >= 0)
+                audit_record(AUDIT_STOP, cur_job, cur_job->stopsig);
+        }
+    }
+    if (notices.mode == NOTIFY_NOW)
+        notify_flush();
+#ifdef TSH_CHECK
+    // a checked build stops at the first reap that leaves the table wrong
+    {
+        struct outbuf ob;
+        char buf[MAXLINE_TSH];
+
+        ob_init(&ob, STDERR_FILENO, buf, sizeof(buf));
+        if (checkjobs(&job_list, &ob) > 0)
+        {
+            ob_flush(&ob);
+            abort();
+        }
+    }
+#endif
+    TRACE(TR_REAP, 'E', 0);
+    return;
+}
+
+/*
+ * drain_sigchld - Signalfd engine: consume the queued SIGCHLDs, and reap
+ *     if there were any. SIGCHLDs that arrive while reaping stay queued
+ *     for the next call, so no child is missed.
+ */
+void drain_sigchld(void)
+{
+    struct signalfd_siginfo info[16];
+    int got = 0;
+
+    while (read(sigchld_fd, info, sizeof(info)) > 0)
+        got = 1;
+    if (got)
+        reap_children();
+}
+
+/*
+ * wait_child_event - Block until the reaper may have changed the job
+ *     table: a child event or another signal. The caller has blocked
+ *     signals; mask is the mask to wait with, as for sigsuspend.
+ */
+void wait_child_event(sigset_t *mask)
+{
+    struct pollfd pfd;
+
+    if (sigchld_fd < 0 && captures.n == 0)
+    {
+        sigsuspend(mask);
+        return;
+    }
+    pfd.fd = sigchld_fd;
+    pfd.events = POLLIN;
+    if (poll_captures(&pfd, 1, mask, 1) > 0 && (pfd.revents & POLLIN))
+        drain_sigchld();
+}
+
+/*
+ * wait_input - Block until fd is readable, reaping children (and so
+ *     reporting background jobs) with the signalfd engine, and draining
+ *     captured background output, in the meantime.
+ */
+void wait_input(int fd)
+{
+    struct pollfd pfd[2];
+
+    pfd[0].fd = fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = sigchld_fd;
+    pfd[1].events = POLLIN;
+    while (1)
+    {
+        if (poll_captures(pfd, 2, NULL, 1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (pfd[1].revents & POLLIN)
+            drain_sigchld();
+        if (pfd[0].revents)
+            return;
+    }
+}
+
+/*
+ * sigint_handler - The kernel sends a SIGINT to the shell whenver the
+ *    user types ctrl-c at the keyboard.  Catch it and send it along
+ *    to the foreground job.
+ */
+void sigint_handler(int sig)
+{
+    // Get the process ID of the current foreground job
+    pid_t fg_pid = fgpid(&job_list);
+    // With no foreground job, a builtin data mover may be running in
+    // the shell itself; ask it to stop
+    if (!fg_pid)
+        builtin_intr = 1;
+    // If there's a foreground job (fg_pid is not 0)
+    // Try to send a SIGINT signal to the foreground job
+    if (fg_pid && kill(-fg_pid, SIGINT) < 0)
+    {
+        // If there's an error sending the signal
+        unix_error("error with signal");
+    }
+}
+
+/*
+ * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
+ *     the user types ctrl-z at the keyboard. Catch it and suspend the
+ *     foreground job by sending it a SIGTSTP.
+ */
+void sigtstp_handler(int sig)
+{
+    // Get the process ID of the current foreground job
+    pid_t fg_pid = fgpid(&job_list);
+    // If there's a foreground job and an error occurs while sending the SIGTSTP signal
+    if (fg_pid && kill(-fg_pid, SIGTSTP) < 0)
+    {
+        unix_error("error with signal");
+    }
+}
+/*
+ * sigquit_handler - The driver program can gracefully terminate the
+ *    child shell by sending it a SIGQUIT signal.
+ */
+void sigquit_handler(int sig)
+{
+    unix_error("Terminating after receipt of SIGQUIT signal\n");
+}
+
+/*********************
+ * End signal handlers
+ *********************/
+
+/***********************************************
+ * Helper routines that manipulate the job list
+ **********************************************/
+
+/* clearjob - Clear the entries in a job struct. The process arrays are
+ * kept for the next job to use the slot, since the handlers can't free */
+void clearjob(struct job_t *job)
+{
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    job->nprocs = 0;
+    job->nlive = 0;
+    job->stopsig = 0;
+    job->termsig = 0;
+    job->status = 0;
+    job->task = -1;
+    job->memo = -1;
+    job->limits = 0;
+    job->cpulimit = 0;
+    job->cgfd = -1;
+    job->cgname[0] = '\0';
+    memset(&job->ru, 0, sizeof(job->ru));
+    if (job->cmdline)
+        job->cmdline[0] = '\0';
+}
+
+/* initjob - Set up a fresh job slot that owns no memory yet */
+static void initjob(struct job_t *job)
+{
+    job->procs = NULL;
+    job->pstate = NULL;
+    job->proccap = 0;
+    job->cmdline = NULL;
+    job->cmdcap = 0;
+    clearjob(job);
+}
+
+/* pidslot - Return the hash bucket holding pid, or the empty bucket
+ * where it would be inserted */
+static int pidslot(struct jobtable *job_list, pid_t pid)
+{
+    unsigned mask = job_list->pidcap - 1;
+    unsigned i = ((unsigned)pid * 2654435761u) & mask;
+    int tomb = -1;
+
+    while (job_list->pidkey[i] != PID_EMPTY)
+    {
+        if (job_list->pidkey[i] == pid)
+            return i;
+        if (job_list->pidkey[i] == PID_DEAD && tomb < 0)
+            tomb = i;
+        i = (i + 1) & mask;
+    }
+    return tomb >= 0 ? tomb : (int)i;
+}
+
+/* rehashpids - Rebuild the pid hash with room for at least n live pids,
+ * dropping tombstones. Only called with job control signals blocked. */
+static void rehashpids(struct jobtable *job_list, int n)
+{
+    pid_t *oldkey = job_list->pidkey;
+    int *oldjid = job_list->pidjid;
+    int oldcap = job_list->pidcap;
+    int i, cap = 2 * INITJOBS;
+
+    while (cap < 2 * n)
+        cap *= 2;
+    job_list->pidkey = calloc(cap, sizeof(pid_t));
+    job_list->pidjid = calloc(cap, sizeof(int));
+    if (!job_list->pidkey || !job_list->pidjid)
+        unix_error("calloc error");
+    job_list->pidcap = cap;
+    job_list->pidused = 0;
+
+    for (i = 0; i < oldcap; i++)
+    {
+        if (oldkey[i] > 0)
+        {
+            int h = pidslot(job_list, oldkey[i]);
+            job_list->pidkey[h] = oldkey[i];
+            job_list->pidjid[h] = oldjid[i];
+            job_list->pidused++;
+        }
+    }
+    free(oldkey);
+    free(oldjid);
+}
+
+/* initjobs - Initialize the job list */
+void initjobs(struct jobtable *job_list)
+{
+    int i;
+
+    job_list->cap = INITJOBS + 1;
+    job_list->jobs = malloc(job_list->cap * sizeof(struct job_t));
+    if (!job_list->jobs)
+        unix_error("malloc error");
+    for (i = 0; i < job_list->cap; i++)
+        initjob(&job_list->jobs[i]);
+    job_list->maxjid = 0;
+    job_list->fg = NULL;
+    job_list->pidkey = NULL;
+    job_list->pidjid = NULL;
+    job_list->pidcap = 0;
+    rehashpids(job_list, INITJOBS);
+}
+
+/* maxjid - Returns largest allocated job ID */
+int maxjid(struct jobtable *job_list)
+{
+    return job_list->maxjid;
+}
+
+/* addjob - Add a job to the job list. pids are the processes of the
+ * pipeline; pids[0] leads its process group */
+int addjob(struct jobtable *job_list, pid_t *pids, int npids, int state,
+           char *cmdline)
+{
+    struct job_t *job;
+    int i, jid, h;
+
+    if (npids < 1 || pids[0] < 1)
+        return 0;
+
+    jid = job_list->maxjid + 1;
+    if (jid > MAXJID)
+    {
+        printf("Tried to create too many jobs\n");
+        return 0;
+    }
+
+    /* Grow the slot array; the cached fg pointer must follow it */
+    if (jid >= job_list->cap)
+    {
+        int cap = 2 * job_list->cap;
+        int fgjid = job_list->fg ? job_list->fg->jid : 0;
+        struct job_t *jobs = realloc(job_list->jobs,
+                                     cap * sizeof(struct job_t));
+        if (!jobs)
+        {
+            printf("Tried to create too many jobs\n");
+            return 0;
+        }
+        for (i = job_list->cap; i < cap; i++)
+            initjob(&jobs[i]);
+        job_list->jobs = jobs;
+        job_list->cap = cap;
+        job_list->fg = fgjid ? &jobs[fgjid] : NULL;
+    }
+    if (2 * (job_list->pidused + npids) > job_list->pidcap)
+        rehashpids(job_list, job_list->pidused + npids);
+
+    job = &job_list->jobs[jid];
+    if (npids > job->proccap)
+    {
+        pid_t *procs = realloc(job->procs, npids * sizeof(pid_t));
+        char *pstate = procs ? realloc(job->pstate, npids) : NULL;
+        if (procs)
+            job->procs = procs;
+        if (!pstate)
+        {
+            printf("Tried to create too many jobs\n");
+            return 0;
+        }
+        job->pstate = pstate;
+        job->proccap = npids;
+    }
+    if (strlen(cmdline) + 1 > job->cmdcap)
+    {
+        char *copy = realloc(job->cmdline, strlen(cmdline) + 1);
+        if (!copy)
+        {
+            printf("Tried to create too many jobs\n");
+            return 0;
+        }
+        job->cmdline = copy;
+        job->cmdcap = strlen(cmdline) + 1;
+    }
+    job->pid = pids[0];
+    job->jid = jid;
+    job->state = UNDEF;
+    job->nprocs = npids;
+    job->nlive = npids;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    strcpy(job->cmdline, cmdline);
+    setjobstate(job_list, job, state);
+
+    for (i = 0; i < npids; i++)
+    {
+        job->procs[i] = pids[i];
+        job->pstate[i] = PROC_RUNNING;
+        h = pidslot(job_list, pids[i]);
+        if (job_list->pidkey[h] == PID_EMPTY)
+            job_list->pidused++;
+        job_list->pidkey[h] = pids[i];
+        job_list->pidjid[h] = jid;
+    }
+    job_list->maxjid = jid;
+    if (audit_log.fd >= 0)
+        audit_record(AUDIT_START, job, 0);
+
+    if (verbose)
+    {
+        printf("Added job [%d] %d %s\n", job->jid, job->pid, job->cmdline);
+    }
+    return 1;
+}
+
+/* deletejob - Delete the job that process pid belongs to */
+int deletejob(struct jobtable *job_list, pid_t pid)
+{
+    struct job_t *job;
+    int i;
+
+    if ((job = getjobpid(job_list, pid)) == NULL)
+        return 0;
+
+    /* Every process of the pipeline leaves a tombstone */
+    for (i = 0; i < job->nprocs; i++)
+        job_list->pidkey[pidslot(job_list, job->procs[i])] = PID_DEAD;
+
+    if (job_list->fg == job)
+        job_list->fg = NULL;
+    if (audit_log.fd >= 0)
+        audit_record(AUDIT_END, job, job->status);
+    clearjob(job);
+
+    /* Next job ID is one past the largest live one */
+    while (job_list->maxjid > 0 &&
+           job_list->jobs[job_list->maxjid].pid == 0)
+        job_list->maxjid--;
+    return 1;
+}
+
+/* setjobstate - Change the state of a job, keeping the cached
+ * foreground job up to date */
+void setjobstate(struct jobtable *job_list, struct job_t *job, int state)
+{
+    if (job_list->fg == job && state != FG)
+        job_list->fg = NULL;
+    job->state = state;
+    if (state == FG)
+        job_list->fg = job;
+}
+
+/* resumejob - Continue every stopped process of a job, in state BG or FG */
+void resumejob(struct jobtable *job_list, struct job_t *job, int state)
+{
+    int i;
+
+    for (i = 0; i < job->nprocs; i++)
+        if (job->pstate[i] == PROC_STOPPED)
+            job->pstate[i] = PROC_RUNNING;
+    setjobstate(job_list, job, state);
+    kill(-(job->pid), SIGCONT);
+}
+
+/* jobrunning - Return 1 if some process of the job is still running */
+int jobrunning(struct job_t *job)
+{
+    int i;
+
+    for (i = 0; i < job->nprocs; i++)
+        if (job->pstate[i] == PROC_RUNNING)
+            return 1;
+    return 0;
+}
+
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpid(struct jobtable *job_list)
+{
+    struct job_t *fg = job_list->fg;
+
+    return fg ? fg->pid : 0;
+}
+
+/* getjobpid  - Find a job (by PID) on the job list */
+struct job_t *getjobpid(struct jobtable *job_list, pid_t pid)
+{
+    int h;
+
+    if (pid < 1)
+        return NULL;
+    h = pidslot(job_list, pid);
+    if (job_list->pidkey[h] != pid)
+        return NULL;
+    return &job_list->jobs[job_list->pidjid[h]];
+}
+
+/* getjobjid  - Find a job (by JID) on the job list */
+struct job_t *getjobjid(struct jobtable *job_list, int jid)
+{
+    if (jid < 1 || jid > job_list->maxjid)
+        return NULL;
+    if (job_list->jobs[jid].pid == 0)
+        return NULL;
+    return &job_list->jobs[jid];
+}
+
+/* pid2jid - Map process ID to job ID */
+int pid2jid(pid_t pid)
+{
+    struct job_t *job = getjobpid(&job_list, pid);
+
+    return job ? job->jid : 0;
+}
+
+/* usage_json - Add the run time and usage of job, as JSON members */
+static void usage_json(struct outbuf *ob, struct job_t *job,
+                       struct timespec *now)
+{
+    ob_puts(ob, ",\"real_us\":");
+    ob_putl(ob, usecs(&job->start, now));
+    ob_puts(ob, ",\"user_us\":");
+    ob_putl(ob, job->ru.ru_utime.tv_sec * 1000000L + job->ru.ru_utime.tv_usec);
+    ob_puts(ob, ",\"sys_us\":");
+    ob_putl(ob, job->ru.ru_stime.tv_sec * 1000000L + job->ru.ru_stime.tv_usec);
+    ob_puts(ob, ",\"maxrss_kb\":");
+    ob_putl(ob, job->ru.ru_maxrss);
+    ob_puts(ob, ",\"nvcsw\":");
+    ob_putl(ob, job->ru.ru_nvcsw);
+    ob_puts(ob, ",\"nivcsw\":");
+    ob_putl(ob, job->ru.ru_nivcsw);
+}
+
+/* listjobs - Print the job list. With LIST_VERBOSE each job is followed
+ * by its run time so far and the usage of its processes reaped so far;
+ * with LIST_JSON the list is a JSON array of jobs, usage included. The
+ * listing is put together in one buffer, so a short job table takes a
+ * single write */
+void listjobs(struct jobtable *job_list, int output_fd, int flags)
+{
+    static const char *states[] = {[BG] = "Running    ",
+                                   [FG] = "Foreground ",
+                                   [ST] = "Stopped    "};
+    static const char *jstates[] = {[BG] = "running",
+                                    [FG] = "foreground",
+                                    [ST] = "stopped"};
+    int i, k, first = 1;
+    struct job_t *job;
+    char buf[MAXLINE_TSH];
+    struct outbuf ob;
+    struct timespec now;
+    static char obuf[1 << 16];
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ob_init(&ob, output_fd, obuf, sizeof(obuf));
+    if (flags & LIST_CHECK)
+    {
+        i = checkjobs(job_list, &ob);
+        ob_putl(&ob, i);
+        ob_puts(&ob, i == 1 ? " problem in the job table\n"
+                            : " problems in the job table\n");
+        ob_flush(&ob);
+        return;
+    }
+    if (flags & LIST_JSON)
+        ob_puts(&ob, "[");
+    for (i = 1; i <= job_list->maxjid; i++)
+    {
+        job = &job_list->jobs[i];
+        if (job->pid == 0)
+            continue;
+        if (flags & LIST_JSON)
+        {
+            ob_puts(&ob, first ? "{\"jid\":" : ",{\"jid\":");
+            ob_putl(&ob, job->jid);
+            ob_puts(&ob, ",\"pgid\":");
+            ob_putl(&ob, job->pid);
+            ob_puts(&ob, ",\"state\":\"");
+            ob_puts(&ob, job->state == BG || job->state == FG ||
+                                 job->state == ST
+                             ? jstates[job->state]
+                             : "undefined");
+            ob_puts(&ob, "\",\"pids\":[");
+            for (k = 0; k < job->nprocs; k++)
+            {
+                if (k > 0)
+                    ob_puts(&ob, ",");
+                ob_putl(&ob, job->procs[k]);
+            }
+            ob_puts(&ob, "],\"live\":");
+            ob_putl(&ob, job->nlive);
+            ob_puts(&ob, ",\"cmdline\":");
+            ob_putjson(&ob, job->cmdline);
+            usage_json(&ob, job, &now);
+            ob_puts(&ob, "}");
+            first = 0;
+            continue;
+        }
+
+        ob_puts(&ob, "[");
+        ob_putl(&ob, job->jid);
+        ob_puts(&ob, "] (");
+        ob_putl(&ob, job->pid);
+        ob_puts(&ob, ") ");
+        if (job->state == BG || job->state == FG || job->state == ST)
+            ob_puts(&ob, states[job->state]);
+        else
+        {
+            sprintf(buf, "listjobs: Internal error: job[%d].state=%d ", i,
+                    job->state);
+            ob_puts(&ob, buf);
+        }
+        ob_puts(&ob, job->cmdline);
+        ob_puts(&ob, "\n");
+        if (flags & LIST_VERBOSE)
+        {
+            long long real = usecs(&job->start, &now);
+            snprintf(buf, MAXLINE_TSH,
+                     "    real %lld.%03llds user %ld.%03lds "
+                     "sys %ld.%03lds maxrss %ldk ctxsw %ld+%ld\n",
+                     real / 1000000, real / 1000 % 1000,
+                     (long)job->ru.ru_utime.tv_sec,
+                     (long)job->ru.ru_utime.tv_usec / 1000,
+                     (long)job->ru.ru_stime.tv_sec,
+                     (long)job->ru.ru_stime.tv_usec / 1000,
+                     job->ru.ru_maxrss, job->ru.ru_nvcsw,
+                     job->ru.ru_nivcsw);
+            ob_puts(&ob, buf);
+        }
+    }
+    if (flags & LIST_JSON)
+        ob_puts(&ob, "]\n");
+    if (ob_flush(&ob) < 0)
+    {
+        fprintf(stderr, "Error writing to output file\n");
+        exit(1);
+    }
+}
+
+/* jobproblem - Report that job jid breaks the invariant what */
+static void jobproblem(struct outbuf *ob, int jid, const char *what)
+{
+    ob_puts(ob, "checkjobs: job ");
+    ob_putl(ob, jid);
+    ob_puts(ob, ": ");
+    ob_puts(ob, what);
+    ob_puts(ob, "\n");
+}
+
+/* checkjobs - Check the invariants of the job table, telling ob about
+ * each one that doesn't hold, and return how many don't. Every live job
+ * sits in the slot of its jid with a known state, procs[0] leads it,
+ * nlive counts its unreaped processes, and each of its pids hashes to
+ * it; a job that isn't stopped still has a process running; there is
+ * at most one foreground job, and it is the cached one; maxjid is live.
+ * Async-signal-safe, so the reaper can run it (-DTSH_CHECK) */
+int checkjobs(struct jobtable *job_list, struct outbuf *ob)
+{
+    struct job_t *job, *fg = NULL;
+    int jid, k, h, live, bad = 0, npids = 0, keys = 0;
+
+    for (jid = 1; jid <= job_list->maxjid && jid < job_list->cap; jid++)
+    {
+        job = &job_list->jobs[jid];
+        if (job->pid == 0)
+            continue;
+        if (job->jid != jid && ++bad)
+            jobproblem(ob, jid, "in the slot of another jid");
+        if (job->state != FG && job->state != BG && job->state != ST &&
+            ++bad)
+            jobproblem(ob, jid, "has no state");
+        if ((job->nprocs < 1 || job->procs[0] != job->pid) && ++bad)
+            jobproblem(ob, jid, "is not led by its first process");
+        for (live = 0, k = 0; k < job->nprocs; k++)
+        {
+            live += job->pstate[k] != PROC_DONE;
+            h = pidslot(job_list, job->procs[k]);
+            if ((job_list->pidkey[h] != job->procs[k] ||
+                 job_list->pidjid[h] != jid) &&
+                ++bad)
+                jobproblem(ob, jid, "has a pid the hash doesn't map to it");
+        }
+        npids += job->nprocs;
+        if (live != job->nlive && ++bad)
+            jobproblem(ob, jid, "nlive doesn't count its live processes");
+        if (live == 0 && ++bad)
+            jobproblem(ob, jid, "is done but still listed");
+        if (job->state != ST && live > 0 && !jobrunning(job) && ++bad)
+            jobproblem(ob, jid, "is not stopped but nothing runs");
+        if (job->state == FG)
+        {
+            if (fg != NULL && ++bad)
+                jobproblem(ob, jid, "is a second foreground job");
+            fg = job;
+        }
+    }
+    if (job_list->fg != fg && ++bad)
+        jobproblem(ob, fg ? fg->jid : 0, "is not the cached foreground job");
+    if (job_list->maxjid > 0 && job_list->jobs[job_list->maxjid].pid == 0 &&
+        ++bad)
+        jobproblem(ob, job_list->maxjid, "is maxjid but not live");
+    for (h = 0; h < job_list->pidcap; h++)
+        keys += job_list->pidkey[h] != PID_EMPTY &&
+                job_list->pidkey[h] != PID_DEAD;
+    if (keys != npids && ++bad)
+        jobproblem(ob, 0, "the pid hash holds pids of no job");
+    return bad;
+}
+
+#ifdef TSH_CHECK
+/*
+ * replay - Replay a driver trace against the shell. The shell is forked
+ *    and returns to main() reading its commands from a pipe, while this
+ *    process feeds it the trace, one line at a time:
+ *      command           written to the shell as is
+ *      REPEAT n command  written n times, to start many jobs at once
+ *      TSTP, INT, QUIT   send the shell that signal, which it passes to
+ *                        the foreground job as ctrl-z, ctrl-c, ctrl-\ do
+ *      SLEEP secs        wait before the next line (secs may be 0.5)
+ *      CLOSE             end the shell's input
+ *      WAIT              wait for the shell to exit
+ *    Blank lines and lines starting with # are skipped. At the end of
+ *    the trace the shell gets a last jobs --check and the end of its
+ *    input. As the build checks the job table after every reap, the
+ *    replay fails if any transition leaves it wrong: the driver exits 1
+ *    unless the shell exited with status 0.
+ */
+void replay(const char *path)
+{
+    static const struct
+    {
+        const char *name;
+        int sig;
+    } sigs[] = {{"TSTP", SIGTSTP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}};
+    char line[MAXLINE_TSH], *arg;
+    struct timespec ts;
+    sigset_t held;
+    int p[2], status, n, i, done = 0;
+    double secs;
+    pid_t pid;
+    FILE *f;
+
+    if ((f = fopen(path, "r")) == NULL)
+        unix_error("error opening trace");
+    if (pipe(p) < 0)
+        unix_error("pipe error");
+
+    // the shell takes the trace's signals once its handlers are in
+    sigemptyset(&held);
+    for (i = 0; i < (int)(sizeof(sigs) / sizeof(sigs[0])); i++)
+        sigaddset(&held, sigs[i].sig);
+    sigprocmask(SIG_BLOCK, &held, NULL);
+    if ((pid = fork()) < 0)
+        unix_error("fork error");
+    if (pid == 0)
+    {
+        fclose(f);
+        dup2(p[0], STDIN_FILENO);
+        close(p[0]);
+        close(p[1]);
+        return;
+    }
+    close(p[0]);
+    sigprocmask(SIG_UNBLOCK, &held, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!done && fgets(line, sizeof(line) - 1, f) != NULL)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        for (i = 0; i < (int)(sizeof(sigs) / sizeof(sigs[0])); i++)
+            if (!strcmp(line, sigs[i].name))
+                break;
+        if (i < (int)(sizeof(sigs) / sizeof(sigs[0])))
+            kill(pid, sigs[i].sig);
+        else if (!strncmp(line, "SLEEP ", 6))
+        {
+            secs = strtod(line + 6, NULL);
+            ts.tv_sec = (time_t)secs;
+            ts.tv_nsec = (long)((secs - ts.tv_sec) * 1e9);
+            while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+                ;
+        }
+        else if (!strcmp(line, "CLOSE"))
+        {
+            close(p[1]);
+            p[1] = -1;
+        }
+        else if (!strcmp(line, "WAIT"))
+            done = 1;
+        else if (p[1] >= 0)
+        {
+            n = 1;
+            arg = line;
+            if (!strncmp(line, "REPEAT ", 7))
+                n = strtol(line + 7, &arg, 10);
+            while (*arg == ' ')
+                arg++;
+            strcat(arg, "\n");
+            for (i = 0; i < n; i++)
+                writeall(p[1], arg, strlen(arg));
+        }
+    }
+    fclose(f);
+
+    if (p[1] >= 0)
+    {
+        if (!done)
+            writeall(p[1], "jobs --check\n", 13);
+        close(p[1]);
+    }
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    if (WIFSIGNALED(status))
+        printf("replay: the shell was killed by signal %d\n",
+               WTERMSIG(status));
+    else if (WEXITSTATUS(status) != 0)
+        printf("replay: the shell exited with status %d\n",
+               WEXITSTATUS(status));
+    exit(WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1);
+}
+#endif
+
+/* rusage_add - Add the usage ru to sum. Times and counts add up, the
+ * peak resident set size is the larger of the two */
+void rusage_add(struct rusage *sum, const struct rusage *ru)
+{
+    sum->ru_utime.tv_sec += ru->ru_utime.tv_sec;
+    sum->ru_utime.tv_usec += ru->ru_utime.tv_usec;
+    if (sum->ru_utime.tv_usec >= 1000000)
+    {
+        sum->ru_utime.tv_sec++;
+        sum->ru_utime.tv_usec -= 1000000;
+    }
+    sum->ru_stime.tv_sec += ru->ru_stime.tv_sec;
+    sum->ru_stime.tv_usec += ru->ru_stime.tv_usec;
+    if (sum->ru_stime.tv_usec >= 1000000)
+    {
+        sum->ru_stime.tv_sec++;
+        sum->ru_stime.tv_usec -= 1000000;
+    }
+    if (ru->ru_maxrss > sum->ru_maxrss)
+        sum->ru_maxrss = ru->ru_maxrss;
+    sum->ru_nvcsw += ru->ru_nvcsw;
+    sum->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/* rusage_since - Turn the usage ru into the usage accrued since before
+ * was taken. The peak resident set size is kept as it is */
+void rusage_since(struct rusage *ru, const struct rusage *before)
+{
+    ru->ru_utime.tv_sec -= before->ru_utime.tv_sec;
+    ru->ru_utime.tv_usec -= before->ru_utime.tv_usec;
+    if (ru->ru_utime.tv_usec < 0)
+    {
+        ru->ru_utime.tv_sec--;
+        ru->ru_utime.tv_usec += 1000000;
+    }
+    ru->ru_stime.tv_sec -= before->ru_stime.tv_sec;
+    ru->ru_stime.tv_usec -= before->ru_stime.tv_usec;
+    if (ru->ru_stime.tv_usec < 0)
+    {
+        ru->ru_stime.tv_sec--;
+        ru->ru_stime.tv_usec += 1000000;
+    }
+    ru->ru_nvcsw -= before->ru_nvcsw;
+    ru->ru_nivcsw -= before->ru_nivcsw;
+}
+
+/* usecs - Return the microseconds from one CLOCK_MONOTONIC time to
+ * another */
+long long usecs(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000LL +
+           (to->tv_nsec - from->tv_nsec) / 1000;
+}
+/******************************
+ * end job list helper routines
+ ******************************/
+
+/*******************************************
+ * Helper routines that manage the command hash
+ *******************************************/
+
+/* hashname - FNV-1a hash of a command name, reduced to a bucket */
+static unsigned hashname(const char *name)
+{
+    unsigned h = 2166136261u;
+
+    while (*name)
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h & (CMDHASH_SIZE - 1);
+}
+
+/* searchpath - Find name in the directories of $PATH. Returns a
+ * malloc'ed path to an executable regular file, or NULL */
+static char *searchpath(const char *name)
+{
+    const char *dir = getenv("PATH");
+    const char *end;
+    size_t dirlen, namelen = strlen(name);
+    struct stat st;
+    char *path;
+
+    if (dir == NULL)
+        dir = "/bin:/usr/bin";
+    for (; ; dir = end + 1)
+    {
+        end = strchrnul(dir, ':');
+        dirlen = end - dir;
+        if ((path = malloc(dirlen + namelen + 3)) == NULL)
+            return NULL;
+        /* An empty PATH element means the current directory */
+        if (dirlen == 0)
+            path[dirlen++] = '.';
+        else
+            memcpy(path, dir, dirlen);
+        path[dirlen] = '/';
+        memcpy(path + dirlen + 1, name, namelen + 1);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+            access(path, X_OK) == 0)
+            return path;
+        free(path);
+        if (*end == '\0')
+            return NULL;
+    }
+}
+
+/* hash_lookup - Return the path to execute for name, searching PATH and
+ * remembering the result if name isn't hashed yet. Names containing a
+ * slash are used as is. *cached tells whether the answer came from the
+ * hash. Returns NULL if the command can't be found */
+const char *hash_lookup(const char *name, int *cached)
+{
+    struct cmdhash_entry *e, **bucket;
+    char *path;
+
+    *cached = 0;
+    if (strchr(name, '/') != NULL)
+        return name;
+
+    bucket = &cmdhash[hashname(name)];
+    for (e = *bucket; e != NULL; e = e->next)
+    {
+        if (!strcmp(e->name, name))
+        {
+            e->hits++;
+            *cached = 1;
+            return e->path;
+        }
+    }
+
+    if ((path = searchpath(name)) == NULL)
+        return NULL;
+    if ((e = malloc(sizeof(*e))) == NULL || (e->name = strdup(name)) == NULL)
+    {
+        free(e);
+        free(path);
+        return NULL;
+    }
+    e->path = path;
+    e->hits = 1;
+    e->next = *bucket;
+    *bucket = e;
+    return path;
+}
+
+/* hash_forget - Drop the entry for name, e.g. after its file vanished */
+void hash_forget(const char *name)
+{
+    struct cmdhash_entry *e, **link = &cmdhash[hashname(name)];
+
+    for (; (e = *link) != NULL; link = &e->next)
+    {
+        if (!strcmp(e->name, name))
+        {
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+    }
+}
+
+/* hash_clear - Forget every remembered command */
+void hash_clear(void)
+{
+    struct cmdhash_entry *e, *next;
+    int i;
+
+    for (i = 0; i < CMDHASH_SIZE; i++)
+    {
+        for (e = cmdhash[i]; e != NULL; e = next)
+        {
+            next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+        cmdhash[i] = NULL;
+    }
+}
+
+/* hash_list - Print the command hash in the style of bash */
+void hash_list(int output_fd)
+{
+    struct cmdhash_entry *e;
+    int i, empty = 1;
+
+    for (i = 0; i < CMDHASH_SIZE; i++)
+    {
+        for (e = cmdhash[i]; e != NULL; e = e->next)
+        {
+            if (empty)
+                dprintf(output_fd, "hits\tcommand\n");
+            empty = 0;
+            dprintf(output_fd, "%4d\t%s\n", e->hits, e->path);
+        }
+    }
+    if (empty)
+        dprintf(output_fd, "hash: hash table empty\n");
+}
+/*********************************
+ * end command hash helper routines
+ *********************************/
+
+/**********************************************
+ * Helper routines that keep the environment
+ **********************************************/
+
+/* env_find - Index of the variable the first len bytes of name are the
+ * name of, or -1 */
+static int env_find(const char *name, size_t len)
+{
+    int i;
+
+    for (i = 0; i < env_store.n; i++)
+        if (!strncmp(env_store.vars[i], name, len) &&
+            env_store.vars[i][len] == '=')
+            return i;
+    return -1;
+}
+
+/* env_init - Take over the environment the shell was started with */
+void env_init(void)
+{
+    int n;
+
+    for (n = 0; environ[n] != NULL; n++)
+        ;
+    env_store.cap = n + 16;
+    if ((env_store.vars = malloc(env_store.cap * sizeof(char *))) == NULL)
+        unix_error("malloc error");
+    for (env_store.n = 0; env_store.n < n; env_store.n++)
+        if ((env_store.vars[env_store.n] = strdup(environ[env_store.n])) ==
+            NULL)
+            unix_error("strdup error");
+    env_store.vars[n] = NULL;
+    environ = env_store.vars;
+}
+
+/* env_assignment - Return 1 if word is NAME=value, NAME being letters,
+ * digits and underscores, not starting with a digit */
+int env_assignment(const char *word)
+{
+    const char *p = word;
+
+    if (!isalpha((unsigned char)*p) && *p != '_')
+        return 0;
+    while (isalnum((unsigned char)*p) || *p == '_')
+        p++;
+    return *p == '=';
+}
+
+/* env_set - Set the variable of the NAME=value string assign. Changing
+ * PATH forgets where commands were found. Returns 0 */
+int env_set(const char *assign)
+{
+    size_t len = strchr(assign, '=') - assign;
+    int i = env_find(assign, len);
+    char *var;
+
+    if ((var = strdup(assign)) == NULL)
+        unix_error("strdup error");
+    if (i >= 0)
+    {
+        free(env_store.vars[i]);
+        env_store.vars[i] = var;
+    }
+    else
+    {
+        if (env_store.n + 1 == env_store.cap)
+        {
+            env_store.cap *= 2;
+            env_store.vars = realloc(env_store.vars,
+                                     env_store.cap * sizeof(char *));
+            if (env_store.vars == NULL)
+                unix_error("realloc error");
+            environ = env_store.vars;
+        }
+        env_store.vars[env_store.n++] = var;
+        env_store.vars[env_store.n] = NULL;
+    }
+    if (len == 4 && !strncmp(assign, "PATH", 4))
+        hash_clear();
+    return 0;
+}
+
+/* env_unset - Remove the variable name, if it is set. Returns 0 */
+int env_unset(const char *name)
+{
+    int i = env_find(name, strlen(name));
+
+    if (i < 0)
+        return 0;
+    free(env_store.vars[i]);
+    env_store.vars[i] = env_store.vars[--env_store.n];
+    env_store.vars[env_store.n] = NULL;
+    if (!strcmp(name, "PATH"))
+        hash_clear();
+    return 0;
+}
+
+/* env_for - The envp of the command st: the environment itself, unless
+ * the command has VAR=value words, which patch a copy of the array in
+ * the command arena. The strings are shared, not copied */
+char **env_for(struct cmdline_stage *st)
+{
+    char **envp;
+    int i, k, n = env_store.n;
+    size_t len;
+
+    if (st->nassigns == 0)
+        return env_store.vars;
+    envp = arena_alloc(&cmd_arena, (n + st->nassigns + 1) * sizeof(char *));
+    memcpy(envp, env_store.vars, n * sizeof(char *));
+    for (i = 0; i < st->nassigns; i++)
+    {
+        len = strchr(st->assigns[i], '=') - st->assigns[i];
+        for (k = 0; k < n; k++)
+            if (!strncmp(envp[k], st->assigns[i], len) && envp[k][len] == '=')
+                break;
+        envp[k] = st->assigns[i];
+        if (k == n)
+            n++;
+    }
+    envp[n] = NULL;
+    return envp;
+}
+
+/*********************************
+ * end environment helper routines
+ *********************************/
+
+/**********************************************
+ * Helper routines that move data inside the kernel
+ **********************************************/
+
+#define MOVE_CHUNK (1 << 16) /* bytes per copy_file_range or splice call */
+
+/* Ways of moving data, from fastest to the plain fallback */
+#define MOVE_COPY 0     /* copy_file_range: file to file */
+#define MOVE_SENDFILE 1 /* sendfile: file to anything */
+#define MOVE_SPLICE 2   /* splice: either side a pipe */
+#define MOVE_RW 3       /* read and write through a user buffer */
+
+/* isfifo - Return 1 if fd is a pipe (splice needs one on one side) */
+static int isfifo(int fd)
+{
+    struct stat st;
+
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/* unsuitable - Return 1 if err means the fds don't support a method */
+static int unsuitable(int err)
+{
+    return err == EINVAL || err == EXDEV || err == ENOSYS || err == EBADF ||
+           err == EOPNOTSUPP;
+}
+
+/* rwcopy - Copy up to len bytes (all of it if len < 0) through a user
+ * buffer, for fds the kernel can't move between. Returns the number of
+ * bytes copied or -1 */
+static ssize_t rwcopy(int in_fd, int out_fd, ssize_t len)
+{
+    static char buf[MOVE_CHUNK];
+    ssize_t n, w, done, total = 0;
+
+    while ((len < 0 || total < len) && !builtin_intr)
+    {
+        n = (len < 0 || len - total > MOVE_CHUNK) ? MOVE_CHUNK : len - total;
+        if ((n = read(in_fd, buf, n)) < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n < 0 ? -1 : total;
+        for (done = 0; done < n; done += w)
+        {
+            if ((w = write(out_fd, buf + done, n - done)) < 0)
+            {
+                if (errno != EINTR)
+                    return -1;
+                w = 0;
+            }
+        }
+        total += n;
+    }
+    return total;
+}
+
+/* copyfd - Copy everything readable from in_fd to out_fd, using the
+ * fastest method the two fds support. A method that doesn't suit them
+ * fails before moving data, or leaves the file offsets where the next
+ * method picks up. Returns 0 or -1 */
+int copyfd(int in_fd, int out_fd)
+{
+    ssize_t n;
+    int method = (isfifo(in_fd) || isfifo(out_fd)) ? MOVE_SPLICE : MOVE_COPY;
+
+    while (!builtin_intr)
+    {
+        switch (method)
+        {
+        case MOVE_COPY:
+            n = copy_file_range(in_fd, NULL, out_fd, NULL, MOVE_CHUNK, 0);
+            break;
+        case MOVE_SENDFILE:
+            n = sendfile(out_fd, in_fd, NULL, MOVE_CHUNK);
+            break;
+        case MOVE_SPLICE:
+            n = splice(in_fd, NULL, out_fd, NULL, MOVE_CHUNK, SPLICE_F_MOVE);
+            break;
+        default:
+            return rwcopy(in_fd, out_fd, -1) < 0 ? -1 : 0;
+        }
+
+        if (n == 0)
+            return 0;
+        if (n > 0 || errno == EINTR)
+            continue;
+        if (!unsuitable(errno))
+            return -1;
+        method = (method == MOVE_COPY) ? MOVE_SENDFILE : MOVE_RW;
+    }
+    return 0;
+}
+
+/* drainpipe - Move exactly len bytes out of the pipe rfd to out_fd,
+ * through a user buffer if out_fd can't be spliced to (a terminal or an
+ * O_APPEND file). Returns 0 or -1 */
+static int drainpipe(int rfd, int out_fd, ssize_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = splice(rfd, NULL, out_fd, NULL, len, SPLICE_F_MOVE);
+        if (n < 0 && unsuitable(errno))
+            n = rwcopy(rfd, out_fd, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/* teefd - Copy everything readable from in_fd to all nout fds. Each
+ * chunk is spliced into a private pipe, duplicated with tee(2) into a
+ * second one for every output but the last, and spliced out from
+ * there, so the data never leaves the kernel. Returns 0 or -1 */
+int teefd(int in_fd, int *out_fds, int nout)
+{
+    int p[2], q[2], i, rc = 0;
+    ssize_t n, t;
+
+    if (nout == 1)
+        return copyfd(in_fd, out_fds[0]);
+    if (pipe2(p, O_CLOEXEC) < 0)
+        return -1;
+    if (pipe2(q, O_CLOEXEC) < 0)
+    {
+        close(p[0]);
+        close(p[1]);
+        return -1;
+    }
+    /* q must hold whatever p does, or tee(2) would come up short */
+    fcntl(q[1], F_SETPIPE_SZ, fcntl(p[1], F_GETPIPE_SZ));
+
+    while (!builtin_intr)
+    {
+        n = splice(in_fd, NULL, p[1], NULL, MOVE_CHUNK, SPLICE_F_MOVE);
+        if (n < 0 && unsuitable(errno))
+            n = rwcopy(in_fd, p[1], MOVE_CHUNK);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            rc = n < 0 ? -1 : 0;
+            break;
+        }
+
+        for (i = 0; i < nout - 1 && rc == 0; i++)
+        {
+            while ((t = tee(p[0], q[1], n, 0)) < 0 && errno == EINTR)
+                ;
+            if (t != n || drainpipe(q[0], out_fds[i], n) < 0)
+                rc = -1;
+        }
+        if (rc < 0 || drainpipe(p[0], out_fds[nout - 1], n) < 0)
+        {
+            rc = -1;
+            break;
+        }
+    }
+
+    close(p[0]);
+    close(p[1]);
+    close(q[0]);
+    close(q[1]);
+    return rc;
+}
+
+/*
+ * writeall - Write all n bytes of buf to fd. Returns 0 or -1
+ */
+int writeall(int fd, const char *buf, size_t n)
+{
+    ssize_t w;
+
+    while (n > 0)
+    {
+        if ((w = write(fd, buf, n)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/*
+ * here_fd - Return a descriptor that reads back text, for << and <<<:
+ *    a pipe when the text fits in one atomic write, else a memfd, so
+ *    nothing touches the filesystem. Returns -1 on failure.
+ */
+int here_fd(const char *text)
+{
+    size_t n = strlen(text);
+    int fds[2], fd;
+
+    if (n <= PIPE_BUF)
+    {
+        if (pipe2(fds, O_CLOEXEC) < 0)
+            return -1;
+        if (n > 0 && write(fds[1], text, n) != (ssize_t)n)
+        {
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        close(fds[1]);
+        return fds[0];
+    }
+    if ((fd = memfd_create("tsh-here", MFD_CLOEXEC)) < 0)
+        return -1;
+    if (writeall(fd, text, n) < 0 || lseek(fd, 0, SEEK_SET) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+/*************************************
+ * end kernel data mover helper routines
+ *************************************/
+
+/**********************************************
+ * Helper routines that place jobs on CPUs and NUMA nodes
+ **********************************************/
+
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+/* parse_idlist - Parse a CPU or node list such as "0-3,8,10-11" into
+ * the bitmap bits of nbits bits. Returns the number of ids in the
+ * list, or -1 if it is malformed or names an id past nbits */
+int parse_idlist(const char *list, unsigned long *bits, int nbits)
+{
+    const char *p = list;
+    char *end;
+    long lo, hi, id;
+    int n = 0;
+
+    memset(bits, 0, nbits / 8);
+    while (*p != '\0')
+    {
+        lo = hi = strtol(p, &end, 10);
+        if (end == p || lo < 0)
+            return -1;
+        p = end;
+        if (*p == '-')
+        {
+            hi = strtol(p + 1, &end, 10);
+            if (end == p + 1 || hi < lo)
+                return -1;
+            p = end;
+        }
+        if (hi >= nbits)
+            return -1;
+        for (id = lo; id <= hi; id++, n++)
+            bits[id / BITS_PER_LONG] |= 1UL << (id % BITS_PER_LONG);
+        if (*p == ',')
+            p++;
+        else if (*p != '\0' && *p != '\n')
+            return -1;
+        else
+            break;
+    }
+    return n;
+}
+
+/* read_idlist - Read a list in the format of parse_idlist from a sysfs
+ * file into ids[], lowest first. Returns how many, or -1 */
+int read_idlist(const char *path, int *ids, int max)
+{
+    unsigned long bits[NODEBITS > CPU_SETSIZE ? NODEBITS / BITS_PER_LONG
+                                              : CPU_SETSIZE / BITS_PER_LONG];
+    char buf[MAXLINE_TSH];
+    ssize_t len;
+    int fd, id, n = 0, nbits = 8 * sizeof(bits);
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return -1;
+    buf[len] = '\0';
+    if (parse_idlist(buf, bits, nbits) < 0)
+        return -1;
+    for (id = 0; id < nbits && n < max; id++)
+        if (bits[id / BITS_PER_LONG] & (1UL << (id % BITS_PER_LONG)))
+            ids[n++] = id;
+    return n;
+}
+
+/* spread_placement - Fill place for a task dealt to CPU id (SPREAD_CPUS),
+ * or to NUMA node id (SPREAD_NODES): the node's CPUs, with memory bound
+ * to it. Returns 0 or -1 */
+int spread_placement(int spread, int id, struct placement *place)
+{
+    int cpus[CPU_SETSIZE];
+    char path[MAXLINE_TSH];
+    int i, n;
+
+    memset(place, 0, sizeof(*place));
+    place->mpol = MPOL_DEFAULT;
+    place->has_cpus = 1;
+    CPU_ZERO(&place->cpus);
+    if (spread == SPREAD_CPUS)
+    {
+        CPU_SET(id, &place->cpus);
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             id);
+    if ((n = read_idlist(path, cpus, CPU_SETSIZE)) < 0)
+        return -1;
+    for (i = 0; i < n; i++)
+        CPU_SET(cpus[i], &place->cpus);
+    place->has_cpus = n > 0; /* a memory-only node has no CPUs */
+    place->mpol = MPOL_BIND;
+    place->nodes[id / BITS_PER_LONG] |= 1UL << (id % BITS_PER_LONG);
+    return 0;
+}
+
+/* place_self - Apply place to the calling process, which then passes it
+ * on to what it executes. Returns 0 or -1 with errno set */
+int place_self(const struct placement *place)
+{
+    if (place->has_cpus &&
+        sched_setaffinity(0, sizeof(place->cpus), &place->cpus) < 0)
+        return -1;
+    if (place->mpol != MPOL_DEFAULT &&
+        syscall(SYS_set_mempolicy, place->mpol, place->nodes,
+                NODEBITS + 1) < 0)
+        return -1;
+    return 0;
+}
+
+/*********************************
+ * end job placement helper routines
+ *********************************/
+
+/**********************************************
+ * Helper routines that limit the resources of jobs
+ **********************************************/
+
+/* writefileat - Write the string val to the file name in directory dirfd.
+ * Returns 0 or -1 */
+static int writefileat(int dirfd, const char *name, const char *val)
+{
+    int fd, r;
+
+    if ((fd = openat(dirfd, name, O_WRONLY | O_CLOEXEC)) < 0)
+        return -1;
+    r = write(fd, val, strlen(val)) < 0 ? -1 : 0;
+    close(fd);
+    return r;
+}
+
+/* cgroup_root - Open the cgroup that job cgroups are made in: $TSH_CGROUP
+ * if set, else the shell's own cgroup (which cgroup v2 only lets have
+ * controlled children if no process lives in it, so a delegated, empty
+ * cgroup is the usual choice). Returns 0 or -1 */
+static int cgroup_root(void)
+{
+    const char *dir = getenv("TSH_CGROUP");
+    char path[MAXLINE_TSH + 32], line[MAXLINE_TSH], *p;
+    ssize_t len;
+    int fd;
+
+    if (dir == NULL || *dir == '\0')
+    {
+        /* The cgroup v2 hierarchy is the line "0::/path"; on a hybrid
+         * system it is mounted at /sys/fs/cgroup/unified */
+        if ((fd = open("/proc/self/cgroup", O_RDONLY | O_CLOEXEC)) < 0)
+            return -1;
+        len = read(fd, line, sizeof(line) - 1);
+        close(fd);
+        line[len > 0 ? len : 0] = '\0';
+        for (p = line; p != NULL && strncmp(p, "0::", 3) != 0;)
+            if ((p = strchr(p, '\n')) != NULL)
+                p++;
+        if (p == NULL)
+        {
+            errno = ENOTSUP;
+            return -1;
+        }
+        p[strcspn(p, "\n")] = '\0';
+        snprintf(path, sizeof(path), "%s%s",
+                 access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0
+                     ? "/sys/fs/cgroup"
+                     : "/sys/fs/cgroup/unified",
+                 p + 3);
+        dir = path;
+    }
+    if ((cgroot_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return -1;
+
+    /* The controllers may be on already, or not be ours to turn on */
+    writefileat(cgroot_fd, "cgroup.subtree_control", "+memory +cpu");
+    return 0;
+}
+
+/* cgroup_create - Make the cgroup of a job with limits lim, and set its
+ * memory.max and cpu.max. Returns 0, or -1 with errno set */
+int cgroup_create(struct limits *lim)
+{
+    static unsigned seq = 0;
+    int err;
+
+    if (cgroot_fd < 0 && cgroup_root() < 0)
+        return -1;
+    snprintf(lim->cgname, sizeof(lim->cgname), "tsh-%d.%u", (int)getpid(),
+             seq++);
+    if (mkdirat(cgroot_fd, lim->cgname, 0755) < 0)
+        return -1;
+    lim->cgfd = openat(cgroot_fd, lim->cgname,
+                       O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (lim->cgfd < 0 ||
+        (lim->memory_max[0] &&
+         writefileat(lim->cgfd, "memory.max", lim->memory_max) < 0) ||
+        (lim->cpu_max[0] &&
+         writefileat(lim->cgfd, "cpu.max", lim->cpu_max) < 0))
+    {
+        err = errno;
+        cgroup_remove(lim->cgfd, lim->cgname);
+        lim->cgfd = -1;
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/* cgroup_remove - Close and remove a job's cgroup. A cgroup that still
+ * holds processes (which left the job behind) stays. Async-signal-safe */
+void cgroup_remove(int cgfd, const char *name)
+{
+    if (cgfd >= 0)
+        close(cgfd);
+    unlinkat(cgroot_fd, name, AT_REMOVEDIR);
+}
+
+/* limit_self - Apply the limits lim to the calling process, which then
+ * passes them on to what it executes: join the job's cgroup, then set
+ * each rlimit, soft and hard, no higher than the current hard limit.
+ * The hard CPU limit is a second later, so SIGXCPU comes before SIGKILL.
+ * Returns 0 or -1 with errno set */
+int limit_self(const struct limits *lim)
+{
+    static const int bit[] = {LIMIT_CPU, LIMIT_AS, LIMIT_NOFILE};
+    static const int resource[] = {RLIMIT_CPU, RLIMIT_AS, RLIMIT_NOFILE};
+    rlim_t val[3], max;
+    struct rlimit rl;
+    int i;
+
+    if (lim->cgfd >= 0 && writefileat(lim->cgfd, "cgroup.procs", "0") < 0)
+        return -1;
+
+    val[0] = lim->cpu;
+    val[1] = lim->as;
+    val[2] = lim->nofile;
+    for (i = 0; i < 3; i++)
+    {
+        if (!(lim->set & bit[i]) || getrlimit(resource[i], &rl) < 0)
+            continue;
+        max = resource[i] == RLIMIT_CPU && val[i] != RLIM_INFINITY
+                  ? val[i] + 1
+                  : val[i];
+        if (rl.rlim_max == RLIM_INFINITY || max < rl.rlim_max)
+            rl.rlim_max = max;
+        rl.rlim_cur = val[i] < rl.rlim_max ? val[i] : rl.rlim_max;
+        if (setrlimit(resource[i], &rl) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* oom_kills - Return how many processes of the cgroup cgfd the OOM
+ * killer has killed, from its memory.events. Async-signal-safe */
+static long oom_kills(int cgfd)
+{
+    char buf[512], *p;
+    ssize_t len;
+    long n = 0;
+    int fd;
+
+    if ((fd = openat(cgfd, "memory.events", O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+    for (p = buf; (p = strstr(p, "oom_kill ")) != NULL; p++)
+        if (p == buf || p[-1] == '\n')
+            break;
+    if (p == NULL)
+        return 0;
+    for (p += strlen("oom_kill "); *p >= '0' && *p <= '9'; p++)
+        n = 10 * n + (*p - '0');
+    return n;
+}
+
+/* report_limits - Give notice when one of its limits ended a job that is
+ * done. Called from the reaper, so it is async-signal-safe */
+void report_limits(struct job_t *job)
+{
+    int what = -1;
+    int sig = job->termsig;
+    long cpu = job->ru.ru_utime.tv_sec + job->ru.ru_stime.tv_sec;
+
+    if (job->cgfd >= 0 && oom_kills(job->cgfd) > 0)
+        what = NOTE_MEM;
+    else if ((job->limits & LIMIT_CPU) &&
+             (sig == SIGXCPU ||
+              (sig == SIGKILL && (rlim_t)cpu >= job->cpulimit)))
+        what = NOTE_CPU;
+    else if ((job->limits & LIMIT_AS) &&
+             (sig == SIGSEGV || sig == SIGABRT || sig == SIGBUS))
+        what = NOTE_AS;
+    if (what >= 0)
+        notify(what, job, 0);
+}
+
+/*********************************
+ * end resource limit helper routines
+ *********************************/
+
+/**********************************************
+ * Helper routines that record the trace
+ **********************************************/
+
+/* trace_event - Record an event in the trace ring. Safe in a handler:
+ * the slot is claimed atomically, and nothing is allocated */
+void trace_event(int phase, char ph, int arg)
+{
+    struct timespec ts;
+    struct trace_event *ev;
+    unsigned i = atomic_fetch_add_explicit(&trace_head, 1,
+                                           memory_order_relaxed);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ev = &trace_ring[i & (TRACE_RING - 1)];
+    ev->ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    ev->arg = arg;
+    ev->phase = phase;
+    ev->ph = ph;
+}
+
+/* trace_dump - Write the events in the ring to fd as Chrome trace JSON,
+ * oldest first. The handlers are kept out while it reads. Returns 0 or
+ * -1 */
+int trace_dump(int fd)
+{
+    static const char *names[] = {"eval", "parse", "launch", "fork", "exec",
+                                  "spawn", "waitfg", "reap", "child"};
+    sigset_t mask, prev_mask;
+    struct trace_event *ev;
+    unsigned i, head, first;
+    FILE *out;
+    int r;
+
+    if ((fd = dup(fd)) < 0 || (out = fdopen(fd, "w")) == NULL)
+        return -1;
+    sigfillset(&mask);
+    sigprocmask(SIG_BLOCK, &mask, &prev_mask);
+    head = atomic_load(&trace_head);
+    first = head > TRACE_RING ? head - TRACE_RING : 0;
+
+    fprintf(out, "{\"traceEvents\":[");
+    for (i = first; i != head; i++)
+    {
+        ev = &trace_ring[i & (TRACE_RING - 1)];
+        fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld.%03lld,"
+                     "\"pid\":%d,\"tid\":%d",
+                i == first ? "" : ",", names[(int)ev->phase], ev->ph,
+                ev->ns / 1000, ev->ns % 1000, (int)trace_pid, (int)trace_pid);
+        if (ev->ph == 'i')
+            fprintf(out, ",\"s\":\"t\"");
+        if (ev->arg)
+            fprintf(out, ",\"args\":{\"pid\":%d}", ev->arg);
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+    r = ferror(out) ? -1 : 0;
+    if (fclose(out) != 0)
+        r = -1;
+    return r;
+}
+
+/* trace_atexit - Dump the trace to the -t file when the shell exits (not
+ * when a child that inherited the handler does) */
+void trace_atexit(void)
+{
+    int fd;
+
+    if (getpid() != trace_pid)
+        return;
+    if ((fd = open(trace_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   0666)) < 0 ||
+        trace_dump(fd) < 0)
+        fprintf(stderr, "trace: %s: %s\n", trace_file, strerror(errno));
+    if (fd >= 0)
+        close(fd);
+}
+
+/*********************************
+ * end trace helper routines
+ *********************************/
+
+/**********************************************
+ * Helper routines that audit jobs
+ **********************************************/
+
+/*
+ * audit_open - Send audit records to sink: a file, appended to, or with
+ *    unix: in front, the Unix datagram socket at that path, a batch of
+ *    lines per datagram. Returns 0 or -1
+ */
+int audit_open(const char *sink)
+{
+    struct sockaddr_un sa;
+    int fd;
+
+    if (!strncmp(sink, "unix:", 5))
+    {
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (strlen(sink + 5) >= sizeof(sa.sun_path))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(sa.sun_path, sink + 5);
+        if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+        audit_log.dgram = 1;
+    }
+    else if ((fd = open(sink, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                        0600)) < 0)
+        return -1;
+    audit_log.fd = fd;
+    return 0;
+}
+
+/* audit_record - Record an event of kind for job. Async-signal-safe:
+ * the slot is claimed with a compare-and-swap, nothing is allocated,
+ * and a full ring only counts what it drops */
+void audit_record(int kind, struct job_t *job, int status)
+{
+    struct audit_rec *r;
+    struct timespec ts, now;
+    unsigned tail = atomic_load(&audit_log.tail);
+
+    do
+    {
+        if (tail - atomic_load(&audit_log.head) >= AUDIT_RING)
+        {
+            atomic_fetch_add(&audit_log.dropped, 1);
+            return;
+        }
+    } while (!atomic_compare_exchange_weak(&audit_log.tail, &tail, tail + 1));
+
+    r = &audit_log.ring[tail & (AUDIT_RING - 1)];
+    clock_gettime(CLOCK_REALTIME, &ts);
+    r->kind = kind;
+    r->pid = job->pid;
+    r->jid = job->jid;
+    r->status = status;
+    r->ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    r->real_us = 0;
+    r->cmd[0] = '\0';
+    if (kind == AUDIT_END)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        r->real_us = usecs(&job->start, &now);
+    }
+    else if (kind == AUDIT_START)
+    {
+        strncpy(r->cmd, job->cmdline, AUDIT_CMD - 1);
+        r->cmd[AUDIT_CMD - 1] = '\0';
+    }
+    atomic_store_explicit(&r->ready, 1, memory_order_release);
+}
+
+/* audit_line - Put record r into line as one line of JSON */
+static void audit_line(struct outbuf *line, struct audit_rec *r)
+{
+    static const char *kinds[] = {[AUDIT_START] = "start",
+                                  [AUDIT_STOP] = "stop",
+                                  [AUDIT_END] = "end"};
+    char frac[16];
+
+    ob_puts(line, "{\"event\":\"");
+    ob_puts(line, kinds[r->kind]);
+    ob_puts(line, "\",\"time\":");
+    ob_putl(line, r->ns / 1000000000);
+    snprintf(frac, sizeof(frac), ".%09lld", r->ns % 1000000000);
+    ob_puts(line, frac);
+    ob_puts(line, ",\"pid\":");
+    ob_putl(line, r->pid);
+    ob_puts(line, ",\"jid\":");
+    ob_putl(line, r->jid);
+    if (r->kind == AUDIT_START)
+    {
+        ob_puts(line, ",\"cmd\":");
+        ob_putjson(line, r->cmd);
+    }
+    else if (r->kind == AUDIT_STOP)
+    {
+        ob_puts(line, ",\"signal\":");
+        ob_putl(line, r->status);
+    }
+    else
+    {
+        ob_puts(line, WIFSIGNALED(r->status) ? ",\"signal\":" : ",\"status\":");
+        ob_putl(line, WIFSIGNALED(r->status) ? WTERMSIG(r->status)
+                                             : WEXITSTATUS(r->status));
+        ob_puts(line, ",\"real_us\":");
+        ob_putl(line, r->real_us);
+    }
+    ob_puts(line, "}\n");
+}
+
+/*
+ * audit_flush - Write the ready records out, oldest first, in batches
+ *    of whole lines: one write (or datagram) per batch. Only the main
+ *    routine calls it, so it is the one reader of the ring.
+ */
+void audit_flush(void)
+{
+    struct outbuf batch, line;
+    struct audit_rec *r;
+    static char bbuf[8192];
+    char lbuf[AUDIT_CMD * 6 + 256];
+    unsigned head = atomic_load(&audit_log.head);
+    unsigned long lost;
+
+    ob_init(&batch, audit_log.fd, bbuf, sizeof(bbuf));
+    while (head != atomic_load(&audit_log.tail))
+    {
+        r = &audit_log.ring[head & (AUDIT_RING - 1)];
+        if (!atomic_load_explicit(&r->ready, memory_order_acquire))
+            break;
+        ob_init(&line, -1, lbuf, sizeof(lbuf));
+        audit_line(&line, r);
+        ob_write(&batch, line.buf, line.len);
+        atomic_store(&r->ready, 0);
+        atomic_store(&audit_log.head, ++head);
+    }
+    if ((lost = atomic_exchange(&audit_log.dropped, 0)) != 0)
+    {
+        ob_init(&line, -1, lbuf, sizeof(lbuf));
+        ob_puts(&line, "{\"event\":\"lost\",\"count\":");
+        ob_putl(&line, lost);
+        ob_puts(&line, "}\n");
+        ob_write(&batch, line.buf, line.len);
+    }
+    ob_flush(&batch);
+}
+
+/* audit_forget - Drop the records a child inherited from the shell, which
+ * the shell writes out itself */
+void audit_forget(void)
+{
+    unsigned head = atomic_load(&audit_log.head);
+
+    for (; head != atomic_load(&audit_log.tail); head++)
+        atomic_store(&audit_log.ring[head & (AUDIT_RING - 1)].ready, 0);
+    atomic_store(&audit_log.head, head);
+}
+
+/*********************************
+ * end audit helper routines
+ *********************************/
+
+/**********************************************
+ * Helper routines that capture background output
+ **********************************************/
+
+/* spillfile - Open an unlinked temporary file for output that doesn't
+ * fit in memory. Returns its fd or -1 */
+static int spillfile(void)
+{
+    const char *dir = getenv("TMPDIR");
+    char name[MAXLINE_TSH];
+    int fd;
+
+    if (dir == NULL || *dir == '\0')
+        dir = "/tmp";
+    if ((fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) >= 0)
+        return fd;
+    snprintf(name, sizeof(name), "%s/tsh-XXXXXX", dir);
+    if ((fd = mkostemp(name, O_CLOEXEC)) >= 0)
+        unlink(name);
+    return fd;
+}
+
+/* capture_add - Start capturing the output of the job about to be
+ * started. Returns the write end of its pipe, or -1 if the job will
+ * write to stdout after all */
+int capture_add(void)
+{
+    struct capture *c;
+    int fds[2];
+
+    if (captures.n == captures.cap)
+    {
+        int cap = captures.cap ? 2 * captures.cap : INITJOBS;
+        c = realloc(captures.c, cap * sizeof(struct capture));
+        if (c == NULL)
+            return -1;
+        captures.c = c;
+        captures.cap = cap;
+    }
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return -1;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    c = &captures.c[captures.n++];
+    c->fd = fds[0];
+    c->buf = NULL;
+    c->len = c->cap = 0;
+    c->spill_fd = -1;
+    return fds[1];
+}
+
+/* capture_remove - Forget capture i, freeing what it holds */
+static void capture_remove(int i)
+{
+    struct capture *c = &captures.c[i];
+
+    if (c->fd >= 0)
+        close(c->fd);
+    if (c->spill_fd >= 0)
+        close(c->spill_fd);
+    free(c->buf);
+    captures.n--;
+    memmove(c, c + 1, (captures.n - i) * sizeof(struct capture));
+}
+
+/* capture_drop - Forget the newest capture, whose job never started */
+void capture_drop(void)
+{
+    capture_remove(captures.n - 1);
+}
+
+/* capture_read - Take in what capture c's pipe holds, without blocking.
+ * A full buffer goes to the spill file. Closes the pipe at EOF */
+static void capture_read(struct capture *c)
+{
+    ssize_t n;
+
+    while (c->fd >= 0)
+    {
+        if (c->len == c->cap)
+        {
+            if (c->cap < CAPTURE_MEM)
+            {
+                size_t cap = c->cap ? 2 * c->cap : 4096;
+                char *buf = realloc(c->buf, cap);
+                if (buf == NULL)
+                    unix_error("realloc error");
+                c->buf = buf;
+                c->cap = cap;
+            }
+            else if ((c->spill_fd >= 0 || (c->spill_fd = spillfile()) >= 0) &&
+                     writeall(c->spill_fd, c->buf, c->len) == 0)
+                c->len = 0;
+            else
+            {
+                /* With nowhere to spill, write out what we have */
+                fflush(stdout);
+                writeall(STDOUT_FILENO, c->buf, c->len);
+                c->len = 0;
+            }
+        }
+        n = read(c->fd, c->buf + c->len, c->cap - c->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return; /* EAGAIN: nothing more for now */
+        if (n == 0)
+        {
+            close(c->fd);
+            c->fd = -1;
+            return;
+        }
+        c->len += n;
+    }
+}
+
+/* capture_emit - Write the whole output of capture c to stdout */
+static void capture_emit(struct capture *c)
+{
+    fflush(stdout);
+    if (c->spill_fd >= 0 &&
+        (lseek(c->spill_fd, 0, SEEK_SET) < 0 ||
+         copyfd(c->spill_fd, STDOUT_FILENO) < 0))
+        fprintf(stderr, "error writing captured output: %s\n",
+                strerror(errno));
+    if (writeall(STDOUT_FILENO, c->buf, c->len) < 0)
+        fprintf(stderr, "error writing captured output: %s\n",
+                strerror(errno));
+}
+
+/* emit_captures - Write out and forget the captures whose jobs are
+ * done, in the order of capture_order */
+static void emit_captures(void)
+{
+    int i = 0;
+
+    while (i < captures.n)
+    {
+        if (captures.c[i].fd >= 0)
+        {
+            if (capture_order == CAPTURE_SUBMIT)
+                break;
+            i++;
+            continue;
+        }
+        capture_emit(&captures.c[i]);
+        capture_remove(i);
+    }
+}
+
+/* poll_captures - ppoll() on the n fds of pfd plus every open capture
+ * pipe, with the signal mask mask (NULL to keep the current one),
+ * blocking if block is set. The captures that were ready are drained
+ * and those that are done are written out. Returns what ppoll()
+ * returned; pfd[].revents are set as by ppoll() */
+int poll_captures(struct pollfd *pfd, int n, const sigset_t *mask, int block)
+{
+    struct timespec zero = {0, 0};
+    int i, k, r;
+
+    if (captures.pfdcap < n + captures.n)
+    {
+        int cap = 2 * (n + captures.n);
+        struct pollfd *all = realloc(captures.pfd, cap * sizeof(*all));
+        if (all == NULL)
+            unix_error("realloc error");
+        captures.pfd = all;
+        captures.pfdcap = cap;
+    }
+    for (i = 0; i < n; i++)
+        captures.pfd[i] = pfd[i];
+    for (k = 0; k < captures.n; k++)
+    {
+        captures.pfd[n + k].fd = captures.c[k].fd;
+        captures.pfd[n + k].events = POLLIN;
+        captures.pfd[n + k].revents = 0;
+    }
+
+    r = ppoll(captures.pfd, n + captures.n, block ? NULL : &zero, mask);
+    for (i = 0; i < n; i++)
+        pfd[i].revents = r > 0 ? captures.pfd[i].revents : 0;
+    if (r > 0)
+    {
+        for (k = 0; k < captures.n; k++)
+            if (captures.pfd[n + k].revents)
+                capture_read(&captures.c[k]);
+        emit_captures();
+    }
+    return r;
+}
+
+/* capture_flush - Write out everything captured so far, done or not,
+ * in the order the jobs were started. Used when the shell exits */
+void capture_flush(void)
+{
+    while (captures.n > 0)
+    {
+        capture_read(&captures.c[0]);
+        capture_emit(&captures.c[0]);
+        capture_remove(0);
+    }
+}
+
+/**************************************
+ * end background output capture routines
+ **************************************/
+
+/**************************************
+ * Helper routines that queue job notifications
+ **************************************/
+
+/* notify - Queue a notice of kind about job (sig is the signal that
+ * stopped or ended it). Called from the reaper, so it only touches the
+ * ring, which the main routine reads with SIGCHLD blocked */
+void notify(int kind, struct job_t *job, int sig)
+{
+    struct notice *n;
+
+    if (notices.mode == NOTIFY_OFF)
+        return;
+    if (notices.tail != notices.head)
+    {
+        n = &notices.ring[(notices.tail - 1) & (NOTICE_RING - 1)];
+        if (n->kind == kind && n->sig == sig)
+        {
+            n->n++;
+            return;
+        }
+    }
+    if (notices.tail - notices.head == NOTICE_RING)
+    {
+        notices.dropped++;
+        return;
+    }
+    n = &notices.ring[notices.tail & (NOTICE_RING - 1)];
+    n->kind = kind;
+    n->sig = sig;
+    n->jid = job->jid;
+    n->pid = job->pid;
+    n->n = 1;
+    notices.tail++;
+}
+
+/* notify_flush - Write out the queued notices, in one write if they fit,
+ * after whatever the caller has flushed from stdout. Async-signal-safe,
+ * so the reaper may call it */
+void notify_flush(void)
+{
+    static const char *one[] = {
+        [NOTE_TERM] = ") terminated by signal ",
+        [NOTE_STOP] = ") stopped by signal ",
+        [NOTE_MEM] = ") was killed by its memory limit (memory.max)",
+        [NOTE_CPU] = ") was killed by its CPU time limit",
+        [NOTE_AS] = ") may have run out of its address space limit"};
+    static const char *many[] = {
+        [NOTE_TERM] = " jobs terminated by signal ",
+        [NOTE_STOP] = " jobs stopped by signal ",
+        [NOTE_MEM] = " jobs were killed by their memory limit (memory.max)",
+        [NOTE_CPU] = " jobs were killed by their CPU time limit",
+        [NOTE_AS] = " jobs may have run out of their address space limit"};
+    struct outbuf ob;
+    struct notice *n;
+    char buf[MAXLINE_TSH];
+    sigset_t mask, prev;
+
+    if (notices.head == notices.tail && !notices.dropped)
+        return;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    ob_init(&ob, STDOUT_FILENO, buf, sizeof(buf));
+    for (; notices.head != notices.tail; notices.head++)
+    {
+        n = &notices.ring[notices.head & (NOTICE_RING - 1)];
+        if (n->n == 1)
+        {
+            ob_puts(&ob, "Job [");
+            ob_putl(&ob, n->jid);
+            ob_puts(&ob, "] (");
+            ob_putl(&ob, n->pid);
+            ob_puts(&ob, one[n->kind]);
+        }
+        else
+        {
+            ob_putl(&ob, n->n);
+            ob_puts(&ob, many[n->kind]);
+        }
+        if (n->kind == NOTE_TERM || n->kind == NOTE_STOP)
+            ob_putl(&ob, n->sig);
+        ob_puts(&ob, "\n");
+    }
+    if (notices.dropped)
+    {
+        ob_putl(&ob, notices.dropped);
+        ob_puts(&ob, " more job notifications were lost\n");
+        notices.dropped = 0;
+    }
+    ob_flush(&ob);
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/**************************************
+ * end job notification routines
+ **************************************/
+
+/**************************************
+ * Helper routines that batch output
+ **************************************/
+
+/* ob_init - Collect output for fd in the cap bytes at buf */
+void ob_init(struct outbuf *ob, int fd, char *buf, size_t cap)
+{
+    ob->buf = buf;
+    ob->cap = cap;
+    ob->len = 0;
+    ob->fd = fd;
+    ob->err = 0;
+}
+
+/* ob_write - Add the n bytes at p, writing out what there is first if
+ * they don't fit. Async-signal-safe */
+void ob_write(struct outbuf *ob, const char *p, size_t n)
+{
+    if (ob->len + n > ob->cap)
+    {
+        ob_flush(ob);
+        if (n > ob->cap)
+        {
+            if (writeall(ob->fd, p, n) < 0)
+                ob->err = 1;
+            return;
+        }
+    }
+    memcpy(ob->buf + ob->len, p, n);
+    ob->len += n;
+}
+
+/* ob_puts - Add the string s */
+void ob_puts(struct outbuf *ob, const char *s)
+{
+    ob_write(ob, s, strlen(s));
+}
+
+/* ob_putl - Add v in decimal, without stdio, so a handler may use it */
+void ob_putl(struct outbuf *ob, long v)
+{
+    char digits[24];
+    int i = sizeof(digits);
+    unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+
+    do
+        digits[--i] = '0' + u % 10;
+    while ((u /= 10) != 0);
+    if (v < 0)
+        digits[--i] = '-';
+    ob_write(ob, digits + i, sizeof(digits) - i);
+}
+
+/* ob_putjson - Add s as a quoted JSON string */
+void ob_putjson(struct outbuf *ob, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    char esc[6] = {'\\', 'u', '0', '0'};
+    const char *run;
+
+    ob_write(ob, "\"", 1);
+    for (run = s; *s != '\0'; s++)
+    {
+        unsigned char c = *s;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        ob_write(ob, run, s - run);
+        if (c == '"' || c == '\\')
+        {
+            esc[1] = c;
+            ob_write(ob, esc, 2);
+        }
+        else
+        {
+            esc[1] = 'u';
+            esc[4] = hex[c >> 4];
+            esc[5] = hex[c & 0xf];
+            ob_write(ob, esc, 6);
+        }
+        run = s + 1;
+    }
+    ob_write(ob, run, s - run);
+    ob_write(ob, "\"", 1);
+}
+
+/* ob_flush - Write out what has been collected. Returns 0, or -1 if this
+ * or an earlier write failed */
+int ob_flush(struct outbuf *ob)
+{
+    if (ob->len > 0 && writeall(ob->fd, ob->buf, ob->len) < 0)
+        ob->err = 1;
+    ob->len = 0;
+    return ob->err ? -1 : 0;
+}
+
+/**************************************
+ * end output batching routines
+ **************************************/
+
+/**************************************
+ * Helper routines that cache parsed scripts
+ **************************************/
+
+/* fnv1a - The 64-bit FNV-1a hash of the n bytes at p */
+uint64_t fnv1a(const char *p, size_t n)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (n-- > 0)
+    {
+        h ^= (unsigned char)*p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* cache_str - Is off a string that lies inside the record of n bytes? */
+static int cache_str(const char *rec, uint32_t n, uint32_t off)
+{
+    return off >= 16 && off < n && memchr(rec + off, '\0', n - off) != NULL;
+}
+
+/*
+ * cache_valid - Check that the nrec records after the header of the
+ *    len byte cache map are well formed, so replay can trust them
+ */
+static int cache_valid(const char *map, size_t len, uint32_t nrec)
+{
+    size_t off = sizeof(struct cache_header);
+    const uint32_t *w;
+    uint32_t i, n, k, j, argc, nredirs;
+    int s;
+
+    for (i = 0; i < nrec; i++)
+    {
+        if (len - off < 16)
+            return 0;
+        w = (const uint32_t *)(map + off);
+        n = w[0];
+        if (n % 4 != 0 || n < 16 || n > len - off ||
+            !cache_str(map + off, n, w[2]) || (int32_t)w[3] < 0)
+            return 0;
+        for (s = 0, k = 4; s < (int32_t)w[3]; s++)
+        {
+            if (n / 4 - k < 3)
+                return 0;
+            argc = w[k];
+            nredirs = w[k + 2];
+            k += 3;
+            if (n / 4 - k < nredirs || (n / 4 - k) / 3 < nredirs)
+                return 0;
+            for (j = 0; j < nredirs; j++, k += 3)
+                if (w[k] > REDIR_HERE ||
+                    (w[k] != REDIR_DUP && w[k] != REDIR_CLOSE &&
+                     !cache_str(map + off, n, w[k + 2])))
+                    return 0;
+            if (n / 4 - k < argc)
+                return 0;
+            for (j = 0; j < argc; j++)
+                if (!cache_str(map + off, n, w[k + j]))
+                    return 0;
+            k += argc;
+        }
+        off += n;
+    }
+    return off == len;
+}
+
+/*
+ * cache_open - Set up the parse cache of the script open on fd. If
+ *    script.tshc holds the tokens of exactly this script, it is mapped
+ *    for replay; otherwise the run records a new one.
+ */
+void cache_open(struct scriptcache *sc, const char *script, int fd)
+{
+    struct stat st, cst;
+    struct cache_header *h;
+    char *text, *map;
+    int cfd;
+
+    sc->mode = CACHE_OFF;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return;
+    text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text == MAP_FAILED)
+        return;
+    sc->hash = fnv1a(text, st.st_size);
+    sc->size = st.st_size;
+    munmap(text, st.st_size);
+
+    if ((sc->path = malloc(strlen(script) + 6)) == NULL)
+        unix_error("malloc error");
+    sprintf(sc->path, "%s.tshc", script);
+    sc->pid = getpid();
+
+    if ((cfd = open(sc->path, O_RDONLY | O_CLOEXEC)) >= 0)
+    {
+        if (fstat(cfd, &cst) == 0 && cst.st_size >= (off_t)sizeof(*h))
+        {
+            /* Private and writable, as the tokens are handed out as char * */
+            map = mmap(NULL, cst.st_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE, cfd, 0);
+            if (map != MAP_FAILED)
+            {
+                h = (struct cache_header *)map;
+                if (!memcmp(h->magic, CACHE_MAGIC, 4) &&
+                    h->version == CACHE_VERSION && h->hash == sc->hash &&
+                    h->size == sc->size &&
+                    cache_valid(map, cst.st_size, h->nrec))
+                {
+                    close(cfd);
+                    sc->map = map;
+                    sc->maplen = cst.st_size;
+                    sc->nrec = h->nrec;
+                    sc->next = sizeof(*h);
+                    sc->mode = CACHE_REPLAY;
+                    return;
+                }
+                munmap(map, cst.st_size);
+            }
+        }
+        close(cfd);
+    }
+
+    sc->cap = SCRIPTBLOCK;
+    if ((sc->buf = malloc(sc->cap)) == NULL)
+        unix_error("malloc error");
+    sc->len = sizeof(*h);
+    sc->nrec = 0;
+    sc->mode = CACHE_RECORD;
+}
+
+/*
+ * cache_next - Step to the next record of the replayed cache. Returns
+ *    its command line, or NULL after the last one.
+ */
+char *cache_next(struct scriptcache *sc)
+{
+    if (sc->next >= sc->maplen)
+        return NULL;
+    sc->cur = (uint32_t *)(sc->map + sc->next);
+    sc->next += sc->cur[0];
+    return (char *)sc->cur + sc->cur[2];
+}
+
+/*
+ * cache_tokens - Rebuild the tokens of the record cache_next() stepped
+ *    to in tok, pointing into the map, with the arrays carved from a.
+ *    Returns what parseline() returned for the line.
+ */
+int cache_tokens(struct scriptcache *sc, char *cmdline,
+                 struct cmdline_tokens *tok, struct arena *a)
+{
+    uint32_t *w = sc->cur;
+    char *rec = (char *)w;
+    struct cmdline_stage *st;
+    struct redirection *r;
+    uint32_t i, j, k;
+
+    /* A line that did not parse is parsed again for its error */
+    if ((int32_t)w[1] == -1)
+        return parseline(cmdline, tok, a);
+
+    tok->nstages = w[3];
+    tok->stage = arena_alloc(a, tok->nstages * sizeof(*tok->stage));
+    for (i = 0, k = 4; i < w[3]; i++)
+    {
+        st = &tok->stage[i];
+        st->argc = w[k];
+        st->builtins = w[k + 1];
+        st->nredirs = w[k + 2];
+        st->redirs = NULL;
+        k += 3;
+        if (st->nredirs > 0)
+            st->redirs = arena_alloc(a, st->nredirs * sizeof(*st->redirs));
+        for (j = 0; j < (uint32_t)st->nredirs; j++, k += 3)
+        {
+            r = &st->redirs[j];
+            r->op = w[k];
+            r->fd = w[k + 1];
+            r->src = r->op == REDIR_DUP ? (int)w[k + 2] : -1;
+            r->word = r->op == REDIR_DUP || r->op == REDIR_CLOSE
+                          ? NULL
+                          : rec + w[k + 2];
+        }
+        st->argv = arena_alloc(a, (st->argc + 1) * sizeof(char *));
+        for (j = 0; j < (uint32_t)st->argc; j++)
+            st->argv[j] = rec + w[k + j];
+        st->argv[st->argc] = NULL;
+        k += st->argc;
+    }
+    return (int32_t)w[1];
+}
+
+/* cache_put - Append string s to the record at start. Returns its offset */
+static uint32_t cache_put(struct scriptcache *sc, size_t start, const char *s)
+{
+    size_t n = strlen(s) + 1;
+    uint32_t off = sc->len - start;
+
+    memcpy(sc->buf + sc->len, s, n);
+    sc->len += n;
+    return off;
+}
+
+/*
+ * cache_record - Add the tokens parseline() made of cmdline, and what it
+ *    returned (bg), to the cache being recorded
+ */
+void cache_record(struct scriptcache *sc, const char *cmdline,
+                  struct cmdline_tokens *tok, int bg)
+{
+    size_t start = sc->len, words = 4, need;
+    struct cmdline_stage *st;
+    struct redirection *r;
+    uint32_t *w;
+    int i, j, k;
+
+    if (sc->mode != CACHE_RECORD)
+        return;
+
+    /* Work out the size of the record, and make room for it */
+    need = strlen(cmdline) + 1 + 3;
+    for (i = 0; bg != -1 && i < tok->nstages; i++)
+    {
+        st = &tok->stage[i];
+        words += 3 + 3 * st->nredirs + st->argc;
+        for (j = 0; j < st->argc; j++)
+            need += strlen(st->argv[j]) + 1;
+        for (j = 0; j < st->nredirs; j++)
+            if (st->redirs[j].word != NULL)
+                need += strlen(st->redirs[j].word) + 1;
+    }
+    need += 4 * words;
+    while (sc->cap - sc->len < need)
+    {
+        char *grown = realloc(sc->buf, 2 * sc->cap);
+        if (grown == NULL)
+            unix_error("realloc error");
+        sc->buf = grown;
+        sc->cap *= 2;
+    }
+
+    w = (uint32_t *)(sc->buf + start);
+    sc->len += 4 * words;
+    w[1] = bg;
+    w[2] = cache_put(sc, start, cmdline);
+    w[3] = bg != -1 ? tok->nstages : 0;
+    for (i = 0, k = 4; bg != -1 && i < tok->nstages; i++)
+    {
+        st = &tok->stage[i];
+        w[k] = st->argc;
+        w[k + 1] = st->builtins;
+        w[k + 2] = st->nredirs;
+        k += 3;
+        for (j = 0; j < st->nredirs; j++, k += 3)
+        {
+            r = &st->redirs[j];
+            w[k] = r->op;
+            w[k + 1] = r->fd;
+            w[k + 2] = r->op == REDIR_DUP ? (uint32_t)r->src
+                       : r->word != NULL ? cache_put(sc, start, r->word)
+                                         : 0;
+        }
+        for (j = 0; j < st->argc; j++)
+            w[k + j] = cache_put(sc, start, st->argv[j]);
+        k += st->argc;
+    }
+    sc->len = (sc->len + 3) & ~(size_t)3;
+    w[0] = sc->len - start;
+    sc->nrec++;
+}
+
+/*
+ * cache_finish - Write out the cache recorded by this run of the script.
+ *    It goes to a temporary file renamed into place, so a concurrent run
+ *    sees either the old cache or the whole new one.
+ */
+void cache_finish(struct scriptcache *sc)
+{
+    struct cache_header *h;
+    char *tmp;
+    int fd;
+
+    if (sc->mode != CACHE_RECORD || getpid() != sc->pid)
+        return;
+    sc->mode = CACHE_OFF;
+
+    h = (struct cache_header *)sc->buf;
+    memcpy(h->magic, CACHE_MAGIC, 4);
+    h->version = CACHE_VERSION;
+    h->hash = sc->hash;
+    h->size = sc->size;
+    h->nrec = sc->nrec;
+    h->pad = 0;
+
+    if ((tmp = malloc(strlen(sc->path) + 8)) == NULL)
+        unix_error("malloc error");
+    sprintf(tmp, "%s.XXXXXX", sc->path);
+    if ((fd = mkostemp(tmp, O_CLOEXEC)) >= 0)
+    {
+        if (writeall(fd, sc->buf, sc->len) == 0 && close(fd) == 0)
+            rename(tmp, sc->path);
+        else
+            unlink(tmp);
+    }
+    free(tmp);
+}
+
+/**************************************
+ * end script parse cache routines
+ **************************************/
+
+/**************************************
+ * Helper routines that memoize commands
+ **************************************/
+
+/*
+ * memo_open - Set up the cache directory, $TSH_MEMO or else tsh-memo in
+ *    $XDG_CACHE_HOME or ~/.cache, and learn how big the cache is.
+ *    Returns 0, or -1 if there is no cache to use.
+ */
+int memo_open(void)
+{
+    const char *env, *base;
+    char *dir;
+    DIR *d;
+    struct dirent *de;
+    struct stat sb;
+
+    if (memo_stats.dir != NULL)
+        return 0;
+    if ((env = getenv("TSH_MEMO_SIZE")) != NULL && atoll(env) > 0)
+        memo_stats.limit = atoll(env);
+    else
+        memo_stats.limit = MEMO_SIZE;
+
+    if ((env = getenv("TSH_MEMO")) != NULL && *env != '\0')
+    {
+        if ((dir = strdup(env)) == NULL)
+            unix_error("strdup error");
+    }
+    else
+    {
+        base = getenv("XDG_CACHE_HOME");
+        if (base == NULL || *base == '\0')
+        {
+            if ((env = getenv("HOME")) == NULL)
+                return -1;
+            base = ".cache";
+        }
+        else
+            env = NULL;
+        if ((dir = malloc((env ? strlen(env) : 0) + strlen(base) + 11)) == NULL)
+            unix_error("malloc error");
+        if (env != NULL)
+        {
+            /* ~/.cache itself may not be there yet */
+            sprintf(dir, "%s/%s", env, base);
+            mkdir(dir, 0700);
+            strcat(dir, "/tsh-memo");
+        }
+        else
+            sprintf(dir, "%s/tsh-memo", base);
+    }
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+    {
+        free(dir);
+        return -1;
+    }
+
+    /* Sum up what is there already */
+    memo_stats.bytes = 0;
+    if ((d = opendir(dir)) != NULL)
+    {
+        while ((de = readdir(d)) != NULL)
+            if (de->d_name[0] != '.' &&
+                fstatat(dirfd(d), de->d_name, &sb, 0) == 0 &&
+                S_ISREG(sb.st_mode))
+                memo_stats.bytes += sb.st_size;
+        closedir(d);
+    }
+    memo_stats.dir = dir;
+    return 0;
+}
+
+/* memo_add - Append n bytes at p, and a NUL, to the key material of m */
+static void memo_add(struct memo_t *m, const char *p, size_t n, size_t *cap)
+{
+    while (m->keylen + n + 1 > *cap)
+    {
+        m->key = arena_grow(&cmd_arena, m->key, *cap, 2 * *cap);
+        *cap *= 2;
+    }
+    memcpy(m->key + m->keylen, p, n);
+    m->key[m->keylen + n] = '\0';
+    m->keylen += n + 1;
+}
+
+/* memo_file - Append what identifies file name to the key material */
+static int memo_file(struct memo_t *m, const char *name, size_t *cap)
+{
+    struct stat sb;
+    char buf[128];
+
+    if (stat(name, &sb) < 0)
+        return -1;
+    memo_add(m, name, strlen(name), cap);
+    memo_add(m, buf, snprintf(buf, sizeof(buf), "%llu:%llu:%lld:%lld.%09ld",
+                              (unsigned long long)sb.st_dev,
+                              (unsigned long long)sb.st_ino,
+                              (long long)sb.st_size,
+                              (long long)sb.st_mtim.tv_sec,
+                              sb.st_mtim.tv_nsec),
+             cap);
+    return 0;
+}
+
+/*
+ * memo_key - Build the key material of the command st into m: the
+ *    working directory, the program file, its own variables, the
+ *    arguments, the redirections and the declared inputs. Returns -1
+ *    if something it depends on can't be found.
+ */
+static int memo_key(struct memo_t *m, struct cmdline_stage *st)
+{
+    struct redirection *r;
+    char cwd[PATH_MAX], buf[32];
+    const char *path;
+    size_t cap = 1024;
+    int i, cached;
+
+    m->key = arena_alloc(&cmd_arena, cap);
+    m->keylen = 0;
+    if (getcwd(cwd, sizeof(cwd)) == NULL ||
+        (path = hash_lookup(st->argv[0], &cached)) == NULL)
+        return -1;
+    memo_add(m, cwd, strlen(cwd), &cap);
+    if (memo_file(m, path, &cap) < 0)
+        return -1;
+    for (i = 0; i < st->nassigns; i++)
+        memo_add(m, st->assigns[i], strlen(st->assigns[i]), &cap);
+    for (i = 0; i < st->argc; i++)
+        memo_add(m, st->argv[i], strlen(st->argv[i]), &cap);
+    for (i = 0; i < st->nredirs; i++)
+    {
+        r = &st->redirs[i];
+        memo_add(m, buf, snprintf(buf, sizeof(buf), "%d %d %d", r->op, r->fd,
+                                  r->src), &cap);
+        if ((r->op == REDIR_IN || r->op == REDIR_RDWR) &&
+            memo_file(m, r->word, &cap) < 0)
+            return -1;
+        if (r->op != REDIR_IN && r->op != REDIR_RDWR && r->word != NULL)
+            memo_add(m, r->word, strlen(r->word), &cap);
+    }
+    for (i = 0; i < m->ninputs; i++)
+        if (memo_file(m, m->inputs[i], &cap) < 0)
+            return -1;
+    return 0;
+}
+
+/*
+ * memo_begin - Look the command of tok up in the cache. On a hit its
+ *    output is written to stdout, and m->hit and m->status say so; on a
+ *    miss m->fd is a new entry for the command's stdout. A command memo
+ *    can't cache (a pipeline, a builtin, a background job, one whose
+ *    stdout is redirected) just runs.
+ */
+void memo_begin(struct memo_t *m, struct cmdline_tokens *tok, int bg)
+{
+    struct cmdline_stage *st = &tok->stage[0];
+    struct memo_header h;
+    int fd;
+
+    m->hit = 0;
+    m->fd = -1;
+    if (tok->nstages > 1 || bg || st->builtins != BUILTIN_NONE ||
+        redirects(st, STDOUT_FILENO) || memo_open() < 0 ||
+        memo_key(m, st) < 0)
+    {
+        memo_stats.uncached++;
+        return;
+    }
+    m->path = arena_alloc(&cmd_arena, strlen(memo_stats.dir) + 32);
+    sprintf(m->path, "%s/%016llx", memo_stats.dir,
+            (unsigned long long)fnv1a(m->key, m->keylen));
+
+    if ((fd = open(m->path, O_RDONLY | O_CLOEXEC)) >= 0)
+    {
+        char *key = arena_alloc(&cmd_arena, m->keylen);
+        if (pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+            !memcmp(h.magic, MEMO_MAGIC, 4) && h.keylen == m->keylen &&
+            pread(fd, key, m->keylen, sizeof(h)) == (ssize_t)m->keylen &&
+            !memcmp(key, m->key, m->keylen))
+        {
+            /* A hit: the output, and a new mtime for the LRU order */
+            fflush(stdout);
+            lseek(fd, sizeof(h) + m->keylen, SEEK_SET);
+            if (copyfd(fd, STDOUT_FILENO) < 0)
+                fprintf(stderr, "memo: %s\n", strerror(errno));
+            futimens(fd, NULL);
+            close(fd);
+            memo_stats.hits++;
+            m->hit = 1;
+            m->status = h.status;
+            return;
+        }
+        close(fd);
+    }
+
+    /* A miss: the command writes its stdout after the header and key */
+    m->tmp = arena_alloc(&cmd_arena, strlen(memo_stats.dir) + 16);
+    sprintf(m->tmp, "%s/.tmpXXXXXX", memo_stats.dir);
+    if ((m->fd = mkostemp(m->tmp, O_CLOEXEC)) < 0)
+    {
+        memo_stats.uncached++;
+        return;
+    }
+    memset(&h, 0, sizeof(h));
+    if (writeall(m->fd, (char *)&h, sizeof(h)) < 0 ||
+        writeall(m->fd, m->key, m->keylen) < 0)
+    {
+        close(m->fd);
+        unlink(m->tmp);
+        m->fd = -1;
+        memo_stats.uncached++;
+        return;
+    }
+    memo_stats.misses++;
+}
+
+/* memo_cmp - Order cache entries oldest first */
+struct memo_entry
+{
+    char name[32];
+    struct timespec used;
+    off_t size;
+};
+static int memo_cmp(const void *a, const void *b)
+{
+    const struct memo_entry *x = a, *y = b;
+
+    if (x->used.tv_sec != y->used.tv_sec)
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    return (x->used.tv_nsec > y->used.tv_nsec) -
+           (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+/*
+ * memo_evict - Drop the least recently used entries (by mtime, which a
+ *    hit renews) until the cache is back within its bound
  */
-void sigchld_handler(int sig)
+static void memo_evict(void)
 {
-    pid_t pid; // process ID for child
-    int stat;  // status for waitpid
+    struct memo_entry *e = NULL;
+    struct dirent *de;
+    struct stat sb;
+    int n = 0, cap = 0, i;
+    DIR *d;
 
-    // loop to reap all terminated child processes
-    while ((pid = waitpid(-1, &stat, WNOHANG | WUNTRACED)) > 0)
+    if (memo_stats.bytes <= memo_stats.limit ||
+        (d = opendir(memo_stats.dir)) == NULL)
+        return;
+    memo_stats.bytes = 0;
+    while ((de = readdir(d)) != NULL)
     {
-        // check if child process was stopped
-        if (WIFSTOPPED(stat))
+        if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(e->name) ||
+            fstatat(dirfd(d), de->d_name, &sb, 0) < 0 || !S_ISREG(sb.st_mode))
+            continue;
+        if (n == cap)
         {
-            struct job_t *cur_job = getjobpid(job_list, pid); // get the job from job list
-            cur_job->state = ST;                              // set the job state to stopped
-            sio_puts("Job [");
-            sio_putl(pid2jid(pid));
-            sio_puts("] (");
-            sio_putl(pid);
-            sio_puts(") stopped by signal ");
-            sio_putl(WSTOPSIG(stat));
-            sio_puts("\n");
-        }
-        // check if child process was terminated by a signal
-        if (WIFSIGNALED(stat))
-        {
-            sio_puts("Job [");
-            sio_putl(pid2jid(pid));
-            sio_puts("] (");
-            sio_putl(pid);
-            sio_puts(") terminated by signal ");
-            sio_putl(WTERMSIG(stat));
-            sio_puts("\n");
-            deletejob(job_list, pid); // remove the job from job list
-        }
-        // check if child process exited normally
-        if (WIFEXITED(stat))
-            deletejob(job_list, pid); // remove the job from job list
+            cap = cap ? 2 * cap : 64;
+            if ((e = realloc(e, cap * sizeof(*e))) == NULL)
+                unix_error("realloc error");
+        }
+        strcpy(e[n].name, de->d_name);
+        e[n].used = sb.st_mtim;
+        e[n].size = sb.st_size;
+        memo_stats.bytes += sb.st_size;
+        n++;
     }
-    return;
+    qsort(e, n, sizeof(*e), memo_cmp);
+    for (i = 0; i < n && memo_stats.bytes > memo_stats.limit; i++)
+    {
+        if (unlinkat(dirfd(d), e[i].name, 0) == 0)
+        {
+            memo_stats.bytes -= e[i].size;
+            memo_stats.evictions++;
+        }
+    }
+    closedir(d);
+    free(e);
 }
 
 /*
- * sigint_handler - The kernel sends a SIGINT to the shell whenver the
- *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.
+ * memo_end - Finish the entry of a command memo_begin() missed, now that
+ *    it has ended with status (-1 if it never started): its output goes
+ *    to stdout and, unless it was killed, the entry goes into the cache.
  */
-void sigint_handler(int sig)
+void memo_end(struct memo_t *m, int status)
 {
-    // Get the process ID of the current foreground job
-    pid_t fg_pid = fgpid(job_list);
-    // If there's a foreground job (fg_pid is not 0)
-    // Try to send a SIGINT signal to the foreground job
-    if (fg_pid && kill(-fg_pid, SIGINT) < 0)
+    struct memo_header h;
+    off_t end = lseek(m->fd, 0, SEEK_END);
+
+    fflush(stdout);
+    lseek(m->fd, sizeof(h) + m->keylen, SEEK_SET);
+    if (copyfd(m->fd, STDOUT_FILENO) < 0)
+        fprintf(stderr, "memo: %s\n", strerror(errno));
+
+    memcpy(h.magic, MEMO_MAGIC, 4);
+    h.status = status;
+    h.keylen = m->keylen;
+    h.outlen = end - sizeof(h) - m->keylen;
+    if (status == -1 || WIFSIGNALED(status) ||
+        pwrite(m->fd, &h, sizeof(h), 0) != sizeof(h) ||
+        rename(m->tmp, m->path) < 0)
     {
-        // If there's an error sending the signal
-        unix_error("error with signal");
+        unlink(m->tmp);
+        memo_stats.misses--;
+        memo_stats.uncached++;
+    }
+    else
+    {
+        memo_stats.bytes += end;
+        memo_evict();
     }
+    close(m->fd);
+    m->fd = -1;
 }
 
 /*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.
+ * memo_defer - Keep the entry m of a command that stopped, whose job is
+ *    job, until the job ends. Called with SIGCHLD blocked.
  */
-void sigtstp_handler(int sig)
+void memo_defer(struct memo_t *m, struct job_t *job)
 {
-    // Get the process ID of the current foreground job
-    pid_t fg_pid = fgpid(job_list);
-    // If there's a foreground job and an error occurs while sending the SIGTSTP signal
-    if (fg_pid && kill(-fg_pid, SIGTSTP) < 0)
+    struct memo_t *d;
+    int i, k;
+
+    for (i = 0; i < memo_jobs.n && memo_jobs.m[i].fd >= 0; i++)
+        ;
+    if (i == memo_jobs.n)
     {
-        unix_error("error with signal");
+        d = realloc(memo_jobs.m, (memo_jobs.n + 4) * sizeof(*d));
+        if (d == NULL)
+            unix_error("realloc error");
+        memo_jobs.m = d;
+        memo_jobs.n += 4;
+        for (k = i; k < memo_jobs.n; k++)
+            memo_jobs.m[k].fd = -1;
     }
+    d = &memo_jobs.m[i];
+    *d = *m;
+    d->inputs = NULL;
+    d->key = NULL;
+    if ((d->path = strdup(m->path)) == NULL ||
+        (d->tmp = strdup(m->tmp)) == NULL)
+        unix_error("strdup error");
+    d->done = 0;
+    job->memo = i;
+    m->fd = -1;
 }
-/*
- * sigquit_handler - The driver program can gracefully terminate the
- *    child shell by sending it a SIGQUIT signal.
- */
-void sigquit_handler(int sig)
+
+/* memo_flush - Finish the entries of stopped commands that have since
+ * ended */
+void memo_flush(void)
 {
-    unix_error("Terminating after receipt of SIGQUIT signal\n");
+    struct memo_t *m;
+    int i;
+
+    for (i = 0; i < memo_jobs.n; i++)
+    {
+        m = &memo_jobs.m[i];
+        if (m->fd < 0 || !m->done)
+            continue;
+        memo_end(m, m->status);
+        free(m->path);
+        free(m->tmp);
+    }
 }
 
-/*********************
- * End signal handlers
- *********************/
+/**************************************
+ * end memo helper routines
+ **************************************/
 
-/***********************************************
- * Helper routines that manipulate the job list
- **********************************************/
+/**************************************
+ * Helper routines that edit command lines
+ **************************************/
 
-/* clearjob - Clear the entries in a job struct */
-void clearjob(struct job_t *job)
+/* hist_map - Map what the history and its index hold now */
+static void hist_map(void)
 {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
+    struct history *h = &cmd_history;
+    struct stat sb, ib;
+
+    if (h->text != NULL)
+        munmap(h->text, h->size);
+    if (h->off != NULL)
+        munmap(h->off, h->n * sizeof(uint64_t));
+    h->text = NULL;
+    h->off = NULL;
+    h->size = h->n = 0;
+    if (fstat(h->fd, &sb) < 0 || fstat(h->ifd, &ib) < 0)
+        return;
+    if (sb.st_size > 0 &&
+        (h->text = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, h->fd, 0)) ==
+            MAP_FAILED)
+        h->text = NULL;
+    else
+        h->size = sb.st_size;
+    if (ib.st_size >= (off_t)sizeof(uint64_t) &&
+        (h->off = mmap(NULL, ib.st_size, PROT_READ, MAP_SHARED, h->ifd, 0)) ==
+            MAP_FAILED)
+        h->off = NULL;
+    else
+        h->n = ib.st_size / sizeof(uint64_t);
 }
 
-/* initjobs - Initialize the job list */
-void initjobs(struct job_t *job_list)
+/* hist_index - Index the lines of the history past what the index has,
+ * rebuilding it if it doesn't match the history. Called under the lock */
+static void hist_index(void)
 {
-    int i;
+    struct history *h = &cmd_history;
+    uint64_t at = 0, buf[512];
+    const char *p, *nl;
+    int k = 0;
 
-    for (i = 0; i < MAXJOBS; i++)
-        clearjob(&job_list[i]);
+    hist_map();
+    if (h->n > 0 && (h->off[h->n - 1] >= h->size ||
+                     (h->n > 1 && h->off[h->n - 1] <= h->off[h->n - 2])))
+    {
+        /* The index is not of this history: start over */
+        if (ftruncate(h->ifd, 0) < 0)
+            return;
+        hist_map();
+    }
+    if (h->n > 0)
+    {
+        p = h->text + h->off[h->n - 1];
+        if ((nl = memchr(p, '\n', h->size - (p - h->text))) == NULL)
+            return;
+        at = nl + 1 - h->text;
+    }
+    if (at >= h->size)
+        return;
+    for (p = h->text + at; p < h->text + h->size; p = nl + 1)
+    {
+        if ((nl = memchr(p, '\n', h->size - (p - h->text))) == NULL)
+            break;
+        buf[k++] = p - h->text;
+        if (k == 512)
+        {
+            writeall(h->ifd, (char *)buf, sizeof(buf));
+            k = 0;
+        }
+    }
+    writeall(h->ifd, (char *)buf, k * sizeof(uint64_t));
+    hist_map();
 }
 
-/* maxjid - Returns largest allocated job ID */
-int maxjid(struct job_t *job_list)
+/*
+ * hist_open - Use path as the history file, making it if need be.
+ *    Returns 0, or -1 if it can't be opened (the editor still works,
+ *    without a history).
+ */
+int hist_open(const char *path)
 {
-    int i, max = 0;
+    struct history *h = &cmd_history;
+    char *ipath = malloc(strlen(path) + 5);
 
-    for (i = 0; i < MAXJOBS; i++)
-        if (job_list[i].jid > max)
-            max = job_list[i].jid;
-    return max;
+    if (ipath == NULL)
+        unix_error("malloc error");
+    sprintf(ipath, "%s.idx", path);
+    h->fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    h->ifd = open(ipath, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    free(ipath);
+    if (h->fd < 0 || h->ifd < 0)
+    {
+        if (h->fd >= 0)
+            close(h->fd);
+        if (h->ifd >= 0)
+            close(h->ifd);
+        h->fd = -1;
+        return -1;
+    }
+    flock(h->fd, LOCK_EX);
+    hist_index();
+    flock(h->fd, LOCK_UN);
+    return 0;
 }
 
-/* addjob - Add a job to the job list */
-int addjob(struct job_t *job_list, pid_t pid, int state, char *cmdline)
+/* hist_add - Append line to the history, unless it is blank or the same
+ * as the last one */
+void hist_add(const char *line)
 {
-    int i;
+    struct history *h = &cmd_history;
+    size_t len = strlen(line);
+    const char *last;
+    struct stat sb;
+    uint64_t at;
+    char *rec;
 
-    if (pid < 1)
-        return 0;
+    if (h->fd < 0 || line[strspn(line, " \t")] == '\0')
+        return;
+    if (h->n > 0 && hist_line(h->n - 1, &last) == len &&
+        !memcmp(last, line, len))
+        return;
+    if ((rec = malloc(len + 2)) == NULL)
+        unix_error("malloc error");
+    flock(h->fd, LOCK_EX);
+    hist_index(); /* take in what other shells added */
+    if (fstat(h->fd, &sb) == 0)
+    {
+        /* A line left unfinished by hand is ended first */
+        at = sb.st_size;
+        rec[0] = '\n';
+        memcpy(rec + 1, line, len);
+        rec[len + 1] = '\n';
+        if (at > 0 && h->text[at - 1] != '\n')
+        {
+            if (writeall(h->fd, rec, len + 2) == 0)
+            {
+                at++;
+                writeall(h->ifd, (char *)&at, sizeof(at));
+            }
+        }
+        else if (writeall(h->fd, rec + 1, len + 1) == 0)
+            writeall(h->ifd, (char *)&at, sizeof(at));
+    }
+    hist_map();
+    flock(h->fd, LOCK_UN);
+    free(rec);
+}
+
+/* hist_line - Point *text at history line i, and return its length */
+size_t hist_line(size_t i, const char **text)
+{
+    struct history *h = &cmd_history;
+    size_t end = i + 1 < h->n ? h->off[i + 1] : h->size;
+
+    *text = h->text + h->off[i];
+    return end - h->off[i] - 1;
+}
 
-    for (i = 0; i < MAXJOBS; i++)
+/*
+ * hist_search - Find the newest history line before line number before
+ *    that contains the plen bytes of pat, and return its number, or -1.
+ *    The mapped text is searched backwards a chunk at a time with
+ *    memmem(), and a match is turned into a line through the index, so
+ *    lines are never looked at one by one.
+ */
+long hist_search(const char *pat, size_t plen, size_t before)
+{
+    struct history *h = &cmd_history;
+    size_t hi, lo, chunk = HIST_CHUNK > 2 * plen ? HIST_CHUNK : 2 * plen;
+    const char *p, *found;
+    size_t a, b, m;
+
+    if (h->n == 0 || before == 0 || plen == 0)
+        return -1;
+    hi = before < h->n ? h->off[before] : h->size;
+    while (hi >= plen)
     {
-        if (job_list[i].pid == 0)
+        lo = hi > chunk ? hi - chunk : 0;
+        found = NULL;
+        for (p = h->text + lo;
+             (p = memmem(p, h->text + hi - p, pat, plen)) != NULL; p++)
+            found = p;
+        if (found != NULL)
         {
-            job_list[i].pid = pid;
-            job_list[i].state = state;
-            job_list[i].jid = nextjid++;
-            if (nextjid > MAXJOBS)
-                nextjid = 1;
-            strcpy(job_list[i].cmdline, cmdline);
-            if (verbose)
+            /* the line it is in: the last that starts at or before it */
+            for (a = 0, b = h->n; b - a > 1;)
             {
-                printf("Added job [%d] %d %s\n",
-                       job_list[i].jid,
-                       job_list[i].pid,
-                       job_list[i].cmdline);
+                m = (a + b) / 2;
+                if (h->off[m] <= (uint64_t)(found - h->text))
+                    a = m;
+                else
+                    b = m;
             }
-            return 1;
+            return a;
         }
+        if (lo == 0)
+            break;
+        hi = lo + plen - 1;
     }
-    printf("Tried to create too many jobs\n");
-    return 0;
+    return -1;
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *job_list, pid_t pid)
+/* edit_raw - Put the terminal in raw mode for editing, or back */
+static void edit_raw(int on)
 {
-    int i;
+    struct termios raw = line_edit.cooked;
 
-    if (pid < 1)
+    if (!on)
+    {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &line_edit.cooked);
+        return;
+    }
+    raw.c_iflag &= ~(ICRNL | IXON | BRKINT | ISTRIP | INPCK);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+}
+
+/* edit_atexit - Leave the terminal as the editor found it */
+static void edit_atexit(void)
+{
+    if (line_edit.on)
+        edit_raw(0);
+}
+
+/*
+ * edit_begin - Turn the line editor on if commands come from a terminal
+ *    (and $TERM is not dumb), with the history in $TSH_HISTORY, else in
+ *    ~/.tsh_history. Returns 1 if it is on.
+ */
+int edit_begin(void)
+{
+    const char *term = getenv("TERM"), *path = getenv("TSH_HISTORY");
+    char *home, buf[PATH_MAX];
+
+    if (cmd_input.fd != STDIN_FILENO || !isatty(STDIN_FILENO) ||
+        !isatty(STDOUT_FILENO) || (term != NULL && !strcmp(term, "dumb")) ||
+        tcgetattr(STDIN_FILENO, &line_edit.cooked) < 0)
         return 0;
+    if (path == NULL && (home = getenv("HOME")) != NULL)
+    {
+        snprintf(buf, sizeof(buf), "%s/.tsh_history", home);
+        path = buf;
+    }
+    if (path != NULL && *path != '\0')
+        hist_open(path);
+    line_edit.cap = 256;
+    if ((line_edit.buf = malloc(line_edit.cap)) == NULL)
+        unix_error("malloc error");
+    line_edit.on = 1;
+    atexit(edit_atexit);
+    return 1;
+}
+
+/* edit_key - The next byte typed, taken from the command reader's buffer
+ * first, so nothing read ahead is lost; -1 at end of input */
+static int edit_key(void)
+{
+    struct linereader *lr = &cmd_input;
+    ssize_t n;
+    int c;
 
-    for (i = 0; i < MAXJOBS; i++)
+    while (lr->start == lr->end)
     {
-        if (job_list[i].pid == pid)
+        lr->start = lr->scan = lr->end = 0;
+        fflush(stdout);
+        if (sigchld_fd >= 0 || captures.n > 0)
+            wait_input(lr->fd);
+        n = read(lr->fd, lr->buf, lr->block);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
         {
-            clearjob(&job_list[i]);
-            nextjid = maxjid(job_list) + 1;
-            return 1;
+            lr->eof = 1;
+            return -1;
         }
+        lr->end = n;
     }
-    return 0;
+    c = (unsigned char)lr->buf[lr->start++];
+    if (lr->scan < lr->start)
+        lr->scan = lr->start;
+    return c;
 }
 
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *job_list)
+/* edit_set - Make the line the n bytes at text, the cursor at its end */
+static void edit_set(const char *text, size_t n)
 {
-    int i;
+    struct lineedit *e = &line_edit;
 
-    for (i = 0; i < MAXJOBS; i++)
-        if (job_list[i].state == FG)
-            return job_list[i].pid;
-    return 0;
+    if (n + 1 > e->cap)
+    {
+        e->cap = 2 * (n + 1);
+        if ((e->buf = realloc(e->buf, e->cap)) == NULL)
+            unix_error("realloc error");
+    }
+    memmove(e->buf, text, n);
+    e->len = e->pos = n;
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *job_list, pid_t pid)
+/* edit_recall - Make the line history line i */
+static void edit_recall(size_t i)
 {
-    int i;
+    const char *text;
+    size_t n = hist_line(i, &text);
 
-    if (pid < 1)
-        return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (job_list[i].pid == pid)
-            return &job_list[i];
-    return NULL;
+    edit_set(text, n);
 }
 
-/* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *job_list, int jid)
+/* edit_show - Redraw the prompt and the line, or the part of it around
+ * the cursor that fits the terminal, in one write */
+static void edit_show(const char *prompt)
 {
-    int i;
+    struct lineedit *e = &line_edit;
+    struct winsize ws;
+    struct outbuf ob;
+    char buf[4096];
+    size_t cols = 80, plen = strlen(prompt), start = 0, show;
 
-    if (jid < 1)
-        return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (job_list[i].jid == jid)
-            return &job_list[i];
-    return NULL;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+        cols = ws.ws_col;
+    show = cols > plen + 1 ? cols - plen - 1 : 1;
+    if (e->pos > show)
+        start = e->pos - show;
+    if (e->len - start < show)
+        show = e->len - start;
+    ob_init(&ob, STDOUT_FILENO, buf, sizeof(buf));
+    ob_puts(&ob, "\r");
+    ob_puts(&ob, prompt);
+    ob_write(&ob, e->buf + start, show);
+    ob_puts(&ob, "\x1b[K");
+    if (start + show > e->pos)
+    {
+        ob_puts(&ob, "\x1b[");
+        ob_putl(&ob, start + show - e->pos);
+        ob_puts(&ob, "D");
+    }
+    ob_flush(&ob);
 }
 
-/* pid2jid - Map process ID to job ID */
-int pid2jid(pid_t pid)
+/* edit_search - ctrl-r: search the history for what is typed, newest
+ * first, ctrl-r again for older matches. Returns the key that ended the
+ * search, with the match (if any) made the line; ctrl-g or ctrl-c put
+ * the line back as it was */
+static int edit_search(void)
 {
-    int i;
+    struct lineedit *e = &line_edit;
+    char pat[256], prompt[320];
+    size_t plen = 0, saved_len = e->len;
+    char *saved = malloc(e->len + 1);
+    long at, found = -1;
+    int c;
 
-    if (pid < 1)
-        return 0;
-    for (i = 0; i < MAXJOBS; i++)
-        if (job_list[i].pid == pid)
+    if (saved == NULL)
+        unix_error("malloc error");
+    memcpy(saved, e->buf, e->len);
+    while (1)
+    {
+        snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%.*s': ",
+                 plen > 0 && found < 0 ? "failed " : "", (int)plen, pat);
+        edit_show(prompt);
+        c = edit_key();
+        if (c == 18) /* ctrl-r: an older match */
         {
-            return job_list[i].jid;
+            if (found > 0 && (at = hist_search(pat, plen, found)) >= 0)
+                found = at;
         }
-    return 0;
+        else if (c == 127 || c == 8) /* backspace: search again */
+        {
+            if (plen > 0)
+                plen--;
+            found = hist_search(pat, plen, cmd_history.n);
+        }
+        else if (c >= 32 && c < 127 && plen < sizeof(pat))
+        {
+            pat[plen++] = c;
+            found = hist_search(pat, plen,
+                                found >= 0 ? (size_t)found + 1 : cmd_history.n);
+        }
+        else
+            break;
+        if (found >= 0)
+            edit_recall(found);
+    }
+    if (c == 7 || c == 3)
+        edit_set(saved, saved_len);
+    free(saved);
+    return c;
 }
 
-/* listjobs - Print the job list */
-void listjobs(struct job_t *job_list, int output_fd)
+/*
+ * edit_line - Read a command line from the terminal, showing prompt, with
+ *    editing: the arrows, ctrl-a/e/b/f to move, backspace, ctrl-d, ctrl-k,
+ *    ctrl-u and ctrl-w to delete, up/down or ctrl-p/n for the history and
+ *    ctrl-r to search it, ctrl-c to drop the line, ctrl-l to clear the
+ *    screen. Returns the line (added to the history), or NULL at end of
+ *    input. It stays valid until the next call.
+ */
+char *edit_line(const char *prompt)
 {
-    int i;
-    char buf[MAXLINE_TSH];
+    struct lineedit *e = &line_edit;
+    size_t hpos = cmd_history.n, draft_len = 0, w;
+    char *draft = NULL;
+    int c;
 
-    for (i = 0; i < MAXJOBS; i++)
+    fflush(stdout);
+    edit_raw(1);
+    e->len = e->pos = 0;
+    edit_show(prompt);
+    while (1)
     {
-        memset(buf, '\0', MAXLINE_TSH);
-        if (job_list[i].pid != 0)
+        c = edit_key();
+        if (c == 18)
+            c = edit_search();
+        if (c < 0 || (c == 4 && e->len == 0)) /* end of input, ctrl-d */
         {
-            sprintf(buf, "[%d] (%d) ", job_list[i].jid, job_list[i].pid);
-            if (write(output_fd, buf, strlen(buf)) < 0)
+            edit_raw(0);
+            free(draft);
+            return NULL;
+        }
+        switch (c)
+        {
+        case '\r':
+        case '\n':
+            goto done;
+        case 3: /* ctrl-c: a fresh line */
+            writeall(STDOUT_FILENO, "^C\r\n", 4);
+            e->len = e->pos = 0;
+            hpos = cmd_history.n;
+            break;
+        case 1: /* ctrl-a */
+            e->pos = 0;
+            break;
+        case 5: /* ctrl-e */
+            e->pos = e->len;
+            break;
+        case 2: /* ctrl-b */
+            if (e->pos > 0)
+                e->pos--;
+            break;
+        case 6: /* ctrl-f */
+            if (e->pos < e->len)
+                e->pos++;
+            break;
+        case 127: /* backspace */
+        case 8:
+            if (e->pos == 0)
+                break;
+            e->pos--;
+            /* fall through */
+        case 4: /* ctrl-d: delete under the cursor */
+            if (e->pos < e->len)
             {
-                fprintf(stderr, "Error writing to output file\n");
-                exit(1);
+                memmove(e->buf + e->pos, e->buf + e->pos + 1,
+                        e->len - e->pos - 1);
+                e->len--;
             }
-            memset(buf, '\0', MAXLINE_TSH);
-            switch (job_list[i].state)
+            break;
+        case 11: /* ctrl-k */
+            e->len = e->pos;
+            break;
+        case 21: /* ctrl-u */
+            memmove(e->buf, e->buf + e->pos, e->len - e->pos);
+            e->len -= e->pos;
+            e->pos = 0;
+            break;
+        case 23: /* ctrl-w: the word before the cursor */
+            for (w = e->pos; w > 0 && e->buf[w - 1] == ' '; w--)
+                ;
+            while (w > 0 && e->buf[w - 1] != ' ')
+                w--;
+            memmove(e->buf + w, e->buf + e->pos, e->len - e->pos);
+            e->len -= e->pos - w;
+            e->pos = w;
+            break;
+        case 12: /* ctrl-l */
+            writeall(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+            break;
+        case 16: /* ctrl-p */
+        case 14: /* ctrl-n */
+        case 27: /* an escape sequence: the arrows */
+            if (c == 27)
             {
-            case BG:
-                sprintf(buf, "Running    ");
-                break;
-
-            case FG:
-                sprintf(buf, "Foreground ");
-                break;
-            case ST:
-                sprintf(buf, "Stopped    ");
-                break;
-            default:
-                sprintf(buf, "listjobs: Internal error: job[%d].state=%d ",
-                        i, job_list[i].state);
+                if (edit_key() != '[')
+                    break;
+                c = edit_key();
+                if (c == 'C' && e->pos < e->len)
+                    e->pos++;
+                else if (c == 'D' && e->pos > 0)
+                    e->pos--;
+                else if (c == 'H')
+                    e->pos = 0;
+                else if (c == 'F')
+                    e->pos = e->len;
+                if (c != 'A' && c != 'B')
+                    break;
+                c = c == 'A' ? 16 : 14;
             }
-            if (write(output_fd, buf, strlen(buf)) < 0)
+            // keep what was being typed, to come back to past the newest
+            if (hpos == cmd_history.n)
             {
-                fprintf(stderr, "Error writing to output file\n");
-                exit(1);
+                free(draft);
+                if ((draft = malloc(e->len + 1)) == NULL)
+                    unix_error("malloc error");
+                memcpy(draft, e->buf, e->len);
+                draft_len = e->len;
             }
-            memset(buf, '\0', MAXLINE_TSH);
-            sprintf(buf, "%s\n", job_list[i].cmdline);
-            if (write(output_fd, buf, strlen(buf)) < 0)
+            if (c == 16 && hpos > 0)
+                hpos--;
+            else if (c == 14 && hpos < cmd_history.n)
+                hpos++;
+            else
+                break;
+            if (hpos < cmd_history.n)
+                edit_recall(hpos);
+            else
+                edit_set(draft, draft_len);
+            break;
+        default:
+            if (c < 32)
+                break;
+            if (e->len + 2 > e->cap)
             {
-                fprintf(stderr, "Error writing to output file\n");
-                exit(1);
+                e->cap *= 2;
+                if ((e->buf = realloc(e->buf, e->cap)) == NULL)
+                    unix_error("realloc error");
             }
+            memmove(e->buf + e->pos + 1, e->buf + e->pos, e->len - e->pos);
+            e->buf[e->pos++] = c;
+            e->len++;
         }
+        edit_show(prompt);
     }
+
+done:
+    e->pos = e->len;
+    edit_show(prompt);
+    writeall(STDOUT_FILENO, "\r\n", 2);
+    edit_raw(0);
+    free(draft);
+    e->buf[e->len] = '\0';
+    hist_add(e->buf);
+    return e->buf;
 }
-/******************************
- * end job list helper routines
- ******************************/
+
+/**************************************
+ * end line editor routines
+ **************************************/
 
 /***********************
  * Other helper routines
  ***********************/
 
+/*
+ * arena_alloc - Hand out n bytes from the arena, 16-byte aligned. A new
+ *    chunk is only allocated when none of the kept ones has room.
+ */
+void *arena_alloc(struct arena *a, size_t n)
+{
+    struct arena_chunk *c = a->cur;
+    size_t size;
+
+    n = (n + 15) & ~(size_t)15;
+    while (c == NULL || c->size - c->used < n)
+    {
+        if (c != NULL && c->next != NULL)
+        {
+            /* Reuse a chunk kept from an earlier command */
+            c = c->next;
+            c->used = 0;
+            continue;
+        }
+        size = n > ARENACHUNK ? n : ARENACHUNK;
+        if (c != NULL && size < 2 * c->size)
+            size = 2 * c->size;
+        struct arena_chunk *fresh = malloc(sizeof(*fresh) + size);
+        if (fresh == NULL)
+            unix_error("malloc error");
+        fresh->next = NULL;
+        fresh->size = size;
+        fresh->used = 0;
+        if (c != NULL)
+            c->next = fresh;
+        else
+            a->head = fresh;
+        c = fresh;
+    }
+    a->cur = c;
+    a->last = c->data + c->used;
+    c->used += n;
+    return a->last;
+}
+
+/*
+ * arena_grow - Resize old, which holds oldsize bytes, to newsize bytes.
+ *    The most recent allocation grows in place when its chunk has room;
+ *    otherwise the contents move to a fresh allocation.
+ */
+void *arena_grow(struct arena *a, void *old, size_t oldsize, size_t newsize)
+{
+    struct arena_chunk *c = a->cur;
+    size_t oldn = (oldsize + 15) & ~(size_t)15;
+    size_t newn = (newsize + 15) & ~(size_t)15;
+    void *fresh;
+
+    if (old == a->last && c->size - (c->used - oldn) >= newn)
+    {
+        c->used += newn - oldn;
+        return old;
+    }
+    fresh = arena_alloc(a, newsize);
+    memcpy(fresh, old, oldsize);
+    return fresh;
+}
+
+/*
+ * arena_mark - Remember how full the arena is
+ */
+struct arena_mark arena_mark(struct arena *a)
+{
+    struct arena_mark mark;
+
+    mark.chunk = a->cur;
+    mark.used = a->cur ? a->cur->used : 0;
+    return mark;
+}
+
+/*
+ * arena_release - Give back everything allocated since mark was taken.
+ *    The chunks are kept for the next allocations.
+ */
+void arena_release(struct arena *a, struct arena_mark mark)
+{
+    a->cur = mark.chunk ? mark.chunk : a->head;
+    if (a->cur)
+        a->cur->used = mark.chunk ? mark.used : 0;
+    a->last = NULL;
+}
+
+/*
+ * initreader - Set up a line reader on fd, reading block bytes at a time
+ */
+void initreader(struct linereader *lr, int fd, size_t block)
+{
+    lr->fd = fd;
+    lr->block = block;
+    lr->cap = block + 1;
+    if ((lr->buf = malloc(lr->cap)) == NULL)
+        unix_error("malloc error");
+    lr->start = lr->scan = lr->end = 0;
+    lr->eof = 0;
+    lr->lines = 0;
+}
+
+/*
+ * readline_src - Return the next line without its newline, or NULL at
+ *    end of input. A final line without a newline is still returned.
+ */
+char *readline_src(struct linereader *lr)
+{
+    char *nl, *line;
+    ssize_t n;
+
+    while (1)
+    {
+        /* A complete line is already buffered */
+        nl = memchr(lr->buf + lr->scan, '\n', lr->end - lr->scan);
+        if (nl != NULL)
+        {
+            *nl = '\0';
+            line = lr->buf + lr->start;
+            lr->start = lr->scan = nl - lr->buf + 1;
+            lr->lines++;
+            return line;
+        }
+        lr->scan = lr->end;
+
+        if (lr->eof)
+        {
+            if (lr->start == lr->end)
+                return NULL;
+            lr->buf[lr->end] = '\0';
+            line = lr->buf + lr->start;
+            lr->start = lr->scan = lr->end;
+            lr->lines++;
+            return line;
+        }
+
+        /* Move the partial line to the front, growing for long lines */
+        if (lr->start > 0)
+        {
+            memmove(lr->buf, lr->buf + lr->start, lr->end - lr->start);
+            lr->end -= lr->start;
+            lr->scan -= lr->start;
+            lr->start = 0;
+        }
+        if (lr->cap - lr->end < lr->block + 1)
+        {
+            char *grown = realloc(lr->buf, lr->end + lr->block + 1);
+            if (grown == NULL)
+                unix_error("realloc error");
+            lr->buf = grown;
+            lr->cap = lr->end + lr->block + 1;
+        }
+
+        if (sigchld_fd >= 0 || captures.n > 0)
+            wait_input(lr->fd);
+        n = read(lr->fd, lr->buf + lr->end, lr->block);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            app_error("read error");
+        if (n == 0)
+            lr->eof = 1;
+        lr->end += n;
+    }
+}
+
 /*
  * usage - print a help message
  */
 void usage(void)
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpsebq] [-f script] [-o done|submit] "
+           "[-t tracefile] [-a auditfile | -a unix:socket]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -s   launch external commands with posix_spawn, not fork\n");
+    printf("   -e   reap children in the main loop through a signalfd\n");
+    printf("   -b   report stopped and killed jobs at once, not before\n");
+    printf("        the next prompt\n");
+    printf("   -q   do not report stopped and killed jobs\n");
+    printf("   -f   run the commands in script in batch mode, parsing\n");
+    printf("        it once and caching the tokens in script.tshc\n");
+    printf("   -o   buffer each background job's output, and write it\n");
+    printf("        once the job is done, in the order they finish or\n");
+    printf("        in the order they were started\n");
+    printf("   -t   trace eval, launches and reaping, and write the\n");
+    printf("        trace to tracefile at exit (Chrome trace JSON)\n");
+    printf("   -a   append a JSON line for every job start, stop and end\n");
+    printf("        to auditfile, or send them to a datagram socket\n");
+#ifdef TSH_CHECK
+    printf("   -r   replay the driver trace tracefile against the shell,\n");
+    printf("        checking the job table after every reap\n");
+#endif
     exit(1);
 }